@@ -0,0 +1,1726 @@
+// benchmarks for the matrix kernels and the network passes
+//
+// usage: bench [--json] [--quick] [--threads N] [--isa scalar|sse2|avx2|avx512]
+//              [--check]
+// prints a table, or one JSON object per measurement with --json; --check
+// only compares the specialized passes of topology.c, the pipeline passes,
+// checkpointed backpropagation and a data parallel step with the generic
+// ones, and checks the random number generator, zero-copy checkpoint
+// loading and model hot-swapping
+
+#include "network.h"
+#include "optimizer.h"
+#include "dataparallel.h"
+#include "hogwild.h"
+#include "pipeline.h"
+#include "random.h"
+#include "topology.h"
+#include "checkpoint.h"
+#include "quantize.h"
+#include "server.h"
+#include "hotswap.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// minimum time spent repeating each measurement
+#define MIN_SECONDS 0.2
+#define QUICK_MIN_SECONDS 0.02
+// samples the specialized passes are checked on, and the largest relative
+// difference from the generic passes allowed
+#define CHECK_STEPS 20
+#define CHECK_TOLERANCE (sizeof(real) == sizeof(double) ? 1e-12 : 1e-4)
+
+typedef struct BenchOptions {
+  unsigned int json;
+  double min_seconds;
+} BenchOptions;
+
+typedef struct BenchResult {
+  double ns_per_op;
+  double allocations_per_op;
+} BenchResult;
+
+typedef void (*bench_op)(void* context);
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static BenchResult time_op(BenchOptions* options, bench_op op, void* context) {
+  // warm up once, then double the repetitions until the run is long enough
+  op(context);
+  unsigned long reps = 1;
+  for (;;) {
+    unsigned long start_allocations = allocation_count();
+    double start = now_seconds();
+    for (unsigned long r = 0; r < reps; r++) {
+      op(context);
+    }
+    double elapsed = now_seconds() - start;
+    if (elapsed >= options->min_seconds || reps >= (1UL << 30)) {
+      BenchResult result;
+      result.ns_per_op = elapsed * 1e9 / reps;
+      result.allocations_per_op = (
+        (double)(allocation_count() - start_allocations) / reps
+      );
+      return result;
+    }
+    reps *= 2;
+  }
+}
+
+static void report(
+  BenchOptions* options, const char* name, unsigned int width,
+  unsigned int depth, unsigned int batch, BenchResult result, double flops,
+  double samples
+) {
+  // flops and samples are per operation, 0 when they do not apply
+  double gflops = flops / result.ns_per_op;
+  double samples_per_sec = samples * 1e9 / result.ns_per_op;
+  if (options->json) {
+    printf("{\"benchmark\": \"%s\", \"width\": %u, \"depth\": %u, "
+    "\"batch\": %u, \"precision_bytes\": %u, \"isa\": \"%s\", "
+    "\"threads\": %u, \"ns_per_op\": %.1f, \"gflops\": %.3f, "
+    "\"samples_per_sec\": %.1f, \"allocations_per_op\": %.3f}\n",
+    name, width, depth, batch, (unsigned int)sizeof(real),
+    kernel_isa_name(kernel_isa()), get_num_threads(), result.ns_per_op,
+    gflops, samples_per_sec, result.allocations_per_op);
+  } else {
+    printf("%-16s %6u %5u %5u %14.1f %9.3f %14.1f %9.3f\n",
+    name, width, depth, batch, result.ns_per_op, gflops, samples_per_sec,
+    result.allocations_per_op);
+  }
+  fflush(stdout);
+}
+
+static void randomise_matrix(Matrix* mat) {
+  for (unsigned int r = 0; r < mat->rows; r++) {
+    for (unsigned int c = 0; c < mat->columns; c++) {
+      set_element(mat, r, c, random_normal());
+    }
+  }
+}
+
+// matrix kernels
+
+typedef struct KernelContext {
+  Matrix* a;
+  Matrix* b;
+  Matrix* c;
+  Matrix* column_a;
+  Matrix* column_b;
+} KernelContext;
+
+static void op_multiply(void* context) {
+  KernelContext* k = (KernelContext*)context;
+  free_matrix(multiply(k->a, k->b));
+}
+
+static void op_gemm(void* context) {
+  KernelContext* k = (KernelContext*)context;
+  gemm(k->a, k->b, k->c);
+}
+
+static void op_gemv(void* context) {
+  KernelContext* k = (KernelContext*)context;
+  gemv(k->a, k->column_a, k->column_b);
+}
+
+static void op_transpose(void* context) {
+  KernelContext* k = (KernelContext*)context;
+  transpose(k->a, k->c);
+}
+
+static void op_outer_product(void* context) {
+  KernelContext* k = (KernelContext*)context;
+  outer_product(k->column_a, k->column_b, k->c);
+}
+
+static void op_add(void* context) {
+  KernelContext* k = (KernelContext*)context;
+  add(k->a, k->b, k->c);
+}
+
+static void op_hadamard(void* context) {
+  KernelContext* k = (KernelContext*)context;
+  hadamard_product(k->a, k->b, k->c);
+}
+
+static void bench_kernels(BenchOptions* options, unsigned int width) {
+  KernelContext k;
+  k.a = create_empty_matrix(width, width);
+  k.b = create_empty_matrix(width, width);
+  k.c = create_empty_matrix(width, width);
+  k.column_a = create_empty_matrix(width, 1);
+  k.column_b = create_empty_matrix(width, 1);
+  randomise_matrix(k.a);
+  randomise_matrix(k.b);
+  randomise_matrix(k.column_a);
+  randomise_matrix(k.column_b);
+  double n = width;
+  report(options, "multiply", width, 0, 0,
+    time_op(options, op_multiply, &k), 2*n*n*n, 0);
+  report(options, "gemm", width, 0, 0,
+    time_op(options, op_gemm, &k), 2*n*n*n, 0);
+  report(options, "gemv", width, 0, 0,
+    time_op(options, op_gemv, &k), 2*n*n, 0);
+  report(options, "transpose", width, 0, 0,
+    time_op(options, op_transpose, &k), 0, 0);
+  report(options, "outer_product", width, 0, 0,
+    time_op(options, op_outer_product, &k), n*n, 0);
+  report(options, "add", width, 0, 0,
+    time_op(options, op_add, &k), n*n, 0);
+  report(options, "hadamard", width, 0, 0,
+    time_op(options, op_hadamard, &k), n*n, 0);
+  free_matrix(k.a);
+  free_matrix(k.b);
+  free_matrix(k.c);
+  free_matrix(k.column_a);
+  free_matrix(k.column_b);
+}
+
+// network passes
+
+typedef struct NetworkContext {
+  Network net;
+  double* input;
+  double* target_output;
+} NetworkContext;
+
+static void op_forward(void* context) {
+  NetworkContext* n = (NetworkContext*)context;
+  forward_pass(&n->net, n->input, n->target_output);
+}
+
+static void op_backward(void* context) {
+  // tiny learning rates keep the weights steady over many repetitions
+  NetworkContext* n = (NetworkContext*)context;
+  backpropagate(&n->net, 1e-9, 1e-9);
+}
+
+static void op_train_step(void* context) {
+  op_forward(context);
+  op_backward(context);
+}
+
+static double forward_flops(Network* net) {
+  // multiply-adds of the weight layers for one sample
+  double flops = 0;
+  for (unsigned int l = 0; l + 1 < net->num_layers; l++) {
+    flops += 2.0 * net->num_nodes[l] * net->num_nodes[l+1];
+  }
+  return flops;
+}
+
+static double backward_flops(Network* net) {
+  // weight gradient and transposed product of every hidden layer for one
+  // sample, the input layer's weights are not trained
+  double flops = 0;
+  for (unsigned int l = 1; l + 1 < net->num_layers; l++) {
+    flops += 4.0 * net->num_nodes[l] * net->num_nodes[l+1];
+  }
+  return flops;
+}
+
+static void bench_network(
+  BenchOptions* options, unsigned int width, unsigned int depth,
+  unsigned int batch
+) {
+  NetworkContext n;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  initialise_batch_network(&n.net, depth, num_nodes, batch, 0);
+  randomise_network(&n.net);
+  n.input = (double*)malloc(sizeof(double) * width * batch);
+  n.target_output = (double*)malloc(sizeof(double) * width * batch);
+  for (unsigned int i = 0; i < width * batch; i++) {
+    n.input[i] = random_normal();
+    n.target_output[i] = random_normal();
+  }
+  double forward = forward_flops(&n.net) * batch;
+  double backward = backward_flops(&n.net) * batch;
+  report(options, "forward_pass", width, depth, batch,
+    time_op(options, op_forward, &n), forward, batch);
+  report(options, "backpropagate", width, depth, batch,
+    time_op(options, op_backward, &n), backward, batch);
+  report(options, "train_step", width, depth, batch,
+    time_op(options, op_train_step, &n), forward + backward, batch);
+  initialise_batch_network(&n.net, depth, num_nodes, batch, 1);
+  free(n.input);
+  free(n.target_output);
+  free(num_nodes);
+}
+
+// optimizer steps
+
+typedef struct OptimizerContext {
+  Network net;
+  Optimizer optimizer;
+} OptimizerContext;
+
+static void op_optimizer_step(void* context) {
+  OptimizerContext* o = (OptimizerContext*)context;
+  optimizer_step(&o->optimizer, &o->net);
+}
+
+static void bench_optimizers(
+  BenchOptions* options, unsigned int width, unsigned int depth
+) {
+  // one update of the whole slab from a fixed gradient, the flops are
+  // counted for every element of the slab
+  OptimizerContext o;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  initialise_network(&o.net, depth, num_nodes, 0);
+  randomise_network(&o.net);
+  for (size_t i = 0; i < o.net.num_parameters; i++) {
+    o.net.gradients[i] = random_normal() * 1e-3;
+  }
+  double parameters = (double)o.net.num_parameters;
+  double flops_per_parameter[] = {2, 4, 6, 16, 16};
+  char name[32];
+  for (unsigned int t = OPTIMIZER_SGD; t <= OPTIMIZER_ADAMW; t++) {
+    initialise_optimizer(&o.optimizer, &o.net, t, 1e-9, 0);
+    snprintf(name, sizeof(name), "%s_step", optimizer_name(t));
+    report(options, name, width, depth, 0,
+      time_op(options, op_optimizer_step, &o),
+      parameters * flops_per_parameter[t], 0);
+    initialise_optimizer(&o.optimizer, &o.net, t, 0, 1);
+  }
+  initialise_network(&o.net, depth, num_nodes, 1);
+  free(num_nodes);
+}
+
+// data parallel training
+
+static void bench_data_parallel(
+  BenchOptions* options, unsigned int width, unsigned int depth,
+  unsigned int batch, unsigned int num_workers
+) {
+  // every worker runs the same number of steps, so the count is fixed
+  // from a single process step before forking; batch is per worker
+  NetworkContext n;
+  Optimizer optimizer;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  initialise_batch_network(&n.net, depth, num_nodes, batch, 0);
+  randomise_network(&n.net);
+  initialise_optimizer(&optimizer, &n.net, OPTIMIZER_SGD, 1e-9, 0);
+  n.input = (double*)malloc(sizeof(double) * width * batch);
+  n.target_output = (double*)malloc(sizeof(double) * width * batch);
+  for (unsigned int i = 0; i < width * batch; i++) {
+    n.input[i] = random_normal();
+    n.target_output[i] = random_normal();
+  }
+  double start = now_seconds();
+  forward_pass(&n.net, n.input, n.target_output);
+  optimise(&optimizer, &n.net);
+  unsigned long reps = options->min_seconds / (now_seconds() - start) + 1;
+  DataParallel dp;
+  start_data_parallel(&dp, &n.net, num_workers);
+  unsigned long start_allocations = allocation_count();
+  start = now_seconds();
+  for (unsigned long r = 0; r < reps; r++) {
+    forward_pass(&n.net, n.input, n.target_output);
+    data_parallel_step(&dp, &optimizer);
+  }
+  BenchResult result;
+  result.allocations_per_op = (
+    (double)(allocation_count() - start_allocations) / reps
+  );
+  result.ns_per_op = (now_seconds() - start) * 1e9 / reps;
+  finish_data_parallel(&dp);
+  char name[32];
+  snprintf(name, sizeof(name), "data_parallel_%u", num_workers);
+  double samples = (double)batch * num_workers;
+  report(options, name, width, depth, batch, result,
+    (forward_flops(&n.net) + backward_flops(&n.net)) * samples, samples);
+  initialise_optimizer(&optimizer, &n.net, OPTIMIZER_SGD, 0, 1);
+  initialise_batch_network(&n.net, depth, num_nodes, batch, 1);
+  free(n.input);
+  free(n.target_output);
+  free(num_nodes);
+}
+
+// Hogwild training
+
+// a student network learning a fixed teacher network: the samples it
+// trains on, the held-out samples it is scored on, and the samples seen
+// per thread configuration
+#define HOGWILD_SAMPLES 4096
+#define HOGWILD_HELD_OUT 512
+#define HOGWILD_BUDGET 65536
+#define HOGWILD_LEARNING_RATE 0.01
+
+static void scale_weights(Network* net) {
+  // N(0, 1/fan-in) weights keep the activations away from atan's tails
+  for (unsigned int l = 0; l + 1 < net->num_layers; l++) {
+    Matrix* weights = net->layers[l].weights;
+    double scale = 1 / sqrt((double)weights->columns);
+    for (unsigned int r = 0; r < weights->rows; r++) {
+      real* row = get_row_data(weights, r);
+      for (unsigned int c = 0; c < weights->columns; c++) {
+        row[c] *= scale;
+      }
+    }
+  }
+}
+
+static double held_out_loss(
+  Network* net, double* samples, double* targets, unsigned int count
+) {
+  // mean squared error per output through predict()
+  unsigned int inputs = net->num_nodes[0];
+  unsigned int outputs = net->num_nodes[net->num_layers-1];
+  double* output = (double*)malloc(sizeof(double) * outputs);
+  double loss = 0;
+  for (unsigned int s = 0; s < count; s++) {
+    predict(net, samples + (size_t)s * inputs, output);
+    for (unsigned int o = 0; o < outputs; o++) {
+      double error = output[o] - targets[(size_t)s * outputs + o];
+      loss += error * error;
+    }
+  }
+  free(output);
+  return loss / ((double)count * outputs);
+}
+
+static void bench_hogwild(
+  BenchOptions* options, unsigned int width, unsigned int depth,
+  unsigned int batch, unsigned int num_threads
+) {
+  // the same student from the same start trains on the same number of
+  // samples, in a single-threaded loop when num_threads is 0 and with
+  // Hogwild otherwise; reports throughput and the held-out loss reached
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  unsigned int total = HOGWILD_SAMPLES + HOGWILD_HELD_OUT;
+  double* samples = (double*)malloc(sizeof(double) * width * total);
+  double* targets = (double*)malloc(sizeof(double) * width * total);
+  Network teacher, net;
+  srand(2);
+  initialise_inference_network(&teacher, depth, num_nodes, 0);
+  randomise_network(&teacher);
+  scale_weights(&teacher);
+  for (unsigned int i = 0; i < width * total; i++) {
+    samples[i] = random_normal();
+  }
+  for (unsigned int s = 0; s < total; s++) {
+    predict(
+      &teacher, samples + (size_t)s * width, targets + (size_t)s * width
+    );
+  }
+  // the student starts from the teacher's untrained input layer
+  initialise_batch_network(&net, depth, num_nodes, batch, 0);
+  randomise_network(&net);
+  scale_weights(&net);
+  copy_matrix(teacher.layers[0].weights, net.layers[0].weights);
+  double* held_out = samples + (size_t)HOGWILD_SAMPLES * width;
+  double* held_out_targets = targets + (size_t)HOGWILD_SAMPLES * width;
+  double start_loss = held_out_loss(
+    &net, held_out, held_out_targets, HOGWILD_HELD_OUT
+  );
+  unsigned int threads = num_threads ? num_threads : 1;
+  unsigned long steps = HOGWILD_BUDGET / ((unsigned long)batch * threads);
+  BenchResult result;
+  double start;
+  if (num_threads) {
+    Hogwild hogwild;
+    initialise_hogwild(
+      &hogwild, &net, num_threads, batch, OPTIMIZER_SGD,
+      HOGWILD_LEARNING_RATE, 0
+    );
+    unsigned long start_allocations = allocation_count();
+    start = now_seconds();
+    hogwild_train(&hogwild, samples, targets, HOGWILD_SAMPLES, steps);
+    result.ns_per_op = (now_seconds() - start) * 1e9 / steps;
+    result.allocations_per_op = (
+      (double)(allocation_count() - start_allocations) / steps
+    );
+    initialise_hogwild(
+      &hogwild, &net, num_threads, batch, OPTIMIZER_SGD, 0, 1
+    );
+  } else {
+    Optimizer optimizer;
+    initialise_optimizer(
+      &optimizer, &net, OPTIMIZER_SGD, HOGWILD_LEARNING_RATE, 0
+    );
+    double* input = (double*)malloc(sizeof(double) * width * batch);
+    double* target_output = (double*)malloc(sizeof(double) * width * batch);
+    unsigned long start_allocations = allocation_count();
+    start = now_seconds();
+    for (unsigned long s = 0; s < steps; s++) {
+      for (unsigned int b = 0; b < batch; b++) {
+        size_t sample = (s * batch + b) % HOGWILD_SAMPLES;
+        for (unsigned int r = 0; r < width; r++) {
+          input[(size_t)r * batch + b] = samples[sample * width + r];
+          target_output[(size_t)r * batch + b] = targets[sample * width + r];
+        }
+      }
+      forward_pass(&net, input, target_output);
+      optimise(&optimizer, &net);
+    }
+    result.ns_per_op = (now_seconds() - start) * 1e9 / steps;
+    result.allocations_per_op = (
+      (double)(allocation_count() - start_allocations) / steps
+    );
+    initialise_optimizer(&optimizer, &net, OPTIMIZER_SGD, 0, 1);
+    free(input);
+    free(target_output);
+  }
+  double loss = held_out_loss(
+    &net, held_out, held_out_targets, HOGWILD_HELD_OUT
+  );
+  // one op is a step of every thread
+  double samples_per_op = (double)batch * threads;
+  char name[32];
+  if (num_threads) {
+    snprintf(name, sizeof(name), "hogwild_%u", num_threads);
+  } else {
+    snprintf(name, sizeof(name), "sequential_sgd");
+  }
+  report(options, name, width, depth, batch, result,
+    (forward_flops(&net) + backward_flops(&net)) * samples_per_op,
+    samples_per_op);
+  if (options->json) {
+    printf("{\"benchmark\": \"%s_loss\", \"width\": %u, \"depth\": %u, "
+    "\"batch\": %u, \"samples\": %lu, \"start_loss\": %.6f, "
+    "\"held_out_loss\": %.6f}\n",
+    name, width, depth, batch, steps * batch * threads, start_loss, loss);
+  } else {
+    printf("%-16s held-out loss %.6f after %lu samples, from %.6f\n",
+    name, loss, steps * batch * threads, start_loss);
+  }
+  initialise_batch_network(&net, depth, num_nodes, batch, 1);
+  initialise_inference_network(&teacher, depth, num_nodes, 1);
+  free(samples);
+  free(targets);
+  free(num_nodes);
+}
+
+// inference server under load
+
+// distinct inputs the clients cycle through, the most latencies each
+// client keeps, and how far a batched answer may be from predict()'s
+#define SERVER_INPUTS 64
+#define SERVER_MAX_LATENCIES 65536
+#define SERVER_TOLERANCE (sizeof(real) == sizeof(double) ? 1e-9 : 1e-4)
+// time between two models published while serving
+#define SERVER_PUBLISH_NS 1000000
+
+typedef struct ServerLoad {
+  InferenceServer* server;
+  unsigned int inputs;
+  unsigned int outputs;
+  double* samples;
+  double* expected;
+  // the answers of the other model when two are swapped in turn, or NULL
+  double* alternate;
+  double seconds;
+} ServerLoad;
+
+typedef struct ServerClient {
+  ServerLoad* load;
+  pthread_t thread;
+  unsigned int first;
+  unsigned long long* latencies;
+  unsigned int count;
+  unsigned int wrong;
+} ServerClient;
+
+static unsigned int matches_answer(
+  double* output, double* expected, unsigned int outputs
+) {
+  for (unsigned int o = 0; o < outputs; o++) {
+    if (fabs(output[o] - expected[o]) > SERVER_TOLERANCE) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+typedef struct ServerPublisher {
+  ModelHandle* model;
+  Network* models[2];
+  _Atomic unsigned int stop;
+} ServerPublisher;
+
+static void* run_publisher(void* context) {
+  // swaps the two models in turn every SERVER_PUBLISH_NS, far more often
+  // than a trainer would
+  ServerPublisher* publisher = (ServerPublisher*)context;
+  struct timespec pause = {0, SERVER_PUBLISH_NS};
+  for (unsigned long p = 1; !atomic_load(&publisher->stop); p++) {
+    model_publish(publisher->model, publisher->models[p % 2]);
+    nanosleep(&pause, NULL);
+  }
+  return NULL;
+}
+
+static void* run_client(void* context) {
+  // one request at a time, as fast as the server answers them
+  ServerClient* client = (ServerClient*)context;
+  ServerLoad* load = client->load;
+  InferenceRequest request;
+  initialise_inference_request(&request, 0);
+  double* output = (double*)malloc(sizeof(double) * load->outputs);
+  double start = now_seconds();
+  unsigned int sample = client->first;
+  while (client->count < SERVER_MAX_LATENCIES
+    && now_seconds() - start < load->seconds) {
+    double submitted = now_seconds();
+    inference_submit(
+      load->server, &request, load->samples + (size_t)sample * load->inputs,
+      output, NULL, NULL
+    );
+    inference_wait(&request);
+    client->latencies[client->count++] = (
+      (now_seconds() - submitted) * 1e9
+    );
+    size_t offset = (size_t)sample * load->outputs;
+    if (!matches_answer(output, load->expected + offset, load->outputs)
+      && (!load->alternate
+      || !matches_answer(output, load->alternate + offset, load->outputs))) {
+      client->wrong++;
+    }
+    sample = (sample + 1) % SERVER_INPUTS;
+  }
+  initialise_inference_request(&request, 1);
+  free(output);
+  return NULL;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+  unsigned long long x = *(const unsigned long long*)a;
+  unsigned long long y = *(const unsigned long long*)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_server(
+  BenchOptions* options, unsigned int width, unsigned int depth,
+  unsigned int clients, unsigned int max_batch,
+  unsigned long long max_delay_ns, unsigned int hot_swap
+) {
+  // clients threads each keep one request in flight against a server
+  // with a worker per thread of the pool; answers are checked against
+  // predict(). With hot_swap the server runs from a model handle while a
+  // second model and the first are published in turn, and each answer
+  // must be one of the two models'
+  Network net;
+  Network other;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  initialise_inference_network(&net, depth, num_nodes, 0);
+  randomise_network(&net);
+  initialise_inference_network(&other, depth, num_nodes, 0);
+  randomise_network(&other);
+  ServerLoad load;
+  load.inputs = width;
+  load.outputs = width;
+  load.seconds = options->min_seconds;
+  load.samples = (double*)malloc(sizeof(double) * width * SERVER_INPUTS);
+  load.expected = (double*)malloc(sizeof(double) * width * SERVER_INPUTS);
+  load.alternate = NULL;
+  if (hot_swap) {
+    load.alternate = (double*)malloc(sizeof(double) * width * SERVER_INPUTS);
+  }
+  for (unsigned int i = 0; i < width * SERVER_INPUTS; i++) {
+    load.samples[i] = random_normal();
+  }
+  for (unsigned int s = 0; s < SERVER_INPUTS; s++) {
+    size_t offset = (size_t)s * width;
+    predict(&net, load.samples + offset, load.expected + offset);
+    if (hot_swap) {
+      predict(&other, load.samples + offset, load.alternate + offset);
+    }
+  }
+  InferenceServer server;
+  ModelHandle model;
+  ServerPublisher publisher = {&model, {&net, &other}, 0};
+  pthread_t publisher_thread;
+  if (hot_swap) {
+    initialise_model_handle(&model, &net, 2, get_num_threads(), 0);
+    start_model_server(
+      &server, &model, get_num_threads(), max_batch, max_delay_ns
+    );
+    if (pthread_create(&publisher_thread, NULL, run_publisher, &publisher)) {
+      printf("Error: Bench: could not start the publisher\n");
+      exit(1);
+    }
+  } else {
+    start_inference_server(
+      &server, &net, get_num_threads(), max_batch, max_delay_ns
+    );
+  }
+  load.server = &server;
+  ServerClient* client_state = (ServerClient*)calloc(
+    clients, sizeof(ServerClient)
+  );
+  double start = now_seconds();
+  for (unsigned int c = 0; c < clients; c++) {
+    client_state[c].load = &load;
+    client_state[c].first = c % SERVER_INPUTS;
+    client_state[c].latencies = (unsigned long long*)malloc(
+      sizeof(unsigned long long) * SERVER_MAX_LATENCIES
+    );
+    if (pthread_create(&client_state[c].thread, NULL, run_client,
+      &client_state[c])) {
+      printf("Error: Bench: could not start a client\n");
+      exit(1);
+    }
+  }
+  unsigned long total = 0;
+  unsigned int wrong = 0;
+  for (unsigned int c = 0; c < clients; c++) {
+    pthread_join(client_state[c].thread, NULL);
+    total += client_state[c].count;
+    wrong += client_state[c].wrong;
+  }
+  double elapsed = now_seconds() - start;
+  if (hot_swap) {
+    atomic_store(&publisher.stop, 1);
+    pthread_join(publisher_thread, NULL);
+  }
+  stop_inference_server(&server);
+  double swaps = hot_swap ? model.publishes / elapsed : 0;
+  unsigned long long* latencies = (unsigned long long*)malloc(
+    sizeof(unsigned long long) * (total ? total : 1)
+  );
+  unsigned long filled = 0;
+  for (unsigned int c = 0; c < clients; c++) {
+    for (unsigned int r = 0; r < client_state[c].count; r++) {
+      latencies[filled++] = client_state[c].latencies[r];
+    }
+    free(client_state[c].latencies);
+  }
+  qsort(latencies, total, sizeof(unsigned long long), compare_latencies);
+  double p50 = total ? latencies[total / 2] / 1e3 : 0;
+  double p99 = total ? latencies[total * 99 / 100] / 1e3 : 0;
+  double mean_batch = server.batches ? (double)server.requests
+    / server.batches : 0;
+  if (options->json) {
+    printf("{\"benchmark\": \"server\", \"width\": %u, \"depth\": %u, "
+    "\"clients\": %u, \"max_batch\": %u, \"max_delay_us\": %.1f, "
+    "\"workers\": %u, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+    "\"samples_per_sec\": %.1f, \"mean_batch\": %.2f, "
+    "\"swaps_per_sec\": %.1f}\n",
+    width, depth, clients, max_batch, max_delay_ns / 1e3,
+    server.num_workers, p50, p99, total / elapsed, mean_batch, swaps);
+  } else {
+    printf("server %3u clients, batch %2u, delay %5.0f us: p50 %8.1f us, "
+    "p99 %8.1f us, %10.1f samples/s, mean batch %.2f",
+    clients, max_batch, max_delay_ns / 1e3, p50, p99, total / elapsed,
+    mean_batch);
+    if (hot_swap) {
+      printf(", %.0f swaps/s", swaps);
+    }
+    printf("\n");
+  }
+  if (wrong) {
+    printf("Error: Bench: %u server answers differ from predict()\n", wrong);
+    exit(1);
+  }
+  if (hot_swap) {
+    initialise_model_handle(&model, NULL, 0, 0, 1);
+  }
+  initialise_inference_network(&net, depth, num_nodes, 1);
+  initialise_inference_network(&other, depth, num_nodes, 1);
+  free(latencies);
+  free(client_state);
+  free(load.samples);
+  free(load.expected);
+  free(load.alternate);
+  free(num_nodes);
+}
+
+// model hot-swap
+
+// readers and the snapshots published while they read
+#define HOT_SWAP_READERS 4
+#define HOT_SWAP_PUBLISHES 2000
+
+typedef struct HotSwapReader {
+  ModelHandle* model;
+  pthread_t thread;
+  _Atomic unsigned int* stop;
+  unsigned long reads;
+  unsigned int wrong;
+} HotSwapReader;
+
+static void* run_hot_swap_reader(void* context) {
+  // every version acquired must hold one published snapshot, all of its
+  // parameters the same value, and none older than the last one seen
+  HotSwapReader* reader = (HotSwapReader*)context;
+  unsigned int slot = register_model_reader(reader->model);
+  real last = 0;
+  while (!atomic_load(reader->stop)) {
+    Network* version = model_acquire(reader->model, slot);
+    real value = version->parameters[0];
+    for (size_t i = 1; i < version->num_parameters; i++) {
+      if (version->parameters[i] != value) {
+        reader->wrong++;
+        break;
+      }
+    }
+    // yields while holding the version give the publisher a few turns
+    for (unsigned int y = 0; y < 3; y++) {
+      sched_yield();
+    }
+    for (size_t i = 0; i < version->num_parameters; i++) {
+      if (version->parameters[i] != value) {
+        reader->wrong++;
+        break;
+      }
+    }
+    model_release(reader->model, slot);
+    if (value < last) {
+      reader->wrong++;
+    }
+    last = value;
+    reader->reads++;
+  }
+  return NULL;
+}
+
+static void check_hot_swap() {
+  // snapshots 1, 2, ... published over two versions while readers check
+  // that no version they hold is ever written to
+  unsigned int num_nodes[] = {16, 32, 16};
+  Network source;
+  initialise_inference_network(&source, 3, num_nodes, 0);
+  for (size_t i = 0; i < source.num_parameters; i++) {
+    source.parameters[i] = 0;
+  }
+  ModelHandle model;
+  initialise_model_handle(&model, &source, 2, HOT_SWAP_READERS, 0);
+  _Atomic unsigned int stop = 0;
+  HotSwapReader readers[HOT_SWAP_READERS];
+  for (unsigned int r = 0; r < HOT_SWAP_READERS; r++) {
+    readers[r].model = &model;
+    readers[r].stop = &stop;
+    readers[r].reads = 0;
+    readers[r].wrong = 0;
+    if (pthread_create(&readers[r].thread, NULL, run_hot_swap_reader,
+      &readers[r])) {
+      printf("Error: Check: could not start a reader\n");
+      exit(1);
+    }
+  }
+  for (unsigned int p = 1; p <= HOT_SWAP_PUBLISHES; p++) {
+    for (size_t i = 0; i < source.num_parameters; i++) {
+      source.parameters[i] = p;
+    }
+    model_publish(&model, &source);
+    // lets the readers run between publishes even on a single core
+    sched_yield();
+  }
+  atomic_store(&stop, 1);
+  unsigned long reads = 0;
+  unsigned int wrong = 0;
+  for (unsigned int r = 0; r < HOT_SWAP_READERS; r++) {
+    pthread_join(readers[r].thread, NULL);
+    reads += readers[r].reads;
+    wrong += readers[r].wrong;
+  }
+  Network* current = model_acquire(&model, 0);
+  wrong += current->parameters[0] != HOT_SWAP_PUBLISHES;
+  model_release(&model, 0);
+  printf("hot swap: %u readers, %lu publishes, %lu reads, %u torn\n",
+  HOT_SWAP_READERS, model.publishes, reads, wrong);
+  initialise_model_handle(&model, NULL, 0, 0, 1);
+  initialise_inference_network(&source, 3, num_nodes, 1);
+  if (wrong) {
+    printf("Error: Check: a reader saw a version change under it\n");
+    exit(1);
+  }
+}
+
+// int8 inference
+
+#define QUANTIZE_SAMPLES 256
+
+typedef struct QuantizedContext {
+  Network net;
+  QuantizedNetwork quantized;
+  double* input;
+  double* output;
+} QuantizedContext;
+
+static void op_predict(void* context) {
+  QuantizedContext* q = (QuantizedContext*)context;
+  predict(&q->net, q->input, q->output);
+}
+
+static void op_quantized_predict(void* context) {
+  QuantizedContext* q = (QuantizedContext*)context;
+  quantized_predict(&q->quantized, q->input, q->output);
+}
+
+static void bench_quantized(
+  BenchOptions* options, unsigned int width, unsigned int depth
+) {
+  // one sample through the network and its int8 copy, calibrated on
+  // random samples; the table also gets the accuracy report
+  QuantizedContext q;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  initialise_batch_network(&q.net, depth, num_nodes, 32, 0);
+  randomise_network(&q.net);
+  // unit weights would amplify any error sqrt(width) times per layer,
+  // these are scaled to keep activations the size of their inputs
+  for (size_t i = 0; i < q.net.num_weight_parameters; i++) {
+    q.net.parameters[i] /= sqrt(width);
+  }
+  double* samples = (double*)malloc(
+    sizeof(double) * width * QUANTIZE_SAMPLES
+  );
+  for (unsigned int i = 0; i < width * QUANTIZE_SAMPLES; i++) {
+    samples[i] = random_normal();
+  }
+  initialise_quantized_network(
+    &q.quantized, &q.net, samples, QUANTIZE_SAMPLES, 0
+  );
+  q.input = samples;
+  q.output = (double*)malloc(sizeof(double) * width);
+  double flops = forward_flops(&q.net);
+  report(options, "predict", width, depth, 1,
+    time_op(options, op_predict, &q), flops, 1);
+  report(options, "int8_predict", width, depth, 1,
+    time_op(options, op_quantized_predict, &q), flops, 1);
+  if (!options->json) {
+    QuantizationReport accuracy;
+    quantization_report(
+      &q.quantized, &q.net, samples, QUANTIZE_SAMPLES, &accuracy
+    );
+    print_quantization_report(&accuracy);
+  }
+  initialise_quantized_network(&q.quantized, &q.net, samples, 0, 1);
+  initialise_batch_network(&q.net, depth, num_nodes, 32, 1);
+  free(samples);
+  free(q.output);
+  free(num_nodes);
+}
+
+// the passes generated for the built topology
+
+typedef struct TopologyContext {
+  Network net;
+  double* input;
+  double* target_output;
+  double* output;
+} TopologyContext;
+
+static unsigned int* built_topology() {
+  unsigned int* num_nodes = (unsigned int*)malloc(
+    sizeof(unsigned int) * topology_num_layers
+  );
+  for (unsigned int l = 0; l < topology_num_layers; l++) {
+    num_nodes[l] = topology_num_nodes[l];
+  }
+  return num_nodes;
+}
+
+static double relative_difference(
+  const real* a, const real* b, size_t n
+) {
+  // largest difference relative to the size of the values, at least 1
+  double worst = 0;
+  for (size_t i = 0; i < n; i++) {
+    double scale = fabs(a[i]) > 1 ? fabs(a[i]) : 1;
+    double difference = fabs((double)a[i] - b[i]) / scale;
+    if (difference > worst) {
+      worst = difference;
+    }
+  }
+  return worst;
+}
+
+static double compare_networks(Network* generic, Network* specialized) {
+  double worst = 0;
+  double difference;
+  for (unsigned int l = 0; l < generic->num_layers; l++) {
+    difference = relative_difference(
+      generic->layers[l].output->matrix_data,
+      specialized->layers[l].output->matrix_data,
+      generic->layers[l].output->rows
+    );
+    if (difference > worst) worst = difference;
+  }
+  difference = fabs(generic->total_cost - specialized->total_cost);
+  if (difference > worst) worst = difference;
+  difference = relative_difference(
+    generic->gradients, specialized->gradients, generic->num_parameters
+  );
+  if (difference > worst) worst = difference;
+  return worst;
+}
+
+static void check_topology() {
+  // the same training steps through both sets of passes, from the same
+  // parameters, then the same predictions
+  unsigned int num_layers = topology_num_layers;
+  unsigned int* num_nodes = built_topology();
+  unsigned int inputs = num_nodes[0];
+  unsigned int outputs = num_nodes[num_layers-1];
+  Network generic;
+  Network specialized;
+  initialise_network(&generic, num_layers, num_nodes, 0);
+  initialise_network(&specialized, num_layers, num_nodes, 0);
+  if (!topology_matches(&specialized)) {
+    printf("Error: Check: built topology does not match its network\n");
+    exit(1);
+  }
+  randomise_network(&generic);
+  copy_parameters(&generic, &specialized);
+  double* input = (double*)malloc(sizeof(double) * inputs);
+  double* target_output = (double*)malloc(sizeof(double) * outputs);
+  double* generic_output = (double*)malloc(sizeof(double) * outputs);
+  double* specialized_output = (double*)malloc(sizeof(double) * outputs);
+  double worst = 0;
+  for (unsigned int step = 0; step < CHECK_STEPS; step++) {
+    for (unsigned int i = 0; i < inputs; i++) {
+      input[i] = random_normal();
+    }
+    for (unsigned int i = 0; i < outputs; i++) {
+      target_output[i] = random_normal();
+    }
+    forward_pass(&generic, input, target_output);
+    compute_gradients(&generic);
+    topology_forward_pass(&specialized, input, target_output);
+    topology_compute_gradients(&specialized);
+    double difference = compare_networks(&generic, &specialized);
+    if (difference > worst) worst = difference;
+    predict(&generic, input, generic_output);
+    topology_predict(&specialized, input, specialized_output);
+    for (unsigned int i = 0; i < outputs; i++) {
+      difference = fabs(generic_output[i] - specialized_output[i]);
+      if (difference > worst) worst = difference;
+    }
+    // both take the generic step so they keep the same parameters
+    apply_gradients(&generic, 0.01, 0.01);
+    copy_parameters(&generic, &specialized);
+  }
+  printf("topology");
+  for (unsigned int l = 0; l < num_layers; l++) {
+    printf("%s%u", l ? "," : " ", num_nodes[l]);
+  }
+  printf(": %u steps, largest difference %g\n", CHECK_STEPS, worst);
+  initialise_network(&generic, num_layers, num_nodes, 1);
+  initialise_network(&specialized, num_layers, num_nodes, 1);
+  free(input);
+  free(target_output);
+  free(generic_output);
+  free(specialized_output);
+  free(num_nodes);
+  if (worst > CHECK_TOLERANCE) {
+    printf("Error: Check: specialized passes differ by more than %g\n",
+    CHECK_TOLERANCE);
+    exit(1);
+  }
+}
+
+static void op_generic_train_step(void* context) {
+  TopologyContext* t = (TopologyContext*)context;
+  forward_pass(&t->net, t->input, t->target_output);
+  compute_gradients(&t->net);
+}
+
+static void op_topology_train_step(void* context) {
+  TopologyContext* t = (TopologyContext*)context;
+  topology_forward_pass(&t->net, t->input, t->target_output);
+  topology_compute_gradients(&t->net);
+}
+
+static void op_generic_predict(void* context) {
+  TopologyContext* t = (TopologyContext*)context;
+  predict(&t->net, t->input, t->output);
+}
+
+static void op_topology_predict(void* context) {
+  TopologyContext* t = (TopologyContext*)context;
+  topology_predict(&t->net, t->input, t->output);
+}
+
+static void bench_topology(BenchOptions* options) {
+  // one sample through the generic and the specialized passes, reported
+  // with the input width and the number of layers
+  TopologyContext t;
+  unsigned int num_layers = topology_num_layers;
+  unsigned int* num_nodes = built_topology();
+  unsigned int width = num_nodes[0];
+  initialise_network(&t.net, num_layers, num_nodes, 0);
+  randomise_network(&t.net);
+  t.input = (double*)malloc(sizeof(double) * width);
+  t.target_output = (double*)malloc(
+    sizeof(double) * num_nodes[num_layers-1]
+  );
+  t.output = (double*)malloc(sizeof(double) * num_nodes[num_layers-1]);
+  for (unsigned int i = 0; i < width; i++) {
+    t.input[i] = random_normal();
+  }
+  for (unsigned int i = 0; i < num_nodes[num_layers-1]; i++) {
+    t.target_output[i] = random_normal();
+  }
+  double train = forward_flops(&t.net) + backward_flops(&t.net);
+  report(options, "generic_step", width, num_layers, 1,
+    time_op(options, op_generic_train_step, &t), train, 1);
+  report(options, "topology_step", width, num_layers, 1,
+    time_op(options, op_topology_train_step, &t), train, 1);
+  report(options, "generic_predict", width, num_layers, 1,
+    time_op(options, op_generic_predict, &t), forward_flops(&t.net), 1);
+  report(options, "topology_predict", width, num_layers, 1,
+    time_op(options, op_topology_predict, &t), forward_flops(&t.net), 1);
+  initialise_network(&t.net, num_layers, num_nodes, 1);
+  free(t.input);
+  free(t.target_output);
+  free(t.output);
+  free(num_nodes);
+}
+
+// activation checkpoints
+
+static double activation_bytes(Network* net) {
+  return (double)net->activation_memory->rows * sizeof(real);
+}
+
+static void check_checkpoints(unsigned int interval) {
+  // gradients and an SGD step with only every interval-th activation kept
+  // against the same with every activation kept
+  unsigned int depth = 9;
+  unsigned int width = 32;
+  unsigned int batch = 16;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  Network kept;
+  Network checkpointed;
+  initialise_batch_network(&kept, depth, num_nodes, batch, 0);
+  initialise_batch_network(&checkpointed, depth, num_nodes, batch, 0);
+  use_activation_checkpoints(&checkpointed, interval);
+  randomise_network(&kept);
+  copy_parameters(&kept, &checkpointed);
+  double* input = (double*)malloc(sizeof(double) * width * batch);
+  double* target_output = (double*)malloc(sizeof(double) * width * batch);
+  for (unsigned int i = 0; i < width * batch; i++) {
+    input[i] = random_normal();
+    target_output[i] = random_normal();
+  }
+  forward_pass(&kept, input, target_output);
+  compute_gradients(&kept);
+  forward_pass(&checkpointed, input, target_output);
+  compute_gradients(&checkpointed);
+  double worst = relative_difference(
+    kept.gradients, checkpointed.gradients, kept.num_parameters
+  );
+  double difference = fabs(kept.total_cost - checkpointed.total_cost);
+  if (difference > worst) worst = difference;
+  forward_pass(&kept, input, target_output);
+  backpropagate(&kept, 0.01, 0.01);
+  forward_pass(&checkpointed, input, target_output);
+  backpropagate(&checkpointed, 0.01, 0.01);
+  difference = relative_difference(
+    kept.parameters, checkpointed.parameters, kept.num_parameters
+  );
+  if (difference > worst) worst = difference;
+  printf("checkpoints every %u layers: activations %.0f of %.0f bytes, "
+  "largest difference %g\n", interval, activation_bytes(&checkpointed),
+  activation_bytes(&kept), worst);
+  initialise_batch_network(&kept, depth, num_nodes, batch, 1);
+  initialise_batch_network(&checkpointed, depth, num_nodes, batch, 1);
+  free(input);
+  free(target_output);
+  free(num_nodes);
+  if (worst > CHECK_TOLERANCE) {
+    printf("Error: Check: checkpointed gradients differ by more than %g\n",
+    CHECK_TOLERANCE);
+    exit(1);
+  }
+}
+
+static void op_compute_gradients(void* context) {
+  NetworkContext* n = (NetworkContext*)context;
+  forward_pass(&n->net, n->input, n->target_output);
+  compute_gradients(&n->net);
+}
+
+static void bench_checkpoints(
+  BenchOptions* options, unsigned int width, unsigned int depth,
+  unsigned int batch, unsigned int interval
+) {
+  // a forward pass and the gradients with every interval-th activation
+  // kept, 0 keeps them all; the flops do not count the recomputation
+  NetworkContext n;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  initialise_batch_network(&n.net, depth, num_nodes, batch, 0);
+  use_activation_checkpoints(&n.net, interval);
+  randomise_network(&n.net);
+  n.input = (double*)malloc(sizeof(double) * width * batch);
+  n.target_output = (double*)malloc(sizeof(double) * width * batch);
+  for (unsigned int i = 0; i < width * batch; i++) {
+    n.input[i] = random_normal();
+    n.target_output[i] = random_normal();
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "checkpoints_%u", interval);
+  report(options, name, width, depth, batch,
+    time_op(options, op_compute_gradients, &n),
+    (forward_flops(&n.net) + backward_flops(&n.net)) * batch, batch);
+  if (options->json) {
+    printf("{\"benchmark\": \"%s_memory\", \"width\": %u, "
+    "\"depth\": %u, \"batch\": %u, \"activation_bytes\": %.0f}\n",
+    name, width, depth, batch, activation_bytes(&n.net));
+  } else {
+    printf("%-16s activation memory %.0f bytes\n", name,
+    activation_bytes(&n.net));
+  }
+  initialise_batch_network(&n.net, depth, num_nodes, batch, 1);
+  free(n.input);
+  free(n.target_output);
+  free(num_nodes);
+}
+
+// parameter initialisation
+
+#define RANDOM_CHECK_VALUES 100003
+#define RANDOM_CHECK_SEED 12345
+
+typedef struct RandomiseContext {
+  Network net;
+} RandomiseContext;
+
+static void op_randomise_rand(void* context) {
+  // the element by element rand() loop randomise_network() used to be
+  Network* net = &((RandomiseContext*)context)->net;
+  for (unsigned int l = 0; l < net->num_layers; l++) {
+    Layer* layer = &net->layers[l];
+    if (layer->weights) {
+      for (unsigned int r = 0; r < layer->weights->rows; r++) {
+        real* row = get_row_data(layer->weights, r);
+        for (unsigned int c = 0; c < layer->weights->columns; c++) {
+          row[c] = random_normal();
+        }
+      }
+    }
+    for (unsigned int j = 0; j < layer->biases->rows; j++) {
+      layer->biases->matrix_data[j] = random_normal();
+    }
+  }
+}
+
+static void op_randomise_philox(void* context) {
+  randomise_network_seeded(&((RandomiseContext*)context)->net, 1);
+}
+
+static void bench_randomise(
+  BenchOptions* options, unsigned int width, unsigned int depth
+) {
+  RandomiseContext r;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  initialise_inference_network(&r.net, depth, num_nodes, 0);
+  double values = 0;
+  for (unsigned int l = 0; l + 1 < depth; l++) {
+    values += (double)num_nodes[l] * num_nodes[l+1];
+  }
+  for (unsigned int l = 0; l < depth; l++) {
+    values += num_nodes[l];
+  }
+  report(options, "randomise_rand", width, depth, 0,
+    time_op(options, op_randomise_rand, &r), 0, values);
+  report(options, "randomise_philox", width, depth, 0,
+    time_op(options, op_randomise_philox, &r), 0, values);
+  initialise_inference_network(&r.net, depth, num_nodes, 1);
+  free(num_nodes);
+}
+
+// zero-copy checkpoint loading
+
+static void check_mapped_load() {
+  // a loaded network reads its parameters straight from the mapped file:
+  // loading allocates no more than a network without a parameter slab,
+  // and its predictions are the saved network's
+  unsigned int num_nodes[] = {64, 128, 32};
+  Network net;
+  initialise_inference_network(&net, 3, num_nodes, 0);
+  randomise_network_seeded(&net, 1);
+  char path[] = "/tmp/bench_checkpoint_XXXXXX";
+  int file = mkstemp(path);
+  if (file < 0) {
+    printf("Error: Check: could not create a checkpoint file\n");
+    exit(1);
+  }
+  close(file);
+  save_network(&net, path);
+  unsigned long before = thread_allocation_count();
+  Network layout;
+  initialise_network_without_parameters(&layout, 3, num_nodes, 0, 0);
+  unsigned long layout_allocations = thread_allocation_count() - before;
+  initialise_network_without_parameters(&layout, 3, num_nodes, 0, 1);
+  before = thread_allocation_count();
+  Network loaded;
+  load_network(&loaded, path, 0, 1);
+  unsigned long load_allocations = thread_allocation_count() - before;
+  unlink(path);
+  unsigned char* mapping = (unsigned char*)loaded.mapping;
+  unsigned char* parameters = (unsigned char*)loaded.parameters;
+  unsigned int wrong = (
+    parameters < mapping
+    || parameters + sizeof(real) * loaded.num_parameters
+      > mapping + loaded.mapping_size
+  );
+  double input[64];
+  double expected[32];
+  double output[32];
+  for (unsigned int i = 0; i < 64; i++) {
+    input[i] = random_normal();
+  }
+  predict(&net, input, expected);
+  predict(&loaded, input, output);
+  for (unsigned int o = 0; o < 32; o++) {
+    wrong += output[o] != expected[o];
+  }
+  printf("mapped load: %lu allocations, %lu without a slab, %u mismatches\n",
+  load_allocations, layout_allocations, wrong);
+  initialise_inference_network(&loaded, 3, num_nodes, 1);
+  initialise_inference_network(&net, 3, num_nodes, 1);
+  if (wrong || load_allocations > layout_allocations) {
+    printf("Error: Check: a loaded network does not use the mapped file\n");
+    exit(1);
+  }
+}
+
+static double reference_normal(unsigned long long seed, size_t position) {
+  // normal position of seed's stream from philox4x32() and libm, to check
+  // the batched fill and its vector Box-Muller transform against
+  unsigned long long block = position / 4;
+  uint32_t counter[4] = {(uint32_t)block, (uint32_t)(block >> 32), 0, 0};
+  uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+  uint32_t words[4];
+  philox4x32(counter, key, words);
+  unsigned int pair = position % 4 / 2;
+  double u1 = (words[2 * pair] + 0.5) * (1.0 / 4294967296.0);
+  double u2 = (words[2 * pair + 1] + 0.5) * (1.0 / 4294967296.0);
+  double radius = sqrt(-2 * log(u1));
+  return radius * (position % 2 ? sin(2 * M_PI * u2) : cos(2 * M_PI * u2));
+}
+
+static void check_random() {
+  // the stream against the Philox4x32-10 known answer, then the same
+  // values however the fill is split between threads and calls, and
+  // close to a plain scalar evaluation of every one
+  uint32_t counter[4] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+  uint32_t key[2] = {0xa4093822, 0x299f31d0};
+  uint32_t expected[4] = {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1};
+  uint32_t words[4];
+  philox4x32(counter, key, words);
+  unsigned int wrong = 0;
+  for (unsigned int w = 0; w < 4; w++) {
+    wrong += words[w] != expected[w];
+  }
+  real* whole = create_aligned_data(RANDOM_CHECK_VALUES);
+  real* split = create_aligned_data(RANDOM_CHECK_VALUES);
+  unsigned int threads = get_num_threads();
+  set_num_threads(1);
+  random_normal_fill(whole, RANDOM_CHECK_VALUES, RANDOM_CHECK_SEED, 0);
+  set_num_threads(4);
+  size_t middle = RANDOM_CHECK_VALUES / 3;
+  random_normal_fill(split, middle, RANDOM_CHECK_SEED, 0);
+  random_normal_fill(
+    split + middle, RANDOM_CHECK_VALUES - middle, RANDOM_CHECK_SEED, middle
+  );
+  set_num_threads(threads);
+  double mean = 0;
+  double variance = 0;
+  double worst = 0;
+  for (size_t i = 0; i < RANDOM_CHECK_VALUES; i++) {
+    wrong += whole[i] != split[i];
+    double expected = reference_normal(RANDOM_CHECK_SEED, i);
+    double difference = fabs(whole[i] - expected)
+      / (fabs(expected) > 1 ? fabs(expected) : 1);
+    if (difference > worst) worst = difference;
+    mean += whole[i];
+    variance += (double)whole[i] * whole[i];
+  }
+  mean /= RANDOM_CHECK_VALUES;
+  variance = variance / RANDOM_CHECK_VALUES - mean * mean;
+  printf("random: %u normals, mean %.4f, variance %.4f, %u mismatches, "
+  "largest difference from scalar %g\n", RANDOM_CHECK_VALUES, mean,
+  variance, wrong, worst);
+  free(whole);
+  free(split);
+  if (wrong || fabs(mean) > 0.01 || fabs(variance - 1) > 0.02
+    || worst > CHECK_TOLERANCE) {
+    printf("Error: Check: random normals are not reproducible or normal\n");
+    exit(1);
+  }
+}
+
+// pipeline parallel passes
+
+typedef struct PipelineContext {
+  Network net;
+  Pipeline pipeline;
+  double* input;
+  double* target_output;
+  double* output;
+  unsigned int num_micro_batches;
+} PipelineContext;
+
+static void gather_micro_batch(
+  double* samples, unsigned int rows, unsigned int first,
+  unsigned int count, double* batch
+) {
+  // count samples from first, one column each like forward_pass() takes
+  for (unsigned int b = 0; b < count; b++) {
+    for (unsigned int r = 0; r < rows; r++) {
+      batch[(size_t)r * count + b] = samples[((size_t)first + b) * rows + r];
+    }
+  }
+}
+
+static void check_pipeline(unsigned int num_stages) {
+  // the gradients and predictions of the pipeline against running the
+  // same micro-batches one after another on a single network
+  unsigned int depth = 8;
+  unsigned int width = 32;
+  unsigned int micro_batch = 4;
+  unsigned int num_micro_batches = 8;
+  unsigned int count = micro_batch * num_micro_batches;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  Network net;
+  Network sequential;
+  initialise_batch_network(&net, depth, num_nodes, micro_batch, 0);
+  initialise_batch_network(&sequential, depth, num_nodes, micro_batch, 0);
+  randomise_network(&net);
+  copy_parameters(&net, &sequential);
+  double* input = (double*)malloc(sizeof(double) * width * count);
+  double* target_output = (double*)malloc(sizeof(double) * width * count);
+  double* output = (double*)malloc(sizeof(double) * width * count);
+  double* expected = (double*)malloc(sizeof(double) * width * count);
+  double* batch_input = (double*)malloc(sizeof(double) * width * micro_batch);
+  double* batch_target = (double*)malloc(sizeof(double) * width * micro_batch);
+  real* gradients = create_aligned_data(net.num_parameters);
+  for (unsigned int i = 0; i < width * count; i++) {
+    input[i] = random_normal();
+    target_output[i] = random_normal();
+  }
+  double sequential_cost = 0;
+  for (unsigned int m = 0; m < num_micro_batches; m++) {
+    gather_micro_batch(input, width, m * micro_batch, micro_batch,
+      batch_input);
+    gather_micro_batch(target_output, width, m * micro_batch, micro_batch,
+      batch_target);
+    forward_pass(&sequential, batch_input, batch_target);
+    for (unsigned int r = 0; r < width; r++) {
+      for (unsigned int b = 0; b < micro_batch; b++) {
+        expected[((size_t)m * micro_batch + b) * width + r] = get_element(
+          sequential.output, r, b
+        );
+      }
+    }
+    compute_gradients(&sequential);
+    sequential_cost += sequential.total_cost;
+    if (m == 0) {
+      vector_copy(sequential.gradients, gradients, net.num_parameters);
+    } else {
+      vector_add(gradients, sequential.gradients, gradients,
+        net.num_parameters);
+    }
+  }
+  Pipeline pipeline;
+  start_pipeline(&pipeline, &net, num_stages, micro_batch);
+  pipeline_gradients(&pipeline, input, target_output, num_micro_batches);
+  double worst = relative_difference(
+    gradients, net.gradients, net.num_parameters
+  );
+  double difference = fabs(sequential_cost - net.total_cost);
+  if (difference > worst) worst = difference;
+  pipeline_predict(&pipeline, input, output, num_micro_batches);
+  for (size_t i = 0; i < (size_t)width * count; i++) {
+    difference = fabs(expected[i] - output[i]);
+    if (difference > worst) worst = difference;
+  }
+  printf("pipeline %u stages:", num_stages);
+  for (unsigned int s = 0; s < num_stages; s++) {
+    printf(" [%u, %u)", pipeline.stages[s].first, pipeline.stages[s].end);
+  }
+  printf(", %u micro-batches, largest difference %g\n", num_micro_batches,
+  worst);
+  finish_pipeline(&pipeline);
+  initialise_batch_network(&net, depth, num_nodes, micro_batch, 1);
+  initialise_batch_network(&sequential, depth, num_nodes, micro_batch, 1);
+  free(input);
+  free(target_output);
+  free(output);
+  free(expected);
+  free(batch_input);
+  free(batch_target);
+  free(gradients);
+  free(num_nodes);
+  if (worst > CHECK_TOLERANCE) {
+    printf("Error: Check: pipeline differs by more than %g\n",
+    CHECK_TOLERANCE);
+    exit(1);
+  }
+}
+
+static void check_data_parallel(unsigned int num_workers) {
+  // one SGD step of workers each on its shard of the samples against one
+  // network stepped once on all of them
+  unsigned int depth = 4;
+  unsigned int width = 16;
+  unsigned int batch = 4;
+  unsigned int count = batch * num_workers;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  Network net;
+  Network whole;
+  Optimizer optimizer;
+  Optimizer whole_optimizer;
+  initialise_batch_network(&net, depth, num_nodes, batch, 0);
+  initialise_batch_network(&whole, depth, num_nodes, count, 0);
+  randomise_network(&whole);
+  copy_parameters(&whole, &net);
+  initialise_optimizer(&optimizer, &net, OPTIMIZER_SGD, 0.1, 0);
+  initialise_optimizer(&whole_optimizer, &whole, OPTIMIZER_SGD, 0.1, 0);
+  double* input = (double*)malloc(sizeof(double) * width * count);
+  double* target_output = (double*)malloc(sizeof(double) * width * count);
+  double* batch_input = (double*)malloc(sizeof(double) * width * count);
+  double* batch_target = (double*)malloc(sizeof(double) * width * count);
+  for (unsigned int i = 0; i < width * count; i++) {
+    input[i] = random_normal();
+    target_output[i] = random_normal();
+  }
+  gather_micro_batch(input, width, 0, count, batch_input);
+  gather_micro_batch(target_output, width, 0, count, batch_target);
+  forward_pass(&whole, batch_input, batch_target);
+  optimise(&whole_optimizer, &whole);
+  DataParallel dp;
+  start_data_parallel(&dp, &net, num_workers);
+  unsigned int begin;
+  unsigned int end;
+  data_parallel_shard(&dp, count, &begin, &end);
+  if (end - begin != batch) {
+    printf("Error: Check: worker %u has %u samples instead of %u\n",
+    dp.rank, end - begin, batch);
+    exit(1);
+  }
+  gather_micro_batch(input, width, begin, batch, batch_input);
+  gather_micro_batch(target_output, width, begin, batch, batch_target);
+  forward_pass(&net, batch_input, batch_target);
+  data_parallel_step(&dp, &optimizer);
+  // only rank 0 comes back, and every replica applied the same step
+  finish_data_parallel(&dp);
+  double worst = relative_difference(
+    whole.parameters, net.parameters, net.num_parameters
+  );
+  printf("data parallel %u workers, %u samples each, largest difference "
+  "%g\n", num_workers, batch, worst);
+  initialise_optimizer(&optimizer, &net, OPTIMIZER_SGD, 0, 1);
+  initialise_optimizer(&whole_optimizer, &whole, OPTIMIZER_SGD, 0, 1);
+  initialise_batch_network(&net, depth, num_nodes, batch, 1);
+  initialise_batch_network(&whole, depth, num_nodes, count, 1);
+  free(input);
+  free(target_output);
+  free(batch_input);
+  free(batch_target);
+  free(num_nodes);
+  if (worst > CHECK_TOLERANCE) {
+    printf("Error: Check: data parallel step differs by more than %g\n",
+    CHECK_TOLERANCE);
+    exit(1);
+  }
+}
+
+static void op_pipeline_gradients(void* context) {
+  PipelineContext* p = (PipelineContext*)context;
+  pipeline_gradients(
+    &p->pipeline, p->input, p->target_output, p->num_micro_batches
+  );
+}
+
+static void op_pipeline_predict(void* context) {
+  PipelineContext* p = (PipelineContext*)context;
+  pipeline_predict(&p->pipeline, p->input, p->output, p->num_micro_batches);
+}
+
+static void bench_pipeline(
+  BenchOptions* options, unsigned int width, unsigned int depth,
+  unsigned int micro_batch, unsigned int num_micro_batches,
+  unsigned int num_stages
+) {
+  // a whole batch of micro-batches through the stages, for training and
+  // for predictions; one stage is the sequential baseline
+  PipelineContext p;
+  unsigned int* num_nodes = (unsigned int*)malloc(sizeof(unsigned int) * depth);
+  for (unsigned int l = 0; l < depth; l++) {
+    num_nodes[l] = width;
+  }
+  unsigned int count = micro_batch * num_micro_batches;
+  initialise_batch_network(&p.net, depth, num_nodes, micro_batch, 0);
+  randomise_network(&p.net);
+  p.num_micro_batches = num_micro_batches;
+  p.input = (double*)malloc(sizeof(double) * width * count);
+  p.target_output = (double*)malloc(sizeof(double) * width * count);
+  p.output = (double*)malloc(sizeof(double) * width * count);
+  for (unsigned int i = 0; i < width * count; i++) {
+    p.input[i] = random_normal();
+    p.target_output[i] = random_normal();
+  }
+  start_pipeline(&p.pipeline, &p.net, num_stages, micro_batch);
+  char name[32];
+  double forward = forward_flops(&p.net) * count;
+  snprintf(name, sizeof(name), "pipeline_train_%u", num_stages);
+  report(options, name, width, depth, micro_batch,
+    time_op(options, op_pipeline_gradients, &p),
+    forward + backward_flops(&p.net) * count, count);
+  snprintf(name, sizeof(name), "pipeline_pred_%u", num_stages);
+  report(options, name, width, depth, micro_batch,
+    time_op(options, op_pipeline_predict, &p), forward, count);
+  finish_pipeline(&p.pipeline);
+  initialise_batch_network(&p.net, depth, num_nodes, micro_batch, 1);
+  free(p.input);
+  free(p.target_output);
+  free(p.output);
+  free(num_nodes);
+}
+
+int main(int argc, char** argv) {
+  BenchOptions options = {0, MIN_SECONDS};
+  unsigned int check = 0;
+  for (int a = 1; a < argc; a++) {
+    if (!strcmp(argv[a], "--json")) {
+      options.json = 1;
+    } else if (!strcmp(argv[a], "--quick")) {
+      options.min_seconds = QUICK_MIN_SECONDS;
+    } else if (!strcmp(argv[a], "--check")) {
+      check = 1;
+    } else if (!strcmp(argv[a], "--threads") && a + 1 < argc) {
+      set_num_threads(atoi(argv[++a]));
+    } else if (!strcmp(argv[a], "--isa") && a + 1 < argc) {
+      const char* name = argv[++a];
+      enum kernelIsa isa = ISA_SCALAR;
+      if (!strcmp(name, "sse2")) isa = ISA_SSE2;
+      else if (!strcmp(name, "avx2")) isa = ISA_AVX2;
+      else if (!strcmp(name, "avx512")) isa = ISA_AVX512;
+      if (!use_kernel_isa(isa)) {
+        printf("Error: Bench: this CPU does not support %s\n", name);
+        exit(1);
+      }
+    } else {
+      printf("usage: %s [--json] [--quick] [--threads N] "
+      "[--isa scalar|sse2|avx2|avx512] [--check]\n", argv[0]);
+      exit(1);
+    }
+  }
+  srand(1);
+  if (check) {
+    check_topology();
+    check_random();
+    check_mapped_load();
+    check_hot_swap();
+    for (unsigned int interval = 2; interval <= 4; interval++) {
+      check_checkpoints(interval);
+    }
+    for (unsigned int stages = 1; stages <= 4; stages++) {
+      check_pipeline(stages);
+    }
+    for (unsigned int workers = 1; workers <= 4; workers++) {
+      check_data_parallel(workers);
+    }
+    return 0;
+  }
+  if (!options.json) {
+    printf("isa: %s, threads: %u, element size: %u bytes\n",
+    kernel_isa_name(kernel_isa()), get_num_threads(),
+    (unsigned int)sizeof(real));
+    printf("%-16s %6s %5s %5s %14s %9s %14s %9s\n",
+    "benchmark", "width", "depth", "batch", "ns/op", "GFLOP/s",
+    "samples/s", "allocs/op");
+  }
+  unsigned int kernel_widths[] = {16, 64, 256, 1024};
+  for (unsigned int w = 0; w < sizeof(kernel_widths) / sizeof(*kernel_widths);
+    w++) {
+    bench_kernels(&options, kernel_widths[w]);
+  }
+  unsigned int network_widths[] = {10, 64, 256, 1024};
+  unsigned int depths[] = {2, 4, 8};
+  unsigned int batches[] = {1, 32};
+  for (unsigned int w = 0;
+    w < sizeof(network_widths) / sizeof(*network_widths); w++) {
+    for (unsigned int d = 0; d < sizeof(depths) / sizeof(*depths); d++) {
+      for (unsigned int b = 0; b < sizeof(batches) / sizeof(*batches); b++) {
+        bench_network(&options, network_widths[w], depths[d], batches[b]);
+      }
+    }
+  }
+  unsigned int optimizer_widths[] = {256, 1024};
+  for (unsigned int w = 0;
+    w < sizeof(optimizer_widths) / sizeof(*optimizer_widths); w++) {
+    bench_optimizers(&options, optimizer_widths[w], 4);
+  }
+  unsigned int workers[] = {1, 2, 4};
+  for (unsigned int w = 0; w < sizeof(workers) / sizeof(*workers); w++) {
+    bench_data_parallel(&options, 256, 4, 32, workers[w]);
+  }
+  unsigned int hogwild_threads[] = {0, 1, 2, 4, 8};
+  for (unsigned int t = 0;
+    t < sizeof(hogwild_threads) / sizeof(*hogwild_threads); t++) {
+    bench_hogwild(&options, 64, 3, 8, hogwild_threads[t]);
+  }
+  unsigned int clients[] = {1, 4, 16, 64};
+  for (unsigned int c = 0; c < sizeof(clients) / sizeof(*clients); c++) {
+    bench_server(&options, 256, 4, clients[c], 1, 0, 0);
+    bench_server(&options, 256, 4, clients[c], 32, 0, 0);
+    bench_server(&options, 256, 4, clients[c], 32, 100000, 0);
+    bench_server(&options, 256, 4, clients[c], 32, 100000, 1);
+  }
+  unsigned int quantized_widths[] = {256, 1024};
+  for (unsigned int w = 0;
+    w < sizeof(quantized_widths) / sizeof(*quantized_widths); w++) {
+    bench_quantized(&options, quantized_widths[w], 4);
+  }
+  bench_topology(&options);
+  bench_randomise(&options, 1024, 4);
+  unsigned int intervals[] = {0, 2, 4};
+  for (unsigned int i = 0; i < sizeof(intervals) / sizeof(*intervals); i++) {
+    bench_checkpoints(&options, 256, 16, 64, intervals[i]);
+  }
+  unsigned int stages[] = {1, 2, 4, 8};
+  for (unsigned int s = 0; s < sizeof(stages) / sizeof(*stages); s++) {
+    bench_pipeline(&options, 256, 16, 8, 16, stages[s]);
+  }
+  return 0;
+}
@@ -0,0 +1,218 @@
+// accuracy of the build's precision mode against double
+//
+// one batch forward pass and its gradients run through real and accum,
+// and the same network, inputs and targets are evaluated in double with
+// plain loops and libm atan; outputs, cost and gradients are compared by
+// their largest difference relative to the largest reference value, then
+// vector_atan against atan. Exits non-zero above the tolerances below.
+
+#include "network.h"
+#include "kernels.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// layer sizes are in main(); samples in the batch
+#define PRECISION_BATCH 8
+// largest difference from the double reference allowed, relative to the
+// largest reference value; the backward pass divides by x * x - 1 of each
+// activation x, which magnifies rounding for activations near 1 by a few
+// thousand, so double must agree to about 1e-12 and float and mixed to
+// about 1e-4, with ten times that to spare
+#define PRECISION_TOLERANCE (sizeof(real) == sizeof(double) ? 1e-11 : 1e-3)
+// atan's absolute error: about one ulp of its result near pi / 2 on top
+// of rounding the result to real
+#define ATAN_TOLERANCE (sizeof(real) == sizeof(double) ? 5e-16 : 2.5e-7)
+#define ATAN_CHECK_VALUES 100001
+
+typedef struct PrecisionError {
+  double largest_difference;
+  double largest_reference;
+} PrecisionError;
+
+static void compare_value(PrecisionError* error, double reference, real value) {
+  double difference = fabs(reference - value);
+  if (difference > error->largest_difference) {
+    error->largest_difference = difference;
+  }
+  if (fabs(reference) > error->largest_reference) {
+    error->largest_reference = fabs(reference);
+  }
+}
+
+static double relative_error(PrecisionError* error) {
+  return error->largest_reference
+    ? error->largest_difference / error->largest_reference : 0;
+}
+
+static double** reference_forward(
+  Network* net, double* input, unsigned int batch
+) {
+  // activations[l] is layer l's input, activations[num_layers] the output,
+  // one row per node and one column per sample
+  unsigned int num_layers = net->num_layers;
+  double** activations = (double**)malloc(
+    sizeof(double*) * (num_layers + 1)
+  );
+  activations[0] = input;
+  for (unsigned int l = 0; l < num_layers; l++) {
+    Layer* layer = &net->layers[l];
+    unsigned int rows = layer->biases->rows;
+    activations[l+1] = (double*)malloc(sizeof(double) * rows * batch);
+    for (unsigned int r = 0; r < rows; r++) {
+      for (unsigned int b = 0; b < batch; b++) {
+        double sum = get_element(layer->biases, r, 0);
+        if (layer->layer_type != LAYER_OUTPUT) {
+          for (unsigned int c = 0; c < net->num_nodes[l]; c++) {
+            sum += (double)get_element(layer->weights, r, c)
+              * activations[l][(size_t)c * batch + b];
+          }
+        } else {
+          sum += activations[l][(size_t)r * batch + b];
+        }
+        activations[l+1][(size_t)r * batch + b] = atan(sum);
+      }
+    }
+  }
+  return activations;
+}
+
+static void compare_gradients(
+  Network* net, double** activations, double* delta, unsigned int batch,
+  PrecisionError* error
+) {
+  // backpropagation from the output delta down to layer 1, layer 0 is
+  // never trained; the delta is consumed
+  for (unsigned int l = net->num_layers - 1; l > 0; l--) {
+    Layer* layer = &net->layers[l];
+    unsigned int rows = layer->biases->rows;
+    unsigned int inputs = net->num_nodes[l];
+    unsigned int has_weights = (layer->layer_type != LAYER_OUTPUT);
+    double* previous = activations[l];
+    for (unsigned int r = 0; r < rows; r++) {
+      double sum = 0;
+      for (unsigned int b = 0; b < batch; b++) {
+        sum += delta[(size_t)r * batch + b];
+      }
+      compare_value(error, sum, get_element(layer->bias_delta, r, 0));
+    }
+    for (unsigned int r = 0; has_weights && r < rows; r++) {
+      for (unsigned int c = 0; c < inputs; c++) {
+        double sum = 0;
+        for (unsigned int b = 0; b < batch; b++) {
+          sum += delta[(size_t)r * batch + b]
+            * previous[(size_t)c * batch + b];
+        }
+        compare_value(error, sum, get_element(layer->weight_delta, r, c));
+      }
+    }
+    double* next_delta = (double*)malloc(sizeof(double) * inputs * batch);
+    for (unsigned int c = 0; c < inputs; c++) {
+      for (unsigned int b = 0; b < batch; b++) {
+        size_t at = (size_t)c * batch + b;
+        if (!has_weights) {
+          // the output layer's delta passes straight back
+          next_delta[at] = delta[at];
+          continue;
+        }
+        double sum = 0;
+        for (unsigned int r = 0; r < rows; r++) {
+          sum += (double)get_element(layer->weights, r, c)
+            * delta[(size_t)r * batch + b];
+        }
+        next_delta[at] = sum / (previous[at] * previous[at] - 1);
+      }
+    }
+    free(delta);
+    delta = next_delta;
+  }
+  free(delta);
+}
+
+static double atan_error() {
+  // vector_atan over both flat tails and the curved middle
+  size_t size = (sizeof(real) * ATAN_CHECK_VALUES + 63) / 64 * 64;
+  real* input = (real*)aligned_alloc(64, size);
+  real* output = (real*)aligned_alloc(64, size);
+  for (unsigned int i = 0; i < ATAN_CHECK_VALUES; i++) {
+    input[i] = -20 + 40.0 * i / (ATAN_CHECK_VALUES - 1);
+  }
+  vector_atan(input, output, ATAN_CHECK_VALUES);
+  double worst = 0;
+  for (unsigned int i = 0; i < ATAN_CHECK_VALUES; i++) {
+    double difference = fabs(output[i] - atan((double)input[i]));
+    if (difference > worst) worst = difference;
+  }
+  free(input);
+  free(output);
+  return worst;
+}
+
+int main() {
+  unsigned int num_nodes[] = {24, 48, 48, 12};
+  unsigned int num_layers = 4;
+  unsigned int batch = PRECISION_BATCH;
+  unsigned int outputs = num_nodes[num_layers-1];
+  srand(1);
+  Network net;
+  initialise_batch_network(&net, num_layers, num_nodes, batch, 0);
+  randomise_network(&net);
+  double* input = (double*)malloc(sizeof(double) * num_nodes[0] * batch);
+  double* target = (double*)malloc(sizeof(double) * outputs * batch);
+  for (unsigned int i = 0; i < num_nodes[0] * batch; i++) {
+    input[i] = random_normal();
+  }
+  for (unsigned int i = 0; i < outputs * batch; i++) {
+    target[i] = random_normal();
+  }
+  // learning rates of 0 leave the parameters alone and the gradients in
+  // the layers' weight_delta and bias_delta
+  forward_pass(&net, input, target);
+  backpropagate(&net, 0, 0);
+  double** activations = reference_forward(&net, input, batch);
+  PrecisionError output_error = {0, 0};
+  double reference_cost = 0;
+  double* delta = (double*)malloc(sizeof(double) * outputs * batch);
+  for (unsigned int r = 0; r < outputs; r++) {
+    for (unsigned int b = 0; b < batch; b++) {
+      double output = activations[num_layers][(size_t)r * batch + b];
+      double expected = target[(size_t)r * batch + b];
+      compare_value(&output_error, output, get_element(net.output, r, b));
+      reference_cost += fabs(expected - output);
+      delta[(size_t)r * batch + b] = output - expected;
+    }
+  }
+  PrecisionError cost_error = {
+    fabs(reference_cost - net.total_cost), fabs(reference_cost)
+  };
+  PrecisionError gradient_error = {0, 0};
+  compare_gradients(&net, activations, delta, batch, &gradient_error);
+  double worst_atan = atan_error();
+  printf("precision: element size %u, accumulator size %u, relative "
+  "difference from double: output %g, cost %g, gradients %g; atan error "
+  "%g\n", (unsigned int)sizeof(real), (unsigned int)sizeof(accum),
+  relative_error(&output_error), relative_error(&cost_error),
+  relative_error(&gradient_error), worst_atan);
+  unsigned int failed = (
+    relative_error(&output_error) > PRECISION_TOLERANCE
+    || relative_error(&cost_error) > PRECISION_TOLERANCE
+    || relative_error(&gradient_error) > PRECISION_TOLERANCE
+  );
+  for (unsigned int l = 1; l <= num_layers; l++) {
+    free(activations[l]);
+  }
+  free(activations);
+  free(input);
+  free(target);
+  initialise_batch_network(&net, num_layers, num_nodes, batch, 1);
+  if (failed) {
+    printf("Error: Check: passes differ from double by more than %g\n",
+    PRECISION_TOLERANCE);
+    return 1;
+  } else if (worst_atan > ATAN_TOLERANCE) {
+    printf("Error: Check: vector_atan is off by more than %g\n",
+    ATAN_TOLERANCE);
+    return 1;
+  }
+  return 0;
+}
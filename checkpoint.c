@@ -0,0 +1,147 @@
+#include "checkpoint.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long checksum_bytes(
+  unsigned long long hash, const unsigned char* data, size_t size
+) {
+  // FNV-1a 64
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+static size_t align_up(size_t size) {
+  size_t mask = CHECKPOINT_ALIGNMENT - 1;
+  return (size + mask) & ~mask;
+}
+
+void save_network(Network* net, const char* path) {
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.version = CHECKPOINT_VERSION;
+  header.num_layers = net->num_layers;
+  header.element_size = sizeof(real);
+  header.data_offset = align_up(
+    sizeof(header) + sizeof(uint32_t) * net->num_layers
+  );
+  // the parameter slab is written as it is, padding included
+  header.data_size = sizeof(real) * net->num_parameters;
+  header.checksum = checksum_bytes(
+    FNV_OFFSET_BASIS, (const unsigned char*)net->parameters,
+    header.data_size
+  );
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    printf("Error: Checkpoint: could not open %s for writing\n", path);
+    exit(1);
+  }
+  size_t prefix_size = header.data_offset;
+  unsigned char* prefix = (unsigned char*)calloc(prefix_size, 1);
+  for (unsigned int l = 0; l < net->num_layers; l++) {
+    uint32_t nodes = net->num_nodes[l];
+    memcpy(prefix + sizeof(header) + sizeof(uint32_t) * l, &nodes, 4);
+  }
+  memcpy(prefix, &header, sizeof(header));
+  if (fwrite(prefix, 1, prefix_size, file) != prefix_size
+    || fwrite(net->parameters, 1, header.data_size, file) != header.data_size
+    || fclose(file)) {
+    printf("Error: Checkpoint: could not write %s\n", path);
+    exit(1);
+  }
+  free(prefix);
+}
+
+void load_network(
+  Network* net, const char* path, unsigned int batch_size,
+  unsigned int verify_checksum
+) {
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info)) {
+    printf("Error: Checkpoint: could not open %s\n", path);
+    exit(1);
+  }
+  size_t file_size = info.st_size;
+  if (file_size < sizeof(CheckpointHeader)) {
+    printf("Error: Checkpoint: %s is too small\n", path);
+    exit(1);
+  }
+  // private mapping: pages are shared with the page cache until written
+  unsigned char* mapping = (unsigned char*)mmap(
+    NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0
+  );
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("Error: Checkpoint: could not map %s\n", path);
+    exit(1);
+  }
+  CheckpointHeader* header = (CheckpointHeader*)mapping;
+  if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic))) {
+    printf("Error: Checkpoint: %s is not a network checkpoint\n", path);
+    exit(1);
+  } else if (header->version != CHECKPOINT_VERSION
+    || header->element_size != sizeof(real)) {
+    printf("Error: Checkpoint: %s has version %d, element size %d, "
+    "expected version %d, element size %d\n",
+    path, header->version, header->element_size,
+    CHECKPOINT_VERSION, (int)sizeof(real));
+    exit(1);
+  } else if (header->num_layers == 0
+    || header->data_offset < sizeof(CheckpointHeader)
+      + sizeof(uint32_t) * (size_t)header->num_layers
+    || header->data_offset % CHECKPOINT_ALIGNMENT
+    || header->data_offset > file_size
+    || header->data_size > file_size - header->data_offset) {
+    // the sizes are compared one at a time so a corrupt header cannot
+    // wrap their sum around
+    printf("Error: Checkpoint: %s is truncated or corrupt\n", path);
+    exit(1);
+  }
+  unsigned char* data = mapping + header->data_offset;
+  if (verify_checksum) {
+    unsigned long long checksum = checksum_bytes(
+      FNV_OFFSET_BASIS, data, header->data_size
+    );
+    if (checksum != header->checksum) {
+      printf("Error: Checkpoint: checksum mismatch in %s\n", path);
+      exit(1);
+    }
+  }
+  // the layer sizes are read in place as well
+  unsigned int* num_nodes = (unsigned int*)(
+    mapping + sizeof(CheckpointHeader)
+  );
+  for (unsigned int l = 0; l < header->num_layers; l++) {
+    if (!num_nodes[l]) {
+      printf("Error: Checkpoint: %s has an empty layer %u\n", path, l);
+      exit(1);
+    }
+  }
+  // the parameters stay in the mapping, the network never allocates a slab
+  initialise_network_without_parameters(
+    net, header->num_layers, num_nodes, batch_size, 0
+  );
+  size_t expected_size = sizeof(real) * net->num_parameters;
+  if (expected_size != header->data_size) {
+    printf("Error: Checkpoint: %s holds %llu bytes of parameters, "
+    "its layer sizes need %zu\n", path, header->data_size, expected_size);
+    exit(1);
+  }
+  // the data region is laid out exactly like the parameter slab
+  use_parameter_slab(net, (real*)data);
+  net->mapping = mapping;
+  net->mapping_size = file_size;
+}
@@ -0,0 +1,45 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "network.h"
+
+// binary model checkpoints
+//
+// layout, in native byte order:
+//   CheckpointHeader
+//   uint32 num_nodes[num_layers]
+//   the network's parameter slab at data_offset, a CHECKPOINT_ALIGNMENT
+//   byte boundary: every layer's weights then every layer's biases, each
+//   block zero padded to the next MATRIX_ALIGNMENT boundary, and every row
+//   of the weights padded to padded_stride() elements
+// the checksum is FNV-1a 64 over the whole parameter data region
+
+#define CHECKPOINT_MAGIC "SFFNET\r\n"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_ALIGNMENT 64
+
+typedef struct CheckpointHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int num_layers;
+  unsigned int element_size;
+  unsigned int reserved;
+  unsigned long long data_offset;
+  unsigned long long data_size;
+  unsigned long long checksum;
+} CheckpointHeader;
+
+void save_network(Network* net, const char* path);
+
+// maps the file and uses the mapped pages as the parameter slab (copy on
+// write, so the loaded network can still be trained without touching the
+// file); no parameter memory of its own is allocated, so pages are only
+// read in as predict() touches them. The network is then released with
+// initialise_network(..., 1) as usual; a batch_size of 0 loads an
+// inference-only network for predict()
+void load_network(
+  Network* net, const char* path, unsigned int batch_size,
+  unsigned int verify_checksum
+);
+
+#endif
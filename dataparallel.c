@@ -0,0 +1,249 @@
+#include "dataparallel.h"
+#include "kernels.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct DataParallelShared {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  // per layer, counted over every step so far: workers whose gradients
+  // are in their slab, then workers whose slice of the sum is done
+  unsigned long counters[];
+};
+
+static unsigned long* published(DataParallel* dp, unsigned int layer) {
+  return &dp->shared->counters[layer];
+}
+
+static unsigned long* summed(DataParallel* dp, unsigned int layer) {
+  return &dp->shared->counters[dp->net->num_layers + layer];
+}
+
+static void data_parallel_error(const char* message) {
+  printf("Error: Data parallel: %s\n", message);
+  exit(1);
+}
+
+static void publish_layer(void* context, unsigned int layer) {
+  // the gradient ready hook, this worker's slab holds the layer
+  DataParallel* dp = (DataParallel*)context;
+  pthread_mutex_lock(&dp->shared->lock);
+  (*published(dp, layer))++;
+  pthread_cond_broadcast(&dp->shared->changed);
+  pthread_mutex_unlock(&dp->shared->lock);
+}
+
+static void sum_slice(
+  DataParallel* dp, real* sum, size_t offset, size_t length
+) {
+  // this worker's slice of [offset, offset + length), split on whole
+  // MATRIX_ALIGNMENT blocks so no two workers write the same cache line
+  size_t per_block = MATRIX_ALIGNMENT / sizeof(real);
+  unsigned int num_workers = dp->num_workers;
+  size_t begin = length * dp->rank / num_workers / per_block * per_block;
+  size_t end = length;
+  if (dp->rank + 1 < num_workers) {
+    end = length * (dp->rank + 1) / num_workers / per_block * per_block;
+  }
+  if (end <= begin) {
+    return;
+  }
+  size_t n = end - begin;
+  size_t slab = dp->net->num_parameters;
+  real* out = sum + offset + begin;
+  const real* in = dp->worker_gradients + offset + begin;
+  vector_copy(in, out, n);
+  for (unsigned int w = 1; w < num_workers; w++) {
+    vector_add(out, in + w * slab, out, n);
+  }
+}
+
+static void* reduce_layers(void* context) {
+  // sums this worker's slice of each layer once every worker has
+  // published it, in the order backpropagation produces them
+  DataParallel* dp = (DataParallel*)context;
+  Network* net = dp->net;
+  for (unsigned long step = 1;; step++) {
+    unsigned long expected = step * dp->num_workers;
+    real* sum = dp->sums[step & 1];
+    for (unsigned int l = net->num_layers - 1; l > 0; l--) {
+      pthread_mutex_lock(&dp->shared->lock);
+      while (*published(dp, l) < expected && !dp->stop) {
+        pthread_cond_wait(&dp->shared->changed, &dp->shared->lock);
+      }
+      unsigned int stop = dp->stop;
+      pthread_mutex_unlock(&dp->shared->lock);
+      if (stop) {
+        return NULL;
+      }
+      sum_slice(dp, sum, dp->weight_offsets[l], dp->weight_lengths[l]);
+      sum_slice(dp, sum, dp->bias_offsets[l], dp->bias_lengths[l]);
+      pthread_mutex_lock(&dp->shared->lock);
+      (*summed(dp, l))++;
+      pthread_cond_broadcast(&dp->shared->changed);
+      pthread_mutex_unlock(&dp->shared->lock);
+    }
+  }
+}
+
+static void measure_layers(DataParallel* dp) {
+  // where each layer's gradients sit in the slab, the same in every copy
+  Network* net = dp->net;
+  unsigned int num_layers = net->num_layers;
+  dp->weight_offsets = (size_t*)calloc(num_layers, sizeof(size_t));
+  dp->weight_lengths = (size_t*)calloc(num_layers, sizeof(size_t));
+  dp->bias_offsets = (size_t*)calloc(num_layers, sizeof(size_t));
+  dp->bias_lengths = (size_t*)calloc(num_layers, sizeof(size_t));
+  for (unsigned int l = 0; l < num_layers; l++) {
+    Layer* layer = &net->layers[l];
+    if (layer->weight_delta) {
+      Matrix* weight_delta = layer->weight_delta;
+      dp->weight_offsets[l] = weight_delta->matrix_data - net->gradients;
+      dp->weight_lengths[l] = (size_t)weight_delta->rows * weight_delta->stride;
+    }
+    dp->bias_offsets[l] = layer->bias_delta->matrix_data - net->gradients;
+    dp->bias_lengths[l] = layer->bias_delta->rows;
+  }
+}
+
+unsigned int start_data_parallel(
+  DataParallel* dp, Network* net, unsigned int num_workers
+) {
+  if (!net->gradients) {
+    data_parallel_error("network was not created for training");
+  }
+  if (num_workers == 0) {
+    data_parallel_error("needs at least one worker");
+  }
+  dp->net = net;
+  dp->num_workers = num_workers;
+  dp->step = 0;
+  dp->stop = 0;
+  measure_layers(dp);
+  // counters, then the worker slabs and the two sums, all on
+  // MATRIX_ALIGNMENT boundaries
+  size_t header = sizeof(DataParallelShared)
+    + 2 * net->num_layers * sizeof(unsigned long);
+  header = (header + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT
+    * MATRIX_ALIGNMENT;
+  size_t slab_bytes = sizeof(real) * net->num_parameters;
+  dp->shared_size = header + (num_workers + 2) * slab_bytes;
+  void* mapping = mmap(
+    NULL, dp->shared_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_ANONYMOUS, -1, 0
+  );
+  if (mapping == MAP_FAILED) {
+    data_parallel_error("could not map shared memory");
+  }
+  dp->shared = (DataParallelShared*)mapping;
+  dp->worker_gradients = (real*)((char*)mapping + header);
+  dp->sums[0] = dp->worker_gradients + num_workers * net->num_parameters;
+  dp->sums[1] = dp->sums[0] + net->num_parameters;
+  pthread_mutexattr_t mutex_attributes;
+  pthread_mutexattr_init(&mutex_attributes);
+  pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&dp->shared->lock, &mutex_attributes);
+  pthread_mutexattr_destroy(&mutex_attributes);
+  pthread_condattr_t cond_attributes;
+  pthread_condattr_init(&cond_attributes);
+  pthread_condattr_setpshared(&cond_attributes, PTHREAD_PROCESS_SHARED);
+  pthread_cond_init(&dp->shared->changed, &cond_attributes);
+  pthread_condattr_destroy(&cond_attributes);
+  // buffered output would otherwise be printed once per worker
+  fflush(stdout);
+  dp->workers = (pid_t*)calloc(num_workers, sizeof(pid_t));
+  dp->rank = 0;
+  for (unsigned int w = 1; w < num_workers; w++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      data_parallel_error("could not start a worker");
+    }
+    if (pid == 0) {
+      dp->rank = w;
+      break;
+    }
+    dp->workers[w] = pid;
+  }
+  // backpropagate straight into this worker's shared slab
+  dp->own_gradients = use_gradient_slab(
+    net, dp->worker_gradients + dp->rank * net->num_parameters
+  );
+  net->gradient_ready = publish_layer;
+  net->gradient_ready_context = dp;
+  if (pthread_create(&dp->reducer, NULL, reduce_layers, dp)) {
+    data_parallel_error("could not start the reducer thread");
+  }
+  return dp->rank;
+}
+
+void data_parallel_step(DataParallel* dp, Optimizer* optimizer) {
+  Network* net = dp->net;
+  dp->step++;
+  compute_gradients(net);
+  unsigned long expected = dp->step * dp->num_workers;
+  // time spent waiting for the other workers' sums after backpropagation
+  PROFILE_START(start);
+  pthread_mutex_lock(&dp->shared->lock);
+  for (unsigned int l = net->num_layers - 1; l > 0; l--) {
+    while (*summed(dp, l) < expected) {
+      pthread_cond_wait(&dp->shared->changed, &dp->shared->lock);
+    }
+  }
+  pthread_mutex_unlock(&dp->shared->lock);
+  PROFILE_END(start, "allreduce_wait", -1, 0, 0);
+  // the input layer's gradients are never written, so its part of the
+  // sums stays zero like in a single network
+  real* own = net->gradients;
+  net->gradients = dp->sums[dp->step & 1];
+  optimizer_step(optimizer, net);
+  net->gradients = own;
+}
+
+void data_parallel_shard(
+  DataParallel* dp, unsigned int count, unsigned int* begin,
+  unsigned int* end
+) {
+  *begin = (unsigned int)((unsigned long long)count * dp->rank
+    / dp->num_workers);
+  *end = (unsigned int)((unsigned long long)count * (dp->rank + 1)
+    / dp->num_workers);
+}
+
+void finish_data_parallel(DataParallel* dp) {
+  Network* net = dp->net;
+  pthread_mutex_lock(&dp->shared->lock);
+  dp->stop = 1;
+  pthread_cond_broadcast(&dp->shared->changed);
+  pthread_mutex_unlock(&dp->shared->lock);
+  pthread_join(dp->reducer, NULL);
+  net->gradient_ready = NULL;
+  net->gradient_ready_context = NULL;
+  // hand the network back its own slab with the last gradients in it
+  real* shared_gradients = use_gradient_slab(net, dp->own_gradients);
+  vector_copy(shared_gradients, net->gradients, net->num_parameters);
+  free(dp->weight_offsets);
+  free(dp->weight_lengths);
+  free(dp->bias_offsets);
+  free(dp->bias_lengths);
+  if (dp->rank != 0) {
+    exit(0);
+  }
+  unsigned int failed = 0;
+  for (unsigned int w = 1; w < dp->num_workers; w++) {
+    int status;
+    if (waitpid(dp->workers[w], &status, 0) < 0
+      || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      failed = 1;
+    }
+  }
+  free(dp->workers);
+  munmap(dp->shared, dp->shared_size);
+  if (failed) {
+    data_parallel_error("a worker did not finish");
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef DATAPARALLEL_H
+#define DATAPARALLEL_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "network.h"
+#include "optimizer.h"
+
+// data parallel training across worker processes on one host
+//
+// start_data_parallel() forks the workers, each with a replica of the
+// network; every step each worker computes gradients on its own shard of
+// samples and the workers sum them through shared memory. Every worker
+// owns a slice of each layer's gradients and sums that slice over all
+// workers, then the summed slab is read back by everyone. A reducer
+// thread in each worker handles a layer as soon as every worker's
+// backpropagation has finished it, so the reduction of layer k+1 overlaps
+// with the gradients of layer k. The workers add in a fixed order, so
+// every replica applies bit-identical updates and stays in step.
+
+typedef struct DataParallelShared DataParallelShared;
+
+typedef struct DataParallel {
+  Network* net;
+  unsigned int num_workers;
+  unsigned int rank;
+  pid_t* workers;
+  // the shared mapping: counters, one gradient slab per worker and two
+  // slabs of sums used on alternate steps
+  DataParallelShared* shared;
+  size_t shared_size;
+  real* worker_gradients;
+  real* sums[2];
+  // the network's own gradient slab while it uses the shared one
+  real* own_gradients;
+  // slab offsets and lengths of each layer's weight and bias gradients
+  size_t* weight_offsets;
+  size_t* weight_lengths;
+  size_t* bias_offsets;
+  size_t* bias_lengths;
+  unsigned long step;
+  pthread_t reducer;
+  unsigned int stop;
+} DataParallel;
+
+// forks num_workers - 1 copies of the calling process, every worker
+// returns from here with its own rank, 0 in the caller; call before
+// anything else starts threads that the workers need
+unsigned int start_data_parallel(
+  DataParallel* dp, Network* net, unsigned int num_workers
+);
+
+// gradients of this worker's last forward pass, summed over every worker,
+// then one optimizer step; the sum over workers each with a batch of B
+// equals the gradient of one network with a batch of num_workers * B
+void data_parallel_step(DataParallel* dp, Optimizer* optimizer);
+
+// the samples [begin, end) of count that this worker trains on
+void data_parallel_shard(
+  DataParallel* dp, unsigned int count, unsigned int* begin,
+  unsigned int* end
+);
+
+// every worker but rank 0 exits here, rank 0 waits for them and returns
+// with its network as it was before, now trained
+void finish_data_parallel(DataParallel* dp);
+
+#endif
@@ -0,0 +1,276 @@
+#include "dataset.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void dataset_error(Dataset* d, const char* message) {
+  printf("Error: Dataset: %s %s\n", d->path, message);
+  exit(1);
+}
+
+static size_t sample_size(Dataset* d) {
+  return d->input_size + d->output_size;
+}
+
+static unsigned int random_below(Dataset* d, unsigned int n) {
+  // xorshift64*, the background thread must not share rand()'s state
+  d->random_state ^= d->random_state >> 12;
+  d->random_state ^= d->random_state << 25;
+  d->random_state ^= d->random_state >> 27;
+  unsigned long long r = d->random_state * 2685821657736338717ULL;
+  return (unsigned int)(((r >> 32) * n) >> 32);
+}
+
+static size_t read_chunk(Dataset* d) {
+  // keep the unread tail of the chunk and top it up from the file
+  size_t tail = d->chunk_length - d->chunk_used;
+  memmove(d->chunk, d->chunk + d->chunk_used, tail);
+  d->chunk_used = 0;
+  d->chunk_length = tail;
+  size_t got = fread(
+    d->chunk + tail, 1, DATASET_CHUNK_BYTES - tail, d->file
+  );
+  if (!got && ferror(d->file)) {
+    dataset_error(d, "could not be read");
+  }
+  d->chunk_length += got;
+  return got;
+}
+
+static int read_binary_sample(Dataset* d, double* sample) {
+  size_t size = sizeof(double) * sample_size(d);
+  while (d->chunk_length - d->chunk_used < size) {
+    if (!read_chunk(d)) {
+      if (d->chunk_length > d->chunk_used) {
+        dataset_error(d, "does not hold a whole number of samples");
+      }
+      return 0;
+    }
+  }
+  memcpy(sample, d->chunk + d->chunk_used, size);
+  d->chunk_used += size;
+  return 1;
+}
+
+static int parse_csv_line(Dataset* d, char* line, double* sample) {
+  // returns 0 for a blank line
+  size_t size = sample_size(d);
+  size_t count = 0;
+  char* cursor = line;
+  while (count < size) {
+    char* end;
+    double value = strtod(cursor, &end);
+    if (end == cursor) {
+      break;
+    }
+    sample[count++] = value;
+    cursor = end;
+    while (*cursor == ' ' || *cursor == '\t') cursor++;
+    if (*cursor == ',') cursor++;
+  }
+  while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r') cursor++;
+  if (!count && !*cursor) {
+    return 0;
+  }
+  if (count != size || *cursor) {
+    dataset_error(d, "has a line without exactly one value per node");
+  }
+  return 1;
+}
+
+static int read_csv_sample(Dataset* d, double* sample) {
+  for (;;) {
+    char* line = d->chunk + d->chunk_used;
+    char* newline = memchr(line, '\n', d->chunk_length - d->chunk_used);
+    if (!newline) {
+      if (d->chunk_length - d->chunk_used == DATASET_CHUNK_BYTES) {
+        dataset_error(d, "has a line longer than a chunk");
+      }
+      if (read_chunk(d)) {
+        continue;
+      }
+      if (d->chunk_used == d->chunk_length) {
+        return 0;
+      }
+      // the last line has no newline, the chunk has a spare byte for one
+      newline = d->chunk + d->chunk_length++;
+    }
+    *newline = '\0';
+    d->chunk_used = newline + 1 - d->chunk;
+    if (parse_csv_line(d, line, sample)) {
+      return 1;
+    }
+  }
+}
+
+static int read_sample(Dataset* d, double* sample) {
+  // at the end of a looping dataset start again from the top, a pass that
+  // yields nothing at all means the file has no samples
+  for (unsigned int pass = 0; pass < 2; pass++) {
+    int got = (d->format == DATASET_CSV)
+      ? read_csv_sample(d, sample)
+      : read_binary_sample(d, sample);
+    if (got) {
+      return 1;
+    }
+    if (!d->loop) {
+      return 0;
+    }
+    rewind(d->file);
+    d->chunk_used = 0;
+    d->chunk_length = 0;
+  }
+  dataset_error(d, "has no samples");
+  return 0;
+}
+
+static unsigned int fill_batch(Dataset* d, unsigned int slot) {
+  // draw random samples from the window, refilling it from the file, and
+  // scatter each one into a column of the batch
+  size_t size = sample_size(d);
+  unsigned int batch_size = d->batch_size;
+  double* input = d->inputs[slot];
+  double* target = d->targets[slot];
+  memset(input, 0, sizeof(double) * d->input_size * batch_size);
+  memset(target, 0, sizeof(double) * d->output_size * batch_size);
+  unsigned int count = 0;
+  for (; count < batch_size; count++) {
+    while (d->window_fill < d->window_size && !d->end_of_file) {
+      if (read_sample(d, d->window + size * d->window_fill)) {
+        d->window_fill++;
+      } else {
+        d->end_of_file = 1;
+      }
+    }
+    if (!d->window_fill) {
+      break;
+    }
+    unsigned int j = random_below(d, d->window_fill);
+    double* sample = d->window + size * j;
+    for (unsigned int i = 0; i < d->input_size; i++) {
+      input[i * batch_size + count] = sample[i];
+    }
+    for (unsigned int o = 0; o < d->output_size; o++) {
+      target[o * batch_size + count] = sample[d->input_size + o];
+    }
+    // the last sample in the window takes the drawn one's place
+    d->window_fill--;
+    if (j != d->window_fill) {
+      memcpy(
+        sample, d->window + size * d->window_fill, sizeof(double) * size
+      );
+    }
+  }
+  return count;
+}
+
+static void* prefetch_batches(void* context) {
+  Dataset* d = (Dataset*)context;
+  unsigned int slot = 0;
+  for (;;) {
+    pthread_mutex_lock(&d->lock);
+    while (d->full[slot] && !d->stop) {
+      pthread_cond_wait(&d->changed, &d->lock);
+    }
+    unsigned int stop = d->stop;
+    pthread_mutex_unlock(&d->lock);
+    if (stop) {
+      break;
+    }
+    unsigned int count = fill_batch(d, slot);
+    pthread_mutex_lock(&d->lock);
+    d->counts[slot] = count;
+    d->full[slot] = 1;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+    if (!count) {
+      break;
+    }
+    slot ^= 1;
+  }
+  return NULL;
+}
+
+void open_dataset(
+  Dataset* dataset, const char* path, enum datasetFormat format,
+  unsigned int input_size, unsigned int output_size, unsigned int batch_size,
+  unsigned int shuffle_window, unsigned int loop, unsigned int seed
+) {
+  Dataset* d = dataset;
+  memset(d, 0, sizeof(*d));
+  d->path = path;
+  d->format = format;
+  d->input_size = input_size;
+  d->output_size = output_size;
+  d->batch_size = batch_size;
+  d->loop = loop;
+  d->window_size = shuffle_window ? shuffle_window : 1;
+  d->random_state = seed + 0x9E3779B97F4A7C15ULL;
+  if (!input_size || !output_size || !batch_size) {
+    dataset_error(d, "needs nodes and a batch size");
+  }
+  if (sizeof(double) * sample_size(d) > DATASET_CHUNK_BYTES) {
+    dataset_error(d, "has samples larger than a chunk");
+  }
+  d->file = fopen(path, (format == DATASET_CSV) ? "r" : "rb");
+  if (!d->file) {
+    dataset_error(d, "could not be opened");
+  }
+  d->chunk = (char*)malloc(DATASET_CHUNK_BYTES + 1);
+  d->window = (double*)malloc(
+    sizeof(double) * sample_size(d) * d->window_size
+  );
+  for (unsigned int slot = 0; slot < 2; slot++) {
+    d->inputs[slot] = (double*)malloc(
+      sizeof(double) * input_size * batch_size
+    );
+    d->targets[slot] = (double*)malloc(
+      sizeof(double) * output_size * batch_size
+    );
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->changed, NULL);
+  if (pthread_create(&d->thread, NULL, prefetch_batches, d)) {
+    dataset_error(d, "could not start its prefetch thread");
+  }
+}
+
+unsigned int next_batch(Dataset* dataset, double** input, double** target) {
+  Dataset* d = dataset;
+  pthread_mutex_lock(&d->lock);
+  if (d->holding) {
+    // hand the previous batch back to the prefetch thread
+    d->full[d->consumer_slot] = 0;
+    d->consumer_slot ^= 1;
+    d->holding = 0;
+    pthread_cond_broadcast(&d->changed);
+  }
+  unsigned int slot = d->consumer_slot;
+  while (!d->full[slot]) {
+    pthread_cond_wait(&d->changed, &d->lock);
+  }
+  unsigned int count = d->counts[slot];
+  // the empty batch at the end stays put so later calls also return 0
+  d->holding = (count > 0);
+  pthread_mutex_unlock(&d->lock);
+  *input = d->inputs[slot];
+  *target = d->targets[slot];
+  return count;
+}
+
+void close_dataset(Dataset* dataset) {
+  Dataset* d = dataset;
+  pthread_mutex_lock(&d->lock);
+  d->stop = 1;
+  pthread_cond_broadcast(&d->changed);
+  pthread_mutex_unlock(&d->lock);
+  pthread_join(d->thread, NULL);
+  pthread_mutex_destroy(&d->lock);
+  pthread_cond_destroy(&d->changed);
+  fclose(d->file);
+  free(d->chunk);
+  free(d->window);
+  for (unsigned int slot = 0; slot < 2; slot++) {
+    free(d->inputs[slot]);
+    free(d->targets[slot]);
+  }
+}
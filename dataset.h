@@ -0,0 +1,67 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+// streams training samples from a file on disk
+//
+// every sample is input_size inputs followed by output_size targets:
+//   DATASET_BINARY  native doubles, back to back with no header
+//   DATASET_CSV     one sample per line, comma separated
+// the file is read in fixed size chunks and samples pass through a shuffle
+// window, so memory use does not depend on the size of the file; a
+// background thread assembles the next batch while the current one trains
+
+#define DATASET_CHUNK_BYTES (1 << 20)
+
+enum datasetFormat {DATASET_BINARY, DATASET_CSV};
+
+typedef struct Dataset {
+  FILE* file;
+  const char* path;
+  enum datasetFormat format;
+  unsigned int input_size;
+  unsigned int output_size;
+  unsigned int batch_size;
+  // rewind at the end of the file instead of stopping
+  unsigned int loop;
+  unsigned int end_of_file;
+  // raw bytes of the current chunk
+  char* chunk;
+  size_t chunk_used;
+  size_t chunk_length;
+  // samples waiting to be drawn in random order
+  double* window;
+  unsigned int window_size;
+  unsigned int window_fill;
+  unsigned long long random_state;
+  // double buffered batches, nodes x batch like forward_pass expects
+  double* inputs[2];
+  double* targets[2];
+  unsigned int counts[2];
+  unsigned int full[2];
+  unsigned int consumer_slot;
+  unsigned int holding;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  unsigned int stop;
+} Dataset;
+
+// a shuffle_window of 1 keeps the file order, the seed makes the order
+// reproducible
+void open_dataset(
+  Dataset* dataset, const char* path, enum datasetFormat format,
+  unsigned int input_size, unsigned int output_size, unsigned int batch_size,
+  unsigned int shuffle_window, unsigned int loop, unsigned int seed
+);
+
+// points input and target at the next batch and returns how many samples
+// it holds, the columns past that are zero; returns 0 once a non-looping
+// dataset is exhausted; the batch stays valid until the next call
+unsigned int next_batch(Dataset* dataset, double** input, double** target);
+
+void close_dataset(Dataset* dataset);
+
+#endif
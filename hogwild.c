@@ -0,0 +1,131 @@
+#include "hogwild.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void hogwild_error(const char* message) {
+  printf("Error: Hogwild: %s\n", message);
+  exit(1);
+}
+
+static void gather_batch(
+  double* samples, unsigned int count, unsigned int rows,
+  unsigned long first, unsigned int batch_size, double* batch
+) {
+  // samples first, first + 1, ... wrapping around count, one column each
+  for (unsigned int b = 0; b < batch_size; b++) {
+    double* sample = samples + (size_t)((first + b) % count) * rows;
+    for (unsigned int r = 0; r < rows; r++) {
+      batch[(size_t)r * batch_size + b] = sample[r];
+    }
+  }
+}
+
+static void* train_thread(void* context) {
+  HogwildThread* thread = (HogwildThread*)context;
+  Hogwild* hogwild = thread->hogwild;
+  Network* replica = &thread->replica;
+  unsigned int inputs = replica->num_nodes[0];
+  unsigned int outputs = replica->num_nodes[replica->num_layers-1];
+  for (unsigned long s = 0; s < hogwild->steps; s++) {
+    PROFILE_START(start);
+    // thread t takes every num_threads-th batch, starting with the t-th
+    unsigned long first = (
+      (s * hogwild->num_threads + thread->index) * hogwild->batch_size
+    );
+    gather_batch(
+      hogwild->samples, hogwild->count, inputs, first, hogwild->batch_size,
+      thread->input
+    );
+    gather_batch(
+      hogwild->targets, hogwild->count, outputs, first, hogwild->batch_size,
+      thread->target_output
+    );
+    forward_pass(replica, thread->input, thread->target_output);
+    // the update is written to the shared slab without synchronisation
+    optimise(&thread->optimizer, replica);
+    PROFILE_END(start, "hogwild_step", -1, 0, 0);
+  }
+  thread->total_cost = replica->total_cost;
+  return NULL;
+}
+
+void initialise_hogwild(
+  Hogwild* hogwild, Network* net, unsigned int num_threads,
+  unsigned int batch_size, enum optimizerType type, double learning_rate,
+  unsigned int clearHogwild
+) {
+  if (clearHogwild) {
+    for (unsigned int t = 0; t < hogwild->num_threads; t++) {
+      HogwildThread* thread = &hogwild->threads[t];
+      initialise_optimizer(&thread->optimizer, &thread->replica, type, 0, 1);
+      initialise_batch_network(
+        &thread->replica, net->num_layers, net->num_nodes,
+        hogwild->batch_size, 1
+      );
+      free(thread->input);
+      free(thread->target_output);
+    }
+    free(hogwild->threads);
+    return;
+  }
+  if (num_threads == 0 || batch_size == 0) {
+    hogwild_error("needs at least one thread and a batch of one");
+  } else if (net->inference_only) {
+    hogwild_error("network was not created for training");
+  }
+  hogwild->net = net;
+  hogwild->num_threads = num_threads;
+  hogwild->batch_size = batch_size;
+  hogwild->total_cost = 0;
+  unsigned int inputs = net->num_nodes[0];
+  unsigned int outputs = net->num_nodes[net->num_layers-1];
+  hogwild->threads = (HogwildThread*)calloc(
+    num_threads, sizeof(HogwildThread)
+  );
+  for (unsigned int t = 0; t < num_threads; t++) {
+    HogwildThread* thread = &hogwild->threads[t];
+    thread->hogwild = hogwild;
+    thread->index = t;
+    initialise_network_without_parameters(
+      &thread->replica, net->num_layers, net->num_nodes, batch_size, 0
+    );
+    share_parameters(net, &thread->replica);
+    initialise_optimizer(
+      &thread->optimizer, &thread->replica, type, learning_rate, 0
+    );
+    thread->input = (double*)malloc(
+      sizeof(double) * inputs * batch_size
+    );
+    thread->target_output = (double*)malloc(
+      sizeof(double) * outputs * batch_size
+    );
+  }
+}
+
+void hogwild_train(
+  Hogwild* hogwild, double* samples, double* targets, unsigned int count,
+  unsigned long steps
+) {
+  if (count == 0) {
+    hogwild_error("no samples");
+  }
+  hogwild->samples = samples;
+  hogwild->targets = targets;
+  hogwild->count = count;
+  hogwild->steps = steps;
+  // a thread's kernels use the pool only while no other thread does, see
+  // parallel_for()
+  for (unsigned int t = 0; t < hogwild->num_threads; t++) {
+    HogwildThread* thread = &hogwild->threads[t];
+    if (pthread_create(&thread->thread, NULL, train_thread, thread)) {
+      hogwild_error("could not start a thread");
+    }
+  }
+  double total_cost = 0;
+  for (unsigned int t = 0; t < hogwild->num_threads; t++) {
+    pthread_join(hogwild->threads[t].thread, NULL);
+    total_cost += hogwild->threads[t].total_cost;
+  }
+  hogwild->total_cost = total_cost / hogwild->num_threads;
+}
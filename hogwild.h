@@ -0,0 +1,63 @@
+#ifndef HOGWILD_H
+#define HOGWILD_H
+
+#include <pthread.h>
+#include "network.h"
+#include "optimizer.h"
+
+// lock-free asynchronous training on one host, Hogwild style
+//
+// every thread has a replica of the network that shares the parameter
+// slab but owns its activations, deltas and gradient slab, and an
+// optimizer of its own. A thread runs forward_pass() and
+// compute_gradients() on its batch and writes its update straight into
+// the shared slab without any lock, so threads read parameters other
+// threads are halfway through updating and some updates are lost. With
+// sparse or small updates that costs little convergence and nothing is
+// ever waited for. Unlike data parallel training the result depends on
+// how the threads interleave and is not reproducible.
+
+typedef struct HogwildThread {
+  struct Hogwild* hogwild;
+  unsigned int index;
+  pthread_t thread;
+  Network replica;
+  Optimizer optimizer;
+  // the thread's batch, one row per node and one column per sample
+  double* input;
+  double* target_output;
+  double total_cost;
+} HogwildThread;
+
+typedef struct Hogwild {
+  Network* net;
+  unsigned int num_threads;
+  unsigned int batch_size;
+  HogwildThread* threads;
+  // what the threads of the running hogwild_train() read
+  double* samples;
+  double* targets;
+  unsigned int count;
+  unsigned long steps;
+  // mean cost of the last batch of every thread of the last call
+  double total_cost;
+} Hogwild;
+
+// replicas of net training its parameters from num_threads threads, each
+// with batches of batch_size samples and an optimizer of the given type
+void initialise_hogwild(
+  Hogwild* hogwild, Network* net, unsigned int num_threads,
+  unsigned int batch_size, enum optimizerType type, double learning_rate,
+  unsigned int clearHogwild
+);
+
+// runs steps batches on every thread at once, then returns; samples and
+// targets hold count samples of num_nodes[0] and num_nodes[num_layers-1]
+// values one after another, which the threads take in turns so that
+// together they go through them in order like a single training loop
+void hogwild_train(
+  Hogwild* hogwild, double* samples, double* targets, unsigned int count,
+  unsigned long steps
+);
+
+#endif
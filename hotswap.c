@@ -0,0 +1,131 @@
+#include "hotswap.h"
+#include "profile.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void hotswap_error(const char* message) {
+  printf("Error: Model hot-swap: %s\n", message);
+  exit(1);
+}
+
+void initialise_model_handle(
+  ModelHandle* handle, Network* net, unsigned int num_versions,
+  unsigned int max_readers, unsigned int clearHandle
+) {
+  if (clearHandle) {
+    for (unsigned int v = 0; v < handle->num_versions; v++) {
+      Network* version = &handle->versions[v];
+      initialise_inference_network(
+        version, version->num_layers, version->num_nodes, 1
+      );
+    }
+    free(handle->versions);
+    free(handle->retired);
+    free(handle->readers);
+    pthread_mutex_destroy(&handle->publish_lock);
+    return;
+  }
+  if (num_versions < 2 || max_readers == 0) {
+    hotswap_error("needs two versions and at least one reader");
+  }
+  handle->num_versions = num_versions;
+  handle->versions = (Network*)calloc(num_versions, sizeof(Network));
+  handle->retired = (unsigned long*)calloc(
+    num_versions, sizeof(unsigned long)
+  );
+  for (unsigned int v = 0; v < num_versions; v++) {
+    initialise_inference_network(
+      &handle->versions[v], net->num_layers, net->num_nodes, 0
+    );
+  }
+  copy_parameters(net, &handle->versions[0]);
+  handle->max_readers = max_readers;
+  handle->readers = (ModelReaderSlot*)aligned_alloc(
+    sizeof(ModelReaderSlot), max_readers * sizeof(ModelReaderSlot)
+  );
+  for (unsigned int r = 0; r < max_readers; r++) {
+    atomic_init(&handle->readers[r].epoch, 0);
+  }
+  atomic_init(&handle->num_readers, 0);
+  // epochs start at 1 so that 0 can mark an idle reader
+  atomic_init(&handle->epoch, 1);
+  atomic_init(&handle->current, &handle->versions[0]);
+  pthread_mutex_init(&handle->publish_lock, NULL);
+  handle->publishes = 0;
+}
+
+unsigned int register_model_reader(ModelHandle* handle) {
+  unsigned int reader = atomic_fetch_add(&handle->num_readers, 1);
+  if (reader >= handle->max_readers) {
+    hotswap_error("more readers than the handle was created for");
+  }
+  return reader;
+}
+
+Network* model_acquire(ModelHandle* handle, unsigned int reader) {
+  // the epoch is announced before the version is loaded, both sequentially
+  // consistent: a publisher that retires the version this load returns
+  // does so after the announcement, and sees it
+  unsigned long epoch = atomic_load(&handle->epoch);
+  atomic_store(&handle->readers[reader].epoch, epoch);
+  return atomic_load(&handle->current);
+}
+
+void model_release(ModelHandle* handle, unsigned int reader) {
+  atomic_store_explicit(
+    &handle->readers[reader].epoch, 0, memory_order_release
+  );
+}
+
+static unsigned int version_free(ModelHandle* handle, unsigned int v) {
+  // a version retired in epoch e may still be read by readers that
+  // announced an earlier epoch, none that announced e or later
+  unsigned long retired = handle->retired[v];
+  if (!retired) {
+    return 1;
+  }
+  unsigned int readers = atomic_load(&handle->num_readers);
+  if (readers > handle->max_readers) {
+    readers = handle->max_readers;
+  }
+  for (unsigned int r = 0; r < readers; r++) {
+    unsigned long epoch = atomic_load(&handle->readers[r].epoch);
+    if (epoch && epoch < retired) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void model_publish(ModelHandle* handle, Network* source) {
+  PROFILE_START(start);
+  pthread_mutex_lock(&handle->publish_lock);
+  Network* current = atomic_load(&handle->current);
+  unsigned int next = handle->num_versions;
+  // readers hold a version for one batch, so a spare one frees up soon;
+  // only the publisher waits for it
+  while (next == handle->num_versions) {
+    for (unsigned int v = 0; v < handle->num_versions; v++) {
+      if (&handle->versions[v] != current && version_free(handle, v)) {
+        next = v;
+        break;
+      }
+    }
+    if (next == handle->num_versions) {
+      sched_yield();
+    }
+  }
+  Network* version = &handle->versions[next];
+  copy_parameters(source, version);
+  handle->retired[next] = 0;
+  atomic_store(&handle->current, version);
+  // readers that load the old version announced an epoch before this one
+  handle->retired[current - handle->versions] = (
+    atomic_fetch_add(&handle->epoch, 1) + 1
+  );
+  handle->publishes++;
+  pthread_mutex_unlock(&handle->publish_lock);
+  PROFILE_END(start, "model_publish", -1, 0,
+    PROFILE_BYTES(source->num_parameters));
+}
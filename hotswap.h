@@ -0,0 +1,61 @@
+#ifndef HOTSWAP_H
+#define HOTSWAP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "network.h"
+
+// a model that is retrained while it serves, swapped without locks
+//
+// the handle owns a few inference-only copies of the network, its
+// versions. Readers take the current version for as long as one batch
+// takes and never wait: model_acquire() announces the epoch the reader
+// started in, then loads the current version. model_publish() copies a
+// trainer's parameters into a version no reader can still be using,
+// swaps it in atomically and starts a new epoch; the version it replaced
+// is retired with that epoch and becomes free again once every reader is
+// idle or started after it. Publishing is the only side that ever waits,
+// and only while every spare version is still in use.
+
+// one reader's announced epoch on a cache line of its own, 0 while idle
+typedef struct ModelReaderSlot {
+  _Atomic unsigned long epoch;
+  char padding[64 - sizeof(unsigned long)];
+} ModelReaderSlot;
+
+typedef struct ModelHandle {
+  Network* versions;
+  unsigned int num_versions;
+  _Atomic(Network*) current;
+  _Atomic unsigned long epoch;
+  // the epoch each version was retired in, 0 if it is current or unused
+  unsigned long* retired;
+  ModelReaderSlot* readers;
+  unsigned int max_readers;
+  _Atomic unsigned int num_readers;
+  // publishers take turns
+  pthread_mutex_t publish_lock;
+  unsigned long publishes;
+} ModelHandle;
+
+// num_versions >= 2 copies of net's topology for up to max_readers
+// reader threads, the first version holding net's parameters
+void initialise_model_handle(
+  ModelHandle* handle, Network* net, unsigned int num_versions,
+  unsigned int max_readers, unsigned int clearHandle
+);
+
+// a reader slot for one thread, kept until the handle is cleared
+unsigned int register_model_reader(ModelHandle* handle);
+
+// the current version, which stays valid and unchanged until the same
+// reader calls model_release()
+Network* model_acquire(ModelHandle* handle, unsigned int reader);
+
+void model_release(ModelHandle* handle, unsigned int reader);
+
+// makes a copy of source's parameters the current version; source must
+// have the handle's topology
+void model_publish(ModelHandle* handle, Network* source);
+
+#endif
@@ -0,0 +1,618 @@
+#include "kernels.h"
+#include <math.h>
+#ifndef M_PI_2
+#define M_PI_2 1.57079632679489661923
+#endif
+#ifndef M_PI_4
+#define M_PI_4 0.78539816339744830962
+#endif
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#ifndef M_SQRT2
+#define M_SQRT2 1.41421356237309504880
+#endif
+
+// coefficients of the Cephes double precision atan approximation
+#define ATAN_T3P8 2.41421356237309504880
+#define ATAN_MOREBITS 6.123233995736765886130E-17
+#define ATAN_P0 -8.750608600031904122785E-1
+#define ATAN_P1 -1.615753718733365076637E1
+#define ATAN_P2 -7.500855792314704667340E1
+#define ATAN_P3 -1.228866684490136173410E2
+#define ATAN_P4 -6.485021904942025371773E1
+#define ATAN_Q0 2.485846490142306297962E1
+#define ATAN_Q1 1.650270098316988542046E2
+#define ATAN_Q2 4.328810604912902668951E2
+#define ATAN_Q3 4.853903996359136964868E2
+#define ATAN_Q4 1.945506571482613964425E2
+
+// coefficients of the Cephes double precision log approximation, with
+// log(2) split into C1 + C2 so e * C1 is exact
+#define LOG_P0 1.01875663804580931796E-4
+#define LOG_P1 4.97494994976747001425E-1
+#define LOG_P2 4.70579119878881725854E0
+#define LOG_P3 1.44989225341610930846E1
+#define LOG_P4 1.79368678507819816313E1
+#define LOG_P5 7.70838733755885391666E0
+#define LOG_Q0 1.12873587189167450590E1
+#define LOG_Q1 4.52279145837532221105E1
+#define LOG_Q2 8.29875266912776603211E1
+#define LOG_Q3 7.11544750618563894466E1
+#define LOG_Q4 2.31251620126765340583E1
+#define LOG_C1 6.93359375E-1
+#define LOG_C2 -2.121944400546905827679E-4
+
+// coefficients of the Cephes sin and cos approximations on [-pi/4, pi/4]
+#define SIN_P0 1.58962301576546568060E-10
+#define SIN_P1 -2.50507477628578072866E-8
+#define SIN_P2 2.75573136213857245213E-6
+#define SIN_P3 -1.98412698295895385996E-4
+#define SIN_P4 8.33333333332211858878E-3
+#define SIN_P5 -1.66666666666666307295E-1
+#define COS_P0 -1.13585365213876817300E-11
+#define COS_P1 2.08757008419747316778E-9
+#define COS_P2 -2.75573141792967388112E-7
+#define COS_P3 2.48015872888517045348E-5
+#define COS_P4 -1.38888888888730564116E-3
+#define COS_P5 4.16666666666665929218E-2
+// adding and subtracting 1.5 * 2^(mantissa bits) rounds to an integer
+#define ROUND_MAGIC \
+  (sizeof(real) == sizeof(double) ? 6755399441055744.0 : 12582912.0)
+
+// portable scalar kernels
+
+static void add_scalar(const real* a, const real* b, real* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = a[i] + b[i];
+  }
+}
+
+static void multiply_scalar(
+  const real* a, const real* b, real* out, size_t n
+) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = a[i] * b[i];
+  }
+}
+
+static void axpy_scalar(real scale, const real* a, real* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] += scale * a[i];
+  }
+}
+
+static void copy_scalar(const real* a, real* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = a[i];
+  }
+}
+
+static double dot_scalar(const real* a, const real* b, size_t n) {
+  accum total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += (accum)a[i] * b[i];
+  }
+  return total;
+}
+
+static double sum_scalar(const real* a, size_t n) {
+  accum total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += a[i];
+  }
+  return total;
+}
+
+static double abs_sum_scalar(const real* a, size_t n) {
+  accum total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += fabs(a[i]);
+  }
+  return total;
+}
+
+static int32_t dot_int8_scalar(const int8_t* a, const int8_t* b, size_t n) {
+  int32_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += (int32_t)a[i] * b[i];
+  }
+  return total;
+}
+
+static void atan_scalar(const real* a, real* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = atan(a[i]);
+  }
+}
+
+static void box_muller_scalar(
+  const real* u1, const real* u2, real* cosines, real* sines, size_t n
+) {
+  for (size_t i = 0; i < n; i++) {
+    double radius = sqrt(-2 * log(u1[i]));
+    double angle = 2 * M_PI * u2[i];
+    cosines[i] = radius * cos(angle);
+    sines[i] = radius * sin(angle);
+  }
+}
+
+static void momentum_step_scalar(
+  real* param, const real* gradient, real* velocity, size_t n, real rate,
+  real momentum, unsigned int nesterov
+) {
+  for (size_t i = 0; i < n; i++) {
+    velocity[i] = momentum * velocity[i] + gradient[i];
+    real direction = nesterov
+      ? gradient[i] + momentum * velocity[i]
+      : velocity[i];
+    param[i] -= rate * direction;
+  }
+}
+
+static void adam_step_scalar(
+  real* param, const real* gradient, real* first, real* second, size_t n,
+  const AdamStep* step
+) {
+  for (size_t i = 0; i < n; i++) {
+    real g = gradient[i] + step->gradient_decay * param[i];
+    first[i] = step->beta1 * first[i] + (1 - step->beta1) * g;
+    second[i] = step->beta2 * second[i] + (1 - step->beta2) * g * g;
+    real denominator = sqrt(second[i] * step->second_correction)
+      + step->epsilon;
+    param[i] = (1 - step->parameter_decay) * param[i]
+      - step->rate * first[i] / denominator;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+
+// each block below defines the vector macros kernels_simd.h expects for
+// one instruction set, the template undefines them again at its end
+
+// SSE2
+
+#define KERNEL(name) name##_sse2
+#define KERNEL_TARGET __attribute__((target("sse2")))
+#ifdef REAL_IS_FLOAT
+#define VEC __m128
+#define VEC_MASK __m128
+#define VEC_WIDTH 4
+#define VEC_LOAD _mm_loadu_ps
+#define VEC_STORE _mm_storeu_ps
+#define VEC_SET1 _mm_set1_ps
+#define VEC_ZERO _mm_setzero_ps
+#define VEC_ADD _mm_add_ps
+#define VEC_SUB _mm_sub_ps
+#define VEC_MUL _mm_mul_ps
+#define VEC_DIV _mm_div_ps
+#define VEC_SQRT _mm_sqrt_ps
+#define VEC_FMADD(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define VEC_ABS(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), a)
+#define VEC_SIGN(a) _mm_and_ps(_mm_set1_ps(-0.0f), a)
+#define VEC_XOR _mm_xor_ps
+#define VEC_GT(a, b) _mm_cmpgt_ps(a, b)
+#define VEC_SELECT(mask, a, b) \
+  _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b))
+#define VEC_EXPONENT(a) _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128( \
+  _mm_srli_epi32(_mm_castps_si128(a), 23), _mm_set1_epi32(0x4b000000))), \
+  _mm_set1_ps(8388735.0f))
+#define VEC_MANTISSA(a) _mm_castsi128_ps(_mm_or_si128(_mm_and_si128( \
+  _mm_castps_si128(a), _mm_set1_epi32(0x007fffff)), \
+  _mm_set1_epi32(0x3f800000)))
+#else
+#define VEC __m128d
+#define VEC_MASK __m128d
+#define VEC_WIDTH 2
+#define VEC_LOAD _mm_loadu_pd
+#define VEC_STORE _mm_storeu_pd
+#define VEC_SET1 _mm_set1_pd
+#define VEC_ZERO _mm_setzero_pd
+#define VEC_ADD _mm_add_pd
+#define VEC_SUB _mm_sub_pd
+#define VEC_MUL _mm_mul_pd
+#define VEC_DIV _mm_div_pd
+#define VEC_SQRT _mm_sqrt_pd
+#define VEC_FMADD(a, b, c) _mm_add_pd(_mm_mul_pd(a, b), c)
+#define VEC_ABS(a) _mm_andnot_pd(_mm_set1_pd(-0.0), a)
+#define VEC_SIGN(a) _mm_and_pd(_mm_set1_pd(-0.0), a)
+#define VEC_XOR _mm_xor_pd
+#define VEC_GT(a, b) _mm_cmpgt_pd(a, b)
+#define VEC_SELECT(mask, a, b) \
+  _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b))
+#define VEC_EXPONENT(a) _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128( \
+  _mm_srli_epi64(_mm_castpd_si128(a), 52), \
+  _mm_set1_epi64x(0x4330000000000000LL))), _mm_set1_pd(4503599627371519.0))
+#define VEC_MANTISSA(a) _mm_castsi128_pd(_mm_or_si128(_mm_and_si128( \
+  _mm_castpd_si128(a), _mm_set1_epi64x(0x000fffffffffffffLL)), \
+  _mm_set1_epi64x(0x3ff0000000000000LL)))
+#endif
+#ifdef PRECISION_MIXED
+#define ACC_VEC __m128d
+#define ACC_WIDTH 2
+#define ACC_LOAD(p) _mm_cvtps_pd(_mm_castsi128_ps( \
+  _mm_loadl_epi64((const __m128i*)(p))))
+#define ACC_STORE _mm_storeu_pd
+#define ACC_ZERO _mm_setzero_pd
+#define ACC_ADD _mm_add_pd
+#define ACC_FMADD(a, b, c) _mm_add_pd(_mm_mul_pd(a, b), c)
+#define ACC_ABS(a) _mm_andnot_pd(_mm_set1_pd(-0.0), a)
+#endif
+#include "kernels_simd.h"
+
+// AVX2 with FMA
+
+#define KERNEL(name) name##_avx2
+#define KERNEL_TARGET __attribute__((target("avx2,fma")))
+#ifdef REAL_IS_FLOAT
+#define VEC __m256
+#define VEC_MASK __m256
+#define VEC_WIDTH 8
+#define VEC_LOAD _mm256_loadu_ps
+#define VEC_STORE _mm256_storeu_ps
+#define VEC_SET1 _mm256_set1_ps
+#define VEC_ZERO _mm256_setzero_ps
+#define VEC_ADD _mm256_add_ps
+#define VEC_SUB _mm256_sub_ps
+#define VEC_MUL _mm256_mul_ps
+#define VEC_DIV _mm256_div_ps
+#define VEC_SQRT _mm256_sqrt_ps
+#define VEC_FMADD _mm256_fmadd_ps
+#define VEC_ABS(a) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a)
+#define VEC_SIGN(a) _mm256_and_ps(_mm256_set1_ps(-0.0f), a)
+#define VEC_XOR _mm256_xor_ps
+#define VEC_GT(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define VEC_SELECT(mask, a, b) _mm256_blendv_ps(b, a, mask)
+#define VEC_EXPONENT(a) _mm256_sub_ps(_mm256_castsi256_ps(_mm256_or_si256( \
+  _mm256_srli_epi32(_mm256_castps_si256(a), 23), \
+  _mm256_set1_epi32(0x4b000000))), _mm256_set1_ps(8388735.0f))
+#define VEC_MANTISSA(a) _mm256_castsi256_ps(_mm256_or_si256( \
+  _mm256_and_si256(_mm256_castps_si256(a), _mm256_set1_epi32(0x007fffff)), \
+  _mm256_set1_epi32(0x3f800000)))
+#else
+#define VEC __m256d
+#define VEC_MASK __m256d
+#define VEC_WIDTH 4
+#define VEC_LOAD _mm256_loadu_pd
+#define VEC_STORE _mm256_storeu_pd
+#define VEC_SET1 _mm256_set1_pd
+#define VEC_ZERO _mm256_setzero_pd
+#define VEC_ADD _mm256_add_pd
+#define VEC_SUB _mm256_sub_pd
+#define VEC_MUL _mm256_mul_pd
+#define VEC_DIV _mm256_div_pd
+#define VEC_SQRT _mm256_sqrt_pd
+#define VEC_FMADD _mm256_fmadd_pd
+#define VEC_ABS(a) _mm256_andnot_pd(_mm256_set1_pd(-0.0), a)
+#define VEC_SIGN(a) _mm256_and_pd(_mm256_set1_pd(-0.0), a)
+#define VEC_XOR _mm256_xor_pd
+#define VEC_GT(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define VEC_SELECT(mask, a, b) _mm256_blendv_pd(b, a, mask)
+#define VEC_EXPONENT(a) _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256( \
+  _mm256_srli_epi64(_mm256_castpd_si256(a), 52), \
+  _mm256_set1_epi64x(0x4330000000000000LL))), \
+  _mm256_set1_pd(4503599627371519.0))
+#define VEC_MANTISSA(a) _mm256_castsi256_pd(_mm256_or_si256( \
+  _mm256_and_si256(_mm256_castpd_si256(a), \
+  _mm256_set1_epi64x(0x000fffffffffffffLL)), \
+  _mm256_set1_epi64x(0x3ff0000000000000LL)))
+#endif
+#ifdef PRECISION_MIXED
+#define ACC_VEC __m256d
+#define ACC_WIDTH 4
+#define ACC_LOAD(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+#define ACC_STORE _mm256_storeu_pd
+#define ACC_ZERO _mm256_setzero_pd
+#define ACC_ADD _mm256_add_pd
+#define ACC_FMADD _mm256_fmadd_pd
+#define ACC_ABS(a) _mm256_andnot_pd(_mm256_set1_pd(-0.0), a)
+#endif
+#include "kernels_simd.h"
+
+// AVX-512F
+
+#define KERNEL(name) name##_avx512
+#define KERNEL_TARGET __attribute__((target("avx512f")))
+#ifdef REAL_IS_FLOAT
+#define VEC __m512
+#define VEC_MASK __mmask16
+#define VEC_WIDTH 16
+#define VEC_LOAD _mm512_loadu_ps
+#define VEC_STORE _mm512_storeu_ps
+#define VEC_SET1 _mm512_set1_ps
+#define VEC_ZERO _mm512_setzero_ps
+#define VEC_ADD _mm512_add_ps
+#define VEC_SUB _mm512_sub_ps
+#define VEC_MUL _mm512_mul_ps
+#define VEC_DIV _mm512_div_ps
+#define VEC_SQRT _mm512_sqrt_ps
+#define VEC_FMADD _mm512_fmadd_ps
+#define VEC_ABS _mm512_abs_ps
+#define VEC_SIGN(a) _mm512_castsi512_ps(_mm512_and_si512( \
+  _mm512_castps_si512(a), _mm512_set1_epi32(0x80000000)))
+#define VEC_XOR(a, b) _mm512_castsi512_ps(_mm512_xor_si512( \
+  _mm512_castps_si512(a), _mm512_castps_si512(b)))
+#define VEC_GT(a, b) _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ)
+#define VEC_SELECT(mask, a, b) _mm512_mask_blend_ps(mask, b, a)
+#define VEC_EXPONENT _mm512_getexp_ps
+#define VEC_MANTISSA(a) _mm512_getmant_ps(a, _MM_MANT_NORM_1_2, \
+  _MM_MANT_SIGN_src)
+#else
+#define VEC __m512d
+#define VEC_MASK __mmask8
+#define VEC_WIDTH 8
+#define VEC_LOAD _mm512_loadu_pd
+#define VEC_STORE _mm512_storeu_pd
+#define VEC_SET1 _mm512_set1_pd
+#define VEC_ZERO _mm512_setzero_pd
+#define VEC_ADD _mm512_add_pd
+#define VEC_SUB _mm512_sub_pd
+#define VEC_MUL _mm512_mul_pd
+#define VEC_DIV _mm512_div_pd
+#define VEC_SQRT _mm512_sqrt_pd
+#define VEC_FMADD _mm512_fmadd_pd
+#define VEC_ABS _mm512_abs_pd
+#define VEC_SIGN(a) _mm512_castsi512_pd(_mm512_and_si512( \
+  _mm512_castpd_si512(a), _mm512_set1_epi64(0x8000000000000000LL)))
+#define VEC_XOR(a, b) _mm512_castsi512_pd(_mm512_xor_si512( \
+  _mm512_castpd_si512(a), _mm512_castpd_si512(b)))
+#define VEC_GT(a, b) _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ)
+#define VEC_SELECT(mask, a, b) _mm512_mask_blend_pd(mask, b, a)
+#define VEC_EXPONENT _mm512_getexp_pd
+#define VEC_MANTISSA(a) _mm512_getmant_pd(a, _MM_MANT_NORM_1_2, \
+  _MM_MANT_SIGN_src)
+#endif
+#ifdef PRECISION_MIXED
+#define ACC_VEC __m512d
+#define ACC_WIDTH 8
+#define ACC_LOAD(p) _mm512_cvtps_pd(_mm256_loadu_ps(p))
+#define ACC_STORE _mm512_storeu_pd
+#define ACC_ZERO _mm512_setzero_pd
+#define ACC_ADD _mm512_add_pd
+#define ACC_FMADD _mm512_fmadd_pd
+#define ACC_ABS _mm512_abs_pd
+#endif
+#include "kernels_simd.h"
+
+// int8 dot products, independent of the precision so written out once per
+// instruction set; bytes are widened to int16 and multiplied in pairs into
+// int32 lanes
+
+__attribute__((target("sse2")))
+static int32_t dot_int8_sse2(const int8_t* a, const int8_t* b, size_t n) {
+  __m128i total = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    // sign extension without SSE4.1: the byte in the high half, shifted
+    __m128i a_low = _mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8);
+    __m128i a_high = _mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8);
+    __m128i b_low = _mm_srai_epi16(_mm_unpacklo_epi8(vb, vb), 8);
+    __m128i b_high = _mm_srai_epi16(_mm_unpackhi_epi8(vb, vb), 8);
+    total = _mm_add_epi32(total, _mm_madd_epi16(a_low, b_low));
+    total = _mm_add_epi32(total, _mm_madd_epi16(a_high, b_high));
+  }
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, total);
+  int32_t sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return sum + dot_int8_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int32_t dot_int8_avx2(const int8_t* a, const int8_t* b, size_t n) {
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i va = _mm256_cvtepi8_epi16(
+      _mm_loadu_si128((const __m128i*)(a + i))
+    );
+    __m256i vb = _mm256_cvtepi8_epi16(
+      _mm_loadu_si128((const __m128i*)(b + i))
+    );
+    total = _mm256_add_epi32(total, _mm256_madd_epi16(va, vb));
+  }
+  int32_t lanes[8];
+  _mm256_storeu_si256((__m256i*)lanes, total);
+  int32_t sum = 0;
+  for (unsigned int l = 0; l < 8; l++) {
+    sum += lanes[l];
+  }
+  return sum + dot_int8_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int32_t dot_int8_avx512vnni(
+  const int8_t* a, const int8_t* b, size_t n
+) {
+  // vpdpbusd multiplies unsigned by signed bytes, so a is offset by 128
+  // and 128 * sum(b) is taken off again
+  __m512i offset = _mm512_set1_epi8((char)0x80);
+  __m512i total = _mm512_setzero_si512();
+  __m512i correction = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i va = _mm512_loadu_si512((const void*)(a + i));
+    __m512i vb = _mm512_loadu_si512((const void*)(b + i));
+    total = _mm512_dpbusd_epi32(total, _mm512_xor_si512(va, offset), vb);
+    correction = _mm512_dpbusd_epi32(correction, offset, vb);
+  }
+  int32_t sum = _mm512_reduce_add_epi32(_mm512_sub_epi32(total, correction));
+  return sum + dot_int8_avx2(a + i, b + i, n - i);
+}
+#endif
+
+// runtime dispatch
+
+typedef struct KernelTable {
+  enum kernelIsa isa;
+  void (*add)(const real*, const real*, real*, size_t);
+  void (*multiply)(const real*, const real*, real*, size_t);
+  void (*axpy)(real, const real*, real*, size_t);
+  void (*copy)(const real*, real*, size_t);
+  double (*dot)(const real*, const real*, size_t);
+  double (*sum)(const real*, size_t);
+  double (*abs_sum)(const real*, size_t);
+  int32_t (*dot_int8)(const int8_t*, const int8_t*, size_t);
+  void (*atan)(const real*, real*, size_t);
+  void (*box_muller)(const real*, const real*, real*, real*, size_t);
+  void (*momentum_step)(
+    real*, const real*, real*, size_t, real, real, unsigned int
+  );
+  void (*adam_step)(
+    real*, const real*, real*, real*, size_t, const AdamStep*
+  );
+} KernelTable;
+
+// int8_suffix names the int8 dot product, AVX-512 without VNNI has no
+// better one than AVX2's
+#define KERNEL_TABLE(isa, suffix, int8_suffix) { \
+  isa, add_##suffix, multiply_##suffix, axpy_##suffix, copy_##suffix, \
+  dot_##suffix, sum_##suffix, abs_sum_##suffix, dot_int8_##int8_suffix, \
+  atan_##suffix, box_muller_##suffix, momentum_step_##suffix, \
+  adam_step_##suffix \
+}
+
+static const KernelTable scalar_kernels = KERNEL_TABLE(
+  ISA_SCALAR, scalar, scalar
+);
+#ifdef HAVE_X86_KERNELS
+static const KernelTable sse2_kernels = KERNEL_TABLE(ISA_SSE2, sse2, sse2);
+static const KernelTable avx2_kernels = KERNEL_TABLE(ISA_AVX2, avx2, avx2);
+static const KernelTable avx512_kernels = KERNEL_TABLE(
+  ISA_AVX512, avx512, avx2
+);
+#endif
+
+static KernelTable kernels = KERNEL_TABLE(ISA_SCALAR, scalar, scalar);
+
+static int isa_supported(enum kernelIsa isa) {
+  switch (isa) {
+    case ISA_SCALAR:
+      return 1;
+    #ifdef HAVE_X86_KERNELS
+    case ISA_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case ISA_AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case ISA_AVX512:
+      return __builtin_cpu_supports("avx512f");
+    #endif
+    default:
+      return 0;
+  }
+}
+
+int use_kernel_isa(enum kernelIsa isa) {
+  // switch to the kernels for isa, returns 0 if the CPU lacks it
+  if (!isa_supported(isa)) {
+    return 0;
+  }
+  switch (isa) {
+    #ifdef HAVE_X86_KERNELS
+    case ISA_SSE2:
+      kernels = sse2_kernels;
+      break;
+    case ISA_AVX2:
+      kernels = avx2_kernels;
+      break;
+    case ISA_AVX512:
+      kernels = avx512_kernels;
+      if (__builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512vnni")) {
+        kernels.dot_int8 = dot_int8_avx512vnni;
+      }
+      break;
+    #endif
+    default:
+      kernels = scalar_kernels;
+      break;
+  }
+  return 1;
+}
+
+enum kernelIsa kernel_isa() {
+  return kernels.isa;
+}
+
+const char* kernel_isa_name(enum kernelIsa isa) {
+  switch (isa) {
+    case ISA_SSE2:
+      return "sse2";
+    case ISA_AVX2:
+      return "avx2";
+    case ISA_AVX512:
+      return "avx512";
+    default:
+      return "scalar";
+  }
+}
+
+__attribute__((constructor)) static void select_kernels() {
+  // pick the widest instruction set this CPU supports
+  if (!use_kernel_isa(ISA_AVX512)
+    && !use_kernel_isa(ISA_AVX2)
+    && !use_kernel_isa(ISA_SSE2)) {
+    use_kernel_isa(ISA_SCALAR);
+  }
+}
+
+void vector_add(const real* a, const real* b, real* out, size_t n) {
+  kernels.add(a, b, out, n);
+}
+
+void vector_multiply(const real* a, const real* b, real* out, size_t n) {
+  kernels.multiply(a, b, out, n);
+}
+
+void vector_axpy(real scale, const real* a, real* out, size_t n) {
+  kernels.axpy(scale, a, out, n);
+}
+
+void vector_copy(const real* a, real* out, size_t n) {
+  kernels.copy(a, out, n);
+}
+
+double vector_dot(const real* a, const real* b, size_t n) {
+  return kernels.dot(a, b, n);
+}
+
+double vector_sum(const real* a, size_t n) {
+  return kernels.sum(a, n);
+}
+
+double vector_abs_sum(const real* a, size_t n) {
+  return kernels.abs_sum(a, n);
+}
+
+int32_t vector_dot_int8(const int8_t* a, const int8_t* b, size_t n) {
+  return kernels.dot_int8(a, b, n);
+}
+
+void vector_atan(const real* a, real* out, size_t n) {
+  kernels.atan(a, out, n);
+}
+
+void vector_box_muller(
+  const real* u1, const real* u2, real* cosines, real* sines, size_t n
+) {
+  kernels.box_muller(u1, u2, cosines, sines, n);
+}
+
+void vector_momentum_step(
+  real* param, const real* gradient, real* velocity, size_t n, real rate,
+  real momentum, unsigned int nesterov
+) {
+  kernels.momentum_step(
+    param, gradient, velocity, n, rate, momentum, nesterov
+  );
+}
+
+void vector_adam_step(
+  real* param, const real* gradient, real* first, real* second, size_t n,
+  const AdamStep* step
+) {
+  kernels.adam_step(param, gradient, first, second, n, step);
+}
@@ -0,0 +1,87 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "precision.h"
+
+// elementwise kernels over contiguous arrays, vectorised with the widest
+// instruction set the CPU supports (chosen at startup)
+
+enum kernelIsa {ISA_SCALAR, ISA_SSE2, ISA_AVX2, ISA_AVX512};
+
+int use_kernel_isa(enum kernelIsa isa);
+
+enum kernelIsa kernel_isa();
+
+const char* kernel_isa_name(enum kernelIsa isa);
+
+void vector_add(const real* a, const real* b, real* out, size_t n);
+
+void vector_multiply(const real* a, const real* b, real* out, size_t n);
+
+// out += scale * a
+void vector_axpy(real scale, const real* a, real* out, size_t n);
+
+void vector_copy(const real* a, real* out, size_t n);
+
+// reductions accumulate in the accum type
+double vector_dot(const real* a, const real* b, size_t n);
+
+double vector_sum(const real* a, size_t n);
+
+double vector_abs_sum(const real* a, size_t n);
+
+// int8 products summed in int32 for quantized inference, exact while
+// n * 127 * 127 fits in an int; with AVX-512 VNNI when the CPU has it
+int32_t vector_dot_int8(const int8_t* a, const int8_t* b, size_t n);
+
+// atan of every element, the activation of every layer and the only
+// definition of it; the SIMD versions use a rational approximation
+// within 1 ulp of libm atan in double (max absolute error 2.3e-16) and
+// within 1 ulp of atanf in float
+void vector_atan(const real* a, real* out, size_t n);
+
+// the Box-Muller transform of uniforms in (0, 1): the two normals
+// sqrt(-2 log u1[i]) times cos and sin of 2 pi u2[i]; the SIMD versions
+// use the Cephes log, sin and cos approximations, within a few ulp
+void vector_box_muller(
+  const real* u1, const real* u2, real* cosines, real* sines, size_t n
+);
+
+// optimizer updates, each a single pass over the parameters, their
+// gradients and the optimizer state
+
+// velocity = momentum * velocity + gradient, then
+// param -= rate * velocity, or with nesterov
+// param -= rate * (gradient + momentum * velocity)
+void vector_momentum_step(
+  real* param, const real* gradient, real* velocity, size_t n, real rate,
+  real momentum, unsigned int nesterov
+);
+
+typedef struct AdamStep {
+  real beta1;
+  real beta2;
+  // learning rate over the first moment's bias correction, 1 - beta1^t
+  real rate;
+  // 1 / (1 - beta2^t)
+  real second_correction;
+  real epsilon;
+  // L2 penalty folded into the gradient (Adam)
+  real gradient_decay;
+  // fraction of the parameter removed each step (AdamW)
+  real parameter_decay;
+} AdamStep;
+
+// g = gradient + gradient_decay * param
+// first = beta1 * first + (1 - beta1) * g
+// second = beta2 * second + (1 - beta2) * g^2
+// param = (1 - parameter_decay) * param
+//   - rate * first / (sqrt(second * second_correction) + epsilon)
+void vector_adam_step(
+  real* param, const real* gradient, real* first, real* second, size_t n,
+  const AdamStep* step
+);
+
+#endif
@@ -0,0 +1,399 @@
+// SIMD kernel bodies, included once per instruction set by kernels.c
+// which first defines:
+//   KERNEL(name)      name of the kernel for this instruction set
+//   KERNEL_TARGET     function attribute enabling the instruction set
+//   VEC, VEC_MASK     vector and comparison mask types
+//   VEC_WIDTH         elements per vector
+//   VEC_LOAD, VEC_STORE, VEC_SET1, VEC_ZERO
+//   VEC_ADD, VEC_SUB, VEC_MUL, VEC_DIV, VEC_SQRT, VEC_FMADD (a * b + c)
+//   VEC_ABS, VEC_SIGN (sign bit only), VEC_XOR
+//   VEC_GT (a > b mask), VEC_SELECT (mask ? a : b)
+//   VEC_EXPONENT (floor(log2(a)) of a positive a, as a real),
+//   VEC_MANTISSA (a positive a scaled into [1, 2))
+// VEC holds real elements; the reductions run on ACC_VEC, which holds
+// accum elements and defaults to VEC unless the storage and accumulation
+// types differ, in which case the includer also defines:
+//   ACC_VEC, ACC_WIDTH, ACC_LOAD (ACC_WIDTH reals widened to accum),
+//   ACC_STORE, ACC_ZERO, ACC_ADD, ACC_FMADD, ACC_ABS
+
+#ifndef ACC_VEC
+#define ACC_VEC VEC
+#define ACC_WIDTH VEC_WIDTH
+#define ACC_LOAD VEC_LOAD
+#define ACC_STORE VEC_STORE
+#define ACC_ZERO VEC_ZERO
+#define ACC_ADD VEC_ADD
+#define ACC_FMADD VEC_FMADD
+#define ACC_ABS VEC_ABS
+#endif
+
+KERNEL_TARGET static void KERNEL(add)(
+  const real* a, const real* b, real* out, size_t n
+) {
+  size_t i = 0;
+  for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+    VEC_STORE(out + i, VEC_ADD(VEC_LOAD(a + i), VEC_LOAD(b + i)));
+  }
+  for (; i < n; i++) {
+    out[i] = a[i] + b[i];
+  }
+}
+
+KERNEL_TARGET static void KERNEL(multiply)(
+  const real* a, const real* b, real* out, size_t n
+) {
+  size_t i = 0;
+  for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+    VEC_STORE(out + i, VEC_MUL(VEC_LOAD(a + i), VEC_LOAD(b + i)));
+  }
+  for (; i < n; i++) {
+    out[i] = a[i] * b[i];
+  }
+}
+
+KERNEL_TARGET static void KERNEL(axpy)(
+  real scale, const real* a, real* out, size_t n
+) {
+  VEC factor = VEC_SET1(scale);
+  size_t i = 0;
+  for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+    VEC_STORE(
+      out + i, VEC_FMADD(factor, VEC_LOAD(a + i), VEC_LOAD(out + i))
+    );
+  }
+  for (; i < n; i++) {
+    out[i] += scale * a[i];
+  }
+}
+
+KERNEL_TARGET static void KERNEL(copy)(
+  const real* a, real* out, size_t n
+) {
+  size_t i = 0;
+  for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+    VEC_STORE(out + i, VEC_LOAD(a + i));
+  }
+  for (; i < n; i++) {
+    out[i] = a[i];
+  }
+}
+
+KERNEL_TARGET static accum KERNEL(horizontal_sum)(
+  ACC_VEC v0, ACC_VEC v1
+) {
+  accum lanes[ACC_WIDTH];
+  ACC_STORE(lanes, ACC_ADD(v0, v1));
+  accum total = 0;
+  for (unsigned int l = 0; l < ACC_WIDTH; l++) {
+    total += lanes[l];
+  }
+  return total;
+}
+
+KERNEL_TARGET static double KERNEL(dot)(
+  const real* a, const real* b, size_t n
+) {
+  // two accumulators to hide the latency of the adds
+  ACC_VEC acc0 = ACC_ZERO();
+  ACC_VEC acc1 = ACC_ZERO();
+  size_t i = 0;
+  for (; i + 2*ACC_WIDTH <= n; i += 2*ACC_WIDTH) {
+    acc0 = ACC_FMADD(ACC_LOAD(a + i), ACC_LOAD(b + i), acc0);
+    acc1 = ACC_FMADD(
+      ACC_LOAD(a + i + ACC_WIDTH), ACC_LOAD(b + i + ACC_WIDTH), acc1
+    );
+  }
+  accum total = KERNEL(horizontal_sum)(acc0, acc1);
+  for (; i < n; i++) {
+    total += (accum)a[i] * b[i];
+  }
+  return total;
+}
+
+KERNEL_TARGET static double KERNEL(sum)(const real* a, size_t n) {
+  ACC_VEC acc0 = ACC_ZERO();
+  ACC_VEC acc1 = ACC_ZERO();
+  size_t i = 0;
+  for (; i + 2*ACC_WIDTH <= n; i += 2*ACC_WIDTH) {
+    acc0 = ACC_ADD(ACC_LOAD(a + i), acc0);
+    acc1 = ACC_ADD(ACC_LOAD(a + i + ACC_WIDTH), acc1);
+  }
+  accum total = KERNEL(horizontal_sum)(acc0, acc1);
+  for (; i < n; i++) {
+    total += a[i];
+  }
+  return total;
+}
+
+KERNEL_TARGET static double KERNEL(abs_sum)(const real* a, size_t n) {
+  ACC_VEC acc0 = ACC_ZERO();
+  ACC_VEC acc1 = ACC_ZERO();
+  size_t i = 0;
+  for (; i + 2*ACC_WIDTH <= n; i += 2*ACC_WIDTH) {
+    acc0 = ACC_ADD(ACC_ABS(ACC_LOAD(a + i)), acc0);
+    acc1 = ACC_ADD(ACC_ABS(ACC_LOAD(a + i + ACC_WIDTH)), acc1);
+  }
+  accum total = KERNEL(horizontal_sum)(acc0, acc1);
+  for (; i < n; i++) {
+    total += fabs(a[i]);
+  }
+  return total;
+}
+
+KERNEL_TARGET static VEC KERNEL(atan_vec)(VEC x) {
+  // Cephes atan: reduce |x| to [-0.66, 0.66] using
+  // atan(x) = pi/2 - atan(1/x) and atan(x) = pi/4 + atan((x-1)/(x+1)),
+  // then a degree 4/5 rational approximation in x^2
+  VEC sign = VEC_SIGN(x);
+  VEC ax = VEC_ABS(x);
+  VEC one = VEC_SET1(1.0);
+  VEC_MASK big = VEC_GT(ax, VEC_SET1(ATAN_T3P8));
+  VEC_MASK mid = VEC_GT(ax, VEC_SET1(0.66));
+  VEC reduced_mid = VEC_DIV(VEC_SUB(ax, one), VEC_ADD(ax, one));
+  VEC reduced_big = VEC_DIV(VEC_SET1(-1.0), ax);
+  VEC xr = VEC_SELECT(big, reduced_big, VEC_SELECT(mid, reduced_mid, ax));
+  VEC offset = VEC_SELECT(
+    big, VEC_SET1(M_PI_2),
+    VEC_SELECT(mid, VEC_SET1(M_PI_4), VEC_ZERO())
+  );
+  VEC more_bits = VEC_SELECT(
+    big, VEC_SET1(ATAN_MOREBITS),
+    VEC_SELECT(mid, VEC_SET1(0.5 * ATAN_MOREBITS), VEC_ZERO())
+  );
+  VEC z = VEC_MUL(xr, xr);
+  VEC p = VEC_SET1(ATAN_P0);
+  p = VEC_FMADD(p, z, VEC_SET1(ATAN_P1));
+  p = VEC_FMADD(p, z, VEC_SET1(ATAN_P2));
+  p = VEC_FMADD(p, z, VEC_SET1(ATAN_P3));
+  p = VEC_FMADD(p, z, VEC_SET1(ATAN_P4));
+  VEC q = VEC_ADD(z, VEC_SET1(ATAN_Q0));
+  q = VEC_FMADD(q, z, VEC_SET1(ATAN_Q1));
+  q = VEC_FMADD(q, z, VEC_SET1(ATAN_Q2));
+  q = VEC_FMADD(q, z, VEC_SET1(ATAN_Q3));
+  q = VEC_FMADD(q, z, VEC_SET1(ATAN_Q4));
+  VEC ratio = VEC_DIV(VEC_MUL(z, p), q);
+  VEC result = VEC_FMADD(xr, ratio, xr);
+  result = VEC_ADD(offset, VEC_ADD(result, more_bits));
+  return VEC_XOR(result, sign);
+}
+
+KERNEL_TARGET static void KERNEL(atan)(
+  const real* a, real* out, size_t n
+) {
+  size_t i = 0;
+  for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+    VEC_STORE(out + i, KERNEL(atan_vec)(VEC_LOAD(a + i)));
+  }
+  if (i < n) {
+    // finish the tail with a padded vector so every element gets the
+    // same approximation
+    real lanes[VEC_WIDTH] = {0};
+    for (size_t j = i; j < n; j++) {
+      lanes[j - i] = a[j];
+    }
+    VEC_STORE(lanes, KERNEL(atan_vec)(VEC_LOAD(lanes)));
+    for (size_t j = i; j < n; j++) {
+      out[j] = lanes[j - i];
+    }
+  }
+}
+
+KERNEL_TARGET static VEC KERNEL(log_vec)(VEC x) {
+  // Cephes log: x = m * 2^e with m in [sqrt(1/2), sqrt(2)), then a degree
+  // 5/5 rational approximation in m - 1; x must be positive and normal
+  VEC one = VEC_SET1(1.0);
+  VEC e = VEC_EXPONENT(x);
+  VEC m = VEC_MANTISSA(x);
+  VEC_MASK high = VEC_GT(m, VEC_SET1(M_SQRT2));
+  m = VEC_SELECT(high, VEC_MUL(m, VEC_SET1(0.5)), m);
+  e = VEC_SELECT(high, VEC_ADD(e, one), e);
+  VEC f = VEC_SUB(m, one);
+  VEC z = VEC_MUL(f, f);
+  VEC p = VEC_SET1(LOG_P0);
+  p = VEC_FMADD(p, f, VEC_SET1(LOG_P1));
+  p = VEC_FMADD(p, f, VEC_SET1(LOG_P2));
+  p = VEC_FMADD(p, f, VEC_SET1(LOG_P3));
+  p = VEC_FMADD(p, f, VEC_SET1(LOG_P4));
+  p = VEC_FMADD(p, f, VEC_SET1(LOG_P5));
+  VEC q = VEC_ADD(f, VEC_SET1(LOG_Q0));
+  q = VEC_FMADD(q, f, VEC_SET1(LOG_Q1));
+  q = VEC_FMADD(q, f, VEC_SET1(LOG_Q2));
+  q = VEC_FMADD(q, f, VEC_SET1(LOG_Q3));
+  q = VEC_FMADD(q, f, VEC_SET1(LOG_Q4));
+  VEC y = VEC_MUL(f, VEC_DIV(VEC_MUL(z, p), q));
+  y = VEC_FMADD(e, VEC_SET1(LOG_C2), y);
+  y = VEC_FMADD(z, VEC_SET1(-0.5), y);
+  return VEC_FMADD(e, VEC_SET1(LOG_C1), VEC_ADD(f, y));
+}
+
+KERNEL_TARGET static void KERNEL(sincos_turn_vec)(
+  VEC u, VEC* sine, VEC* cosine
+) {
+  // sin and cos of 2 pi u for u in (0, 1): t = u - 1/2 takes a half turn
+  // off, flipping both signs, and q = round(4t) quarter turns more leave
+  // an angle in [-pi/4, pi/4]; working in turns keeps the reduction exact
+  VEC negative = VEC_SET1(-0.0);
+  VEC magic = VEC_SET1(ROUND_MAGIC);
+  VEC t = VEC_SUB(u, VEC_SET1(0.5));
+  VEC q = VEC_SUB(VEC_ADD(VEC_MUL(t, VEC_SET1(4.0)), magic), magic);
+  VEC x = VEC_MUL(VEC_FMADD(q, VEC_SET1(-0.25), t), VEC_SET1(2 * M_PI));
+  VEC z = VEC_MUL(x, x);
+  VEC s = VEC_SET1(SIN_P0);
+  s = VEC_FMADD(s, z, VEC_SET1(SIN_P1));
+  s = VEC_FMADD(s, z, VEC_SET1(SIN_P2));
+  s = VEC_FMADD(s, z, VEC_SET1(SIN_P3));
+  s = VEC_FMADD(s, z, VEC_SET1(SIN_P4));
+  s = VEC_FMADD(s, z, VEC_SET1(SIN_P5));
+  s = VEC_FMADD(VEC_MUL(x, z), s, x);
+  VEC c = VEC_SET1(COS_P0);
+  c = VEC_FMADD(c, z, VEC_SET1(COS_P1));
+  c = VEC_FMADD(c, z, VEC_SET1(COS_P2));
+  c = VEC_FMADD(c, z, VEC_SET1(COS_P3));
+  c = VEC_FMADD(c, z, VEC_SET1(COS_P4));
+  c = VEC_FMADD(c, z, VEC_SET1(COS_P5));
+  c = VEC_FMADD(VEC_MUL(z, z), c, VEC_FMADD(z, VEC_SET1(-0.5), VEC_SET1(1.0)));
+  // an odd q swaps sin and cos, with q's sign on one of them, and q = +-2
+  // is a half turn that cancels the one taken off
+  VEC aq = VEC_ABS(q);
+  VEC q_sign = VEC_SIGN(q);
+  VEC_MASK odd = VEC_GT(aq, VEC_SET1(0.5));
+  VEC_MASK half = VEC_GT(aq, VEC_SET1(1.5));
+  *sine = VEC_SELECT(half, s, VEC_SELECT(
+    odd, VEC_XOR(c, VEC_XOR(q_sign, negative)), VEC_XOR(s, negative)
+  ));
+  *cosine = VEC_SELECT(half, c, VEC_SELECT(
+    odd, VEC_XOR(s, q_sign), VEC_XOR(c, negative)
+  ));
+}
+
+KERNEL_TARGET static void KERNEL(box_muller_vec)(
+  VEC u1, VEC u2, real* cosines, real* sines
+) {
+  VEC radius = VEC_SQRT(VEC_MUL(VEC_SET1(-2.0), KERNEL(log_vec)(u1)));
+  VEC sine;
+  VEC cosine;
+  KERNEL(sincos_turn_vec)(u2, &sine, &cosine);
+  VEC_STORE(cosines, VEC_MUL(radius, cosine));
+  VEC_STORE(sines, VEC_MUL(radius, sine));
+}
+
+KERNEL_TARGET static void KERNEL(box_muller)(
+  const real* u1, const real* u2, real* cosines, real* sines, size_t n
+) {
+  size_t i = 0;
+  for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+    KERNEL(box_muller_vec)(
+      VEC_LOAD(u1 + i), VEC_LOAD(u2 + i), cosines + i, sines + i
+    );
+  }
+  if (i < n) {
+    // the tail in padded vectors, like atan
+    real lanes1[VEC_WIDTH];
+    real lanes2[VEC_WIDTH];
+    for (size_t j = 0; j < VEC_WIDTH; j++) {
+      lanes1[j] = i + j < n ? u1[i + j] : 0.5;
+      lanes2[j] = i + j < n ? u2[i + j] : 0.5;
+    }
+    KERNEL(box_muller_vec)(
+      VEC_LOAD(lanes1), VEC_LOAD(lanes2), lanes1, lanes2
+    );
+    for (size_t j = i; j < n; j++) {
+      cosines[j] = lanes1[j - i];
+      sines[j] = lanes2[j - i];
+    }
+  }
+}
+
+KERNEL_TARGET static void KERNEL(momentum_step)(
+  real* param, const real* gradient, real* velocity, size_t n, real rate,
+  real momentum, unsigned int nesterov
+) {
+  VEC factor = VEC_SET1(momentum);
+  VEC step = VEC_SET1(-rate);
+  size_t i = 0;
+  for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+    VEC g = VEC_LOAD(gradient + i);
+    VEC v = VEC_FMADD(factor, VEC_LOAD(velocity + i), g);
+    VEC direction = nesterov ? VEC_FMADD(factor, v, g) : v;
+    VEC_STORE(velocity + i, v);
+    VEC_STORE(param + i, VEC_FMADD(step, direction, VEC_LOAD(param + i)));
+  }
+  for (; i < n; i++) {
+    velocity[i] = momentum * velocity[i] + gradient[i];
+    real direction = nesterov
+      ? gradient[i] + momentum * velocity[i]
+      : velocity[i];
+    param[i] -= rate * direction;
+  }
+}
+
+KERNEL_TARGET static void KERNEL(adam_step)(
+  real* param, const real* gradient, real* first, real* second, size_t n,
+  const AdamStep* step
+) {
+  VEC beta1 = VEC_SET1(step->beta1);
+  VEC beta2 = VEC_SET1(step->beta2);
+  VEC first_weight = VEC_SET1(1 - step->beta1);
+  VEC second_weight = VEC_SET1(1 - step->beta2);
+  VEC rate = VEC_SET1(step->rate);
+  VEC correction = VEC_SET1(step->second_correction);
+  VEC epsilon = VEC_SET1(step->epsilon);
+  VEC gradient_decay = VEC_SET1(step->gradient_decay);
+  VEC keep = VEC_SET1(1 - step->parameter_decay);
+  size_t i = 0;
+  for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+    VEC p = VEC_LOAD(param + i);
+    VEC g = VEC_FMADD(gradient_decay, p, VEC_LOAD(gradient + i));
+    VEC m = VEC_FMADD(
+      beta1, VEC_LOAD(first + i), VEC_MUL(first_weight, g)
+    );
+    VEC v = VEC_FMADD(
+      beta2, VEC_LOAD(second + i), VEC_MUL(second_weight, VEC_MUL(g, g))
+    );
+    VEC denominator = VEC_ADD(VEC_SQRT(VEC_MUL(v, correction)), epsilon);
+    VEC update = VEC_DIV(VEC_MUL(rate, m), denominator);
+    VEC_STORE(first + i, m);
+    VEC_STORE(second + i, v);
+    VEC_STORE(param + i, VEC_SUB(VEC_MUL(keep, p), update));
+  }
+  for (; i < n; i++) {
+    real g = gradient[i] + step->gradient_decay * param[i];
+    first[i] = step->beta1 * first[i] + (1 - step->beta1) * g;
+    second[i] = step->beta2 * second[i] + (1 - step->beta2) * g * g;
+    real denominator = sqrt(second[i] * step->second_correction)
+      + step->epsilon;
+    param[i] = (1 - step->parameter_decay) * param[i]
+      - step->rate * first[i] / denominator;
+  }
+}
+
+#undef KERNEL
+#undef KERNEL_TARGET
+#undef VEC
+#undef VEC_MASK
+#undef VEC_WIDTH
+#undef VEC_LOAD
+#undef VEC_STORE
+#undef VEC_SET1
+#undef VEC_ZERO
+#undef VEC_ADD
+#undef VEC_SUB
+#undef VEC_MUL
+#undef VEC_DIV
+#undef VEC_SQRT
+#undef VEC_FMADD
+#undef VEC_ABS
+#undef VEC_SIGN
+#undef VEC_XOR
+#undef VEC_GT
+#undef VEC_SELECT
+#undef VEC_EXPONENT
+#undef VEC_MANTISSA
+#undef ACC_VEC
+#undef ACC_WIDTH
+#undef ACC_LOAD
+#undef ACC_STORE
+#undef ACC_ZERO
+#undef ACC_ADD
+#undef ACC_FMADD
+#undef ACC_ABS
@@ -2,27 +2,207 @@
 #define NUM_EPOCHS 1000000
 // print information every increment
 #define PRINT_INCREMENT 1000
+// optimizer and learning rate used for training
+#define OPTIMIZER OPTIMIZER_NESTEROV
+#define LEARNING_RATE 0.001
+// samples per batch and shuffle window when training from a file
+#define DATASET_BATCH 32
+#define DATASET_WINDOW 4096
+// where a profiling build (make PROFILE=1) writes its results
+#define PROFILE_JSON "profile.json"
+#define PROFILE_TRACE "profile_trace.json"
 // // reset the display of the average cost every so many epochs
 // #define RESET_COST 1000
 
 #include "network.h"
+#include "optimizer.h"
+#include "dataset.h"
+#include "profile.h"
+#include "topology.h"
+#include "quantize.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-int main(void) {
+static void write_profile() {
+  #ifdef ENABLE_PROFILING
+  FILE* file = fopen(PROFILE_JSON, "w");
+  if (file) {
+    profile_write_json(file);
+    fclose(file);
+  }
+  file = fopen(PROFILE_TRACE, "w");
+  if (file) {
+    profile_write_trace(file);
+    fclose(file);
+  }
+  printf("Profile written to %s and %s\n", PROFILE_JSON, PROFILE_TRACE);
+  #endif
+}
+
+static void report_quantization(Network* net) {
+  // the trained network in int8, calibrated and compared on every one-hot
+  // input; calibration runs forward passes, so the cost is kept aside
+  unsigned int inputs = net->num_nodes[0];
+  double total_cost = net->total_cost;
+  double* samples = (double*)calloc((size_t)inputs * inputs, sizeof(double));
+  for (unsigned int s = 0; s < inputs; s++) {
+    samples[(size_t)s * inputs + s] = 1;
+  }
+  QuantizedNetwork quantized;
+  QuantizationReport report;
+  initialise_quantized_network(&quantized, net, samples, inputs, 0);
+  quantization_report(&quantized, net, samples, inputs, &report);
+  print_quantization_report(&report);
+  initialise_quantized_network(&quantized, net, samples, inputs, 1);
+  free(samples);
+  net->total_cost = total_cost;
+}
+
+typedef struct TailBatch {
+  // a network the size of the short final batch of a pass, sharing the
+  // trained network's parameters, with the samples repacked to its width
+  Network net;
+  double* input;
+  double* target;
+  unsigned int count;
+} TailBatch;
+
+static void clear_tail_batch(TailBatch* tail, Network* net) {
+  if (!tail->count) {
+    return;
+  }
+  initialise_batch_network(
+    &tail->net, net->num_layers, net->num_nodes, tail->count, 1
+  );
+  free(tail->input);
+  free(tail->target);
+  tail->count = 0;
+}
+
+static void train_short_batch(
+  TailBatch* tail, Network* net, Optimizer* optimizer, double* input,
+  double* target, unsigned int count
+) {
+  // the last batch of a pass holds fewer samples, and its zero columns
+  // would pull the cost and gradients toward zero targets; it runs instead
+  // on a network of its own size, which the optimizer then steps through.
+  // every pass ends on the same count, so the network is built once
+  unsigned int inputs = net->num_nodes[0];
+  unsigned int outputs = net->num_nodes[net->num_layers-1];
+  if (tail->count != count) {
+    clear_tail_batch(tail, net);
+    initialise_network_without_parameters(
+      &tail->net, net->num_layers, net->num_nodes, count, 0
+    );
+    share_parameters(net, &tail->net);
+    tail->input = (double*)malloc(sizeof(double) * inputs * count);
+    tail->target = (double*)malloc(sizeof(double) * outputs * count);
+    tail->count = count;
+  }
+  // the samples are the first count columns of a DATASET_BATCH batch
+  for (unsigned int r = 0; r < inputs; r++) {
+    memcpy(tail->input + (size_t)r * count,
+      input + (size_t)r * DATASET_BATCH, sizeof(double) * count);
+  }
+  for (unsigned int r = 0; r < outputs; r++) {
+    memcpy(tail->target + (size_t)r * count,
+      target + (size_t)r * DATASET_BATCH, sizeof(double) * count);
+  }
+  forward_pass(&tail->net, tail->input, tail->target);
+  optimise(optimizer, &tail->net);
+  net->total_cost = tail->net.total_cost;
+}
+
+static void train_dataset(
+  const char* path, unsigned int num_layers, unsigned int* num_nodes,
+  double cost_threshold
+) {
+  // samples are num_nodes[0] inputs then num_nodes[num_layers-1] targets,
+  // CSV when the name ends in .csv and native doubles otherwise; every
+  // pass reads the file once, shuffled with its own seed
+  size_t length = strlen(path);
+  enum datasetFormat format = DATASET_BINARY;
+  if (length > 4 && !strcmp(path + length - 4, ".csv")) {
+    format = DATASET_CSV;
+  }
+  Network net;
+  Optimizer optimizer;
+  Dataset dataset;
+  TailBatch tail = {0};
+  initialise_batch_network(&net, num_layers, num_nodes, DATASET_BATCH, 0);
+  randomise_network(&net);
+  initialise_optimizer(&optimizer, &net, OPTIMIZER, LEARNING_RATE, 0);
+  double average_cost = 0;
+  double* input;
+  double* output;
+  unsigned int i = 0;
+  unsigned int done = 0;
+  for (unsigned int pass = 1; !done && i < NUM_EPOCHS; pass++) {
+    open_dataset(
+      &dataset, path, format, num_nodes[0], num_nodes[num_layers-1],
+      DATASET_BATCH, DATASET_WINDOW, 0, pass
+    );
+    unsigned int count = next_batch(&dataset, &input, &output);
+    if (!count) {
+      printf("Error: Dataset: %s holds no samples\n", path);
+      exit(1);
+    }
+    for (; count && i < NUM_EPOCHS; i++) {
+      if (count < DATASET_BATCH) {
+        train_short_batch(&tail, &net, &optimizer, input, output, count);
+      } else {
+        forward_pass(&net, input, output);
+        optimise(&optimizer, &net);
+      }
+      average_cost += net.total_cost;
+      if (!(i%PRINT_INCREMENT))
+        printf("i: %d Total cost: %f, Average: %f\n", i, net.total_cost, average_cost/(i+1));
+      if (net.total_cost <= cost_threshold) {
+        done = 1;
+        break;
+      }
+      count = next_batch(&dataset, &input, &output);
+    }
+    close_dataset(&dataset);
+  }
+  clear_tail_batch(&tail, &net);
+  initialise_optimizer(&optimizer, &net, OPTIMIZER, LEARNING_RATE, 1);
+  initialise_batch_network(&net, num_layers, num_nodes, DATASET_BATCH, 1);
+  printf("Done in %d batches! Cost: %f :D\n", i, net.total_cost);
+}
+
+int main(int argc, char** argv) {
   printf("Hello Saqib\n");
   Network net;
+  Optimizer optimizer;
   const unsigned int num_layers = 2;
   unsigned int num_nodes[] = {10, 10};
   double* output = (double*)calloc(num_nodes[num_layers-1], sizeof(double));
   double* input = (double*)calloc(num_nodes[0], sizeof(double));
   // stop training once threshold reached
   const double cost_threshold = 0.001;
+  if (argc > 1) {
+    // train from a file instead of the built in example
+    train_dataset(argv[1], num_layers, num_nodes, cost_threshold);
+    write_profile();
+    free(output);
+    free(input);
+    return 0;
+  }
   printf("Initialising network\n");
   initialise_network(&net, num_layers, num_nodes, 0);
   printf("Randomising network\n");
   randomise_network(&net);
+  initialise_optimizer(&optimizer, &net, OPTIMIZER, LEARNING_RATE, 0);
+  // the passes generated for this topology, if the build has them
+  unsigned int specialized = topology_matches(&net);
+  if (specialized) {
+    printf("Using the specialized passes\n");
+  }
   double average_cost = 0;
+  // the training loop should never touch the heap
+  unsigned long start_allocations = allocation_count();
   unsigned int i = 0;
   for (; i < NUM_EPOCHS; i++) {
     // autoencoder
@@ -32,21 +212,35 @@ int main(void) {
     input[index] = 1;
     output[index] = 1;
     // printf("Forward pass\n");
-    forward_pass(&net, input, output);
+    if (specialized) {
+      topology_forward_pass(&net, input, output);
+    } else {
+      forward_pass(&net, input, output);
+    }
     average_cost += net.total_cost;
     if (!(i%PRINT_INCREMENT))
-      printf("i: %d Total cost: %f, Average: %f\n", i, net.total_cost, average_cost/i);
+      printf("i: %d Total cost: %f, Average: %f\n", i, net.total_cost, average_cost/(i+1));
     // printf("Backpropagating\n");
-    backpropagate(&net, 0.001, 0.001);
+    if (specialized) {
+      topology_compute_gradients(&net);
+      optimizer_step(&optimizer, &net);
+    } else {
+      optimise(&optimizer, &net);
+    }
     // reset values
     input[index] = 0;
     output[index] = 0;
     if (net.total_cost <= cost_threshold) break;
   }
+  printf("Allocations during training: %lu\n",
+    allocation_count() - start_allocations);
+  report_quantization(&net);
   // free all network data
   free(output);
   free(input);
+  initialise_optimizer(&optimizer, &net, OPTIMIZER, LEARNING_RATE, 1);
   initialise_network(&net, num_layers, num_nodes, 1);
   printf("Done in %d epochs! Cost: %f :D\n", i, net.total_cost);
+  write_profile();
   return 0;
 }
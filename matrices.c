@@ -1,10 +1,23 @@
 #include "matrices.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include "profile.h"
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
+// columns of mat2 per gemm() panel, chosen so a panel of a few thousand
+// rows still fits in L2 cache
+#define GEMM_BLOCK_COLUMNS 64
+// multiply-adds below which an operation stays on one thread, so small
+// layers never pay for waking the pool
+#define PARALLEL_MIN_WORK 65536
+// rows handled together by the gemm and gemv register tiles
+#define ROW_TILE 4
 
 // generate normal distribution for starting values
 
@@ -19,59 +32,233 @@ double random_normal() {
   return sqrt(-2*log(drand())) * cos(2*M_PI*drand());
 }
 
+// count heap allocations so callers can check the training loop makes none;
+// any thread may allocate, so the total is atomic, and each thread also
+// keeps its own count for charging allocations to the work it did
+
+static _Atomic unsigned long allocations = 0;
+static _Thread_local unsigned long thread_allocations = 0;
+
+static void count_allocation() {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  thread_allocations++;
+}
+
+static void* counted_calloc(size_t count, size_t size) {
+  count_allocation();
+  return calloc(count, size);
+}
+
+unsigned long allocation_count() {
+  return atomic_load_explicit(&allocations, memory_order_relaxed);
+}
+
+unsigned long thread_allocation_count() {
+  return thread_allocations;
+}
+
 // implement matrix calculations
 
+unsigned int padded_stride(unsigned int columns) {
+  // rows of more than one element are padded to whole MATRIX_ALIGNMENT
+  // blocks, column vectors stay dense
+  unsigned int per_block = MATRIX_ALIGNMENT / sizeof(real);
+  if (columns <= 1) {
+    return columns;
+  }
+  return (columns + per_block - 1) / per_block * per_block;
+}
+
 Matrix* create_empty_matrix(unsigned int rows, unsigned int columns) {
-  Matrix* matAns = (Matrix*)malloc(sizeof(Matrix));
+  Matrix* matAns = (Matrix*)counted_calloc(1, sizeof(Matrix));
   matAns->rows = rows;
   matAns->columns = columns;
-  unsigned int matrix_size = matAns->rows * matAns->columns;
-  matAns->matrix_data = (double*)calloc(sizeof(double), matrix_size);
+  matAns->stride = padded_stride(columns);
+  matAns->matrix_data = create_aligned_data((size_t)rows * matAns->stride);
+  matAns->owns_data = 1;
   return matAns;
 }
 
+real* create_aligned_data(size_t count) {
+  // zeroed memory on a MATRIX_ALIGNMENT boundary, released with free()
+  // aligned_alloc wants a non-zero multiple of the alignment
+  size_t blocks = (
+    (sizeof(real) * count + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT
+  );
+  size_t size = (blocks ? blocks : 1) * MATRIX_ALIGNMENT;
+  count_allocation();
+  real* data = (real*)aligned_alloc(MATRIX_ALIGNMENT, size);
+  memset(data, 0, size);
+  return data;
+}
+
+Matrix* create_strided_view(
+  real* data, unsigned int rows, unsigned int columns, unsigned int stride
+) {
+  // matrix header over memory owned by someone else, e.g. a workspace
+  Matrix* matAns = (Matrix*)counted_calloc(1, sizeof(Matrix));
+  matAns->rows = rows;
+  matAns->columns = columns;
+  matAns->matrix_data = data;
+  matAns->owns_data = 0;
+  matAns->stride = stride;
+  matAns->transposed = 0;
+  return matAns;
+}
+
+Matrix* create_matrix_view(
+  real* data, unsigned int rows, unsigned int columns
+) {
+  return create_strided_view(data, rows, columns, columns);
+}
+
 void free_matrix(Matrix* matrix) {
-  free(matrix->matrix_data);
+  if (matrix->owns_data) {
+    free(matrix->matrix_data);
+  }
   free(matrix);
 }
 
-double get_element(Matrix* mat, unsigned int row, unsigned int column) {
-  unsigned int index = (mat->columns * row) + column;
-  return mat->matrix_data[index];
+// how far apart consecutive elements of a column and of a row are stored
+
+static size_t row_step(Matrix* mat) {
+  return mat->transposed ? 1 : mat->stride;
 }
 
-Matrix* get_column(Matrix* mat, unsigned int column) {
-  Matrix* matAns = (Matrix*)malloc(sizeof(Matrix) * mat->rows);
-  matAns->rows = mat->rows;
-  matAns->columns = 1;
-  double* columnData = (double*)malloc(sizeof(double) * matAns->rows);
-  for (unsigned int r = 0; r < matAns->rows; r++) {
-    columnData[r] = get_element(mat, r, column);
+static size_t column_step(Matrix* mat) {
+  return mat->transposed ? mat->stride : 1;
+}
+
+// the shape of the data as it is laid out in memory
+
+static unsigned int stored_rows(Matrix* mat) {
+  return mat->transposed ? mat->columns : mat->rows;
+}
+
+static unsigned int stored_columns(Matrix* mat) {
+  return mat->transposed ? mat->rows : mat->columns;
+}
+
+unsigned int is_dense(Matrix* mat) {
+  // stored rows follow each other with no padding in between
+  return mat->stride == stored_columns(mat) || stored_rows(mat) <= 1;
+}
+
+static real* element_address(
+  Matrix* mat, unsigned int row, unsigned int column
+) {
+  return mat->matrix_data + row * row_step(mat) + column * column_step(mat);
+}
+
+real get_element(Matrix* mat, unsigned int row, unsigned int column) {
+  return *element_address(mat, row, column);
+}
+
+void set_element(
+  Matrix* mat, unsigned int row, unsigned int column, real value
+) {
+  *element_address(mat, row, column) = value;
+}
+
+real* get_row_data(Matrix* mat, unsigned int row) {
+  // start of a row, whose elements are consecutive unless transposed
+  return mat->matrix_data + row * row_step(mat);
+}
+
+Matrix* get_block(
+  Matrix* mat, unsigned int row, unsigned int column, unsigned int rows,
+  unsigned int columns
+) {
+  // rows x columns view starting at (row, column), no data is copied
+  if (row + rows > mat->rows || column + columns > mat->columns) {
+    printf("Error: Matrix block: "
+    "%d x %d at (%d, %d) does not fit in %d x %d\n",
+    rows, columns, row, column, mat->rows, mat->columns);
+    exit(1);
   }
-  matAns->matrix_data = columnData;
+  Matrix* matAns = create_strided_view(
+    element_address(mat, row, column), rows, columns, mat->stride
+  );
+  matAns->transposed = mat->transposed;
   return matAns;
 }
 
+Matrix* get_column(Matrix* mat, unsigned int column) {
+  return get_block(mat, 0, column, mat->rows, 1);
+}
+
 Matrix* get_row(Matrix* mat, unsigned int row) {
-  Matrix* matAns = (Matrix*)malloc(sizeof(Matrix) * mat->columns);
-  matAns->rows = 1;
-  matAns->columns = mat->columns;
-  double* rowData = (double*)malloc(sizeof(double) * matAns->columns);
-  for (unsigned int c = 0; c < matAns->columns; c++) {
-    rowData[c] = get_element(mat, row, c);
-  }
-  matAns->matrix_data = rowData;
+  return get_block(mat, row, 0, 1, mat->columns);
+}
+
+Matrix* transposed_view(Matrix* mat) {
+  Matrix* matAns = create_strided_view(
+    mat->matrix_data, mat->columns, mat->rows, mat->stride
+  );
+  matAns->transposed = !mat->transposed;
   return matAns;
 }
 
+static double reduce(Matrix* mat, double (*reduction)(const real*, size_t)) {
+  // sums a reduction over the stored rows, in one call when they are dense
+  if (is_dense(mat)) {
+    return reduction(mat->matrix_data, (size_t)mat->rows * mat->columns);
+  }
+  double total = 0;
+  for (unsigned int r = 0; r < stored_rows(mat); r++) {
+    total += reduction(
+      mat->matrix_data + (size_t)r * mat->stride, stored_columns(mat)
+    );
+  }
+  return total;
+}
+
 double sum(Matrix* mat) {
   // gets sum of elements in matrix
-  float total = 0;
-  unsigned int mat_size = mat->rows * mat->columns;
-  for (unsigned int i = 0; i < mat_size; i++) {
-    total += mat->matrix_data[i];
+  return reduce(mat, vector_sum);
+}
+
+double abs_sum(Matrix* mat) {
+  return reduce(mat, vector_abs_sum);
+}
+
+typedef void (*elementwise_kernel)(
+  const real* a, const real* b, real* out, size_t n
+);
+
+static void elementwise(
+  Matrix* mat1, Matrix* mat2, Matrix* matAns, elementwise_kernel kernel
+) {
+  // applies a kernel to matrices of the same size: over the whole data
+  // when it is dense, row by row when the layouts match, and one element
+  // at a time otherwise
+  if (mat1->transposed == mat2->transposed
+    && mat1->transposed == matAns->transposed) {
+    if (is_dense(mat1) && is_dense(mat2) && is_dense(matAns)) {
+      kernel(
+        mat1->matrix_data, mat2->matrix_data, matAns->matrix_data,
+        (size_t)mat1->rows * mat1->columns
+      );
+    } else {
+      for (unsigned int r = 0; r < stored_rows(mat1); r++) {
+        kernel(
+          mat1->matrix_data + (size_t)r * mat1->stride,
+          mat2->matrix_data + (size_t)r * mat2->stride,
+          matAns->matrix_data + (size_t)r * matAns->stride,
+          stored_columns(mat1)
+        );
+      }
+    }
+  } else {
+    for (unsigned int r = 0; r < mat1->rows; r++) {
+      for (unsigned int c = 0; c < mat1->columns; c++) {
+        kernel(
+          element_address(mat1, r, c), element_address(mat2, r, c),
+          element_address(matAns, r, c), 1
+        );
+      }
+    }
   }
-  return total;
 }
 
 void hadamard_product(Matrix* mat1, Matrix* mat2, Matrix* matAns) {
@@ -82,12 +269,13 @@ void hadamard_product(Matrix* mat1, Matrix* mat2, Matrix* matAns) {
     );
     exit(1);
   } else {
+    PROFILE_START(start);
     matAns->rows = mat1->rows;
     matAns->columns = mat1->columns;
-    unsigned int matrix_size = mat1->rows * mat1->columns;
-    for (unsigned int i = 0; i < matrix_size; i++) {
-      matAns->matrix_data[i] = mat1->matrix_data[i] * mat2->matrix_data[i];
-    }
+    elementwise(mat1, mat2, matAns, vector_multiply);
+    PROFILE_END(start, "hadamard_product", -1,
+      (double)mat1->rows * mat1->columns,
+      PROFILE_BYTES(3.0 * mat1->rows * mat1->columns));
   }
 }
 
@@ -99,12 +287,17 @@ double dot_product(Matrix* mat1, Matrix* mat2) {
     "matrices not the same size: %d x %d, %d x %d\n",
     mat1->rows, mat1->columns, mat2->rows, mat2->columns);
     exit(1);
+  } else if (is_dense(mat1) && is_dense(mat2)
+    && mat1->transposed == mat2->transposed) {
+    return vector_dot(mat1->matrix_data, mat2->matrix_data, mat1_size);
   } else {
-    double dot_product = 0;
+    // elements paired in row-major order of each matrix's own shape
+    double total = 0;
     for (unsigned int i = 0; i < mat1_size; i++) {
-      dot_product += (mat1->matrix_data[i] * mat2->matrix_data[i]);
+      total += (accum)get_element(mat1, i / mat1->columns, i % mat1->columns)
+        * get_element(mat2, i / mat2->columns, i % mat2->columns);
     }
-    return dot_product;
+    return total;
   }
 }
 
@@ -121,50 +314,568 @@ void print_matrix(Matrix* mat) {
 
 Matrix* multiply(Matrix* mat1, Matrix* mat2) {
   // to multiply a matrix, mat1->columns == mat2->rows
+  // new matrix dimensions: mat1.rows, mat2.columns
+  Matrix* mat = create_empty_matrix(
+    mat1->rows,
+    mat2->columns
+  );
+  gemm(mat1, mat2, mat);
+  return mat;
+}
+
+static void check_multiply_sizes(
+  const char* name, Matrix* mat1, Matrix* mat2, Matrix* matAns
+) {
   if (mat1->columns != mat2->rows) {
-    printf("Error: Matrix multiplication: "
+    printf("Error: %s: "
     "matrices incompatible: %d x %d, %d x %d\n",
-    mat1->rows, mat1->columns, mat2->rows, mat2->columns);
+    name, mat1->rows, mat1->columns, mat2->rows, mat2->columns);
     exit(1);
+  } else if (matAns->rows != mat1->rows || matAns->columns != mat2->columns) {
+    printf("Error: %s: "
+    "answer matrix not the right size: %d x %d, expected %d x %d\n",
+    name, matAns->rows, matAns->columns, mat1->rows, mat2->columns);
+    exit(1);
+  }
+}
+
+unsigned int parallel_grain(size_t work_per_item) {
+  // items per parallel chunk so each chunk is worth handing to a thread
+  size_t grain = PARALLEL_MIN_WORK / (work_per_item ? work_per_item : 1);
+  return grain ? (unsigned int)grain : 1;
+}
+
+typedef struct MultiplyTask {
+  // element (r, k) of a is at a[r * a_row_step + k * a_column_step], row
+  // k of b starts at b + k * b_stride and row r of c at c + r * c_stride
+  const real* a;
+  const real* b;
+  real* c;
+  size_t a_row_step;
+  size_t a_column_step;
+  size_t b_stride;
+  size_t c_stride;
+  unsigned int rows;
+  unsigned int inner;
+  unsigned int columns;
+  // fused layer forward: bias column added before the answer is stored,
+  // the sum optionally kept in preactivation, which is laid out like c,
+  // then atan applied
+  const real* bias;
+  size_t bias_step;
+  real* preactivation;
+  unsigned int activate;
+} MultiplyTask;
+
+static unsigned int rows_contiguous(Matrix* mat) {
+  // each row's elements are next to each other
+  return column_step(mat) == 1 || mat->columns <= 1;
+}
+
+static MultiplyTask multiply_task(
+  Matrix* mat1, Matrix* mat2, Matrix* matAns
+) {
+  // matAns = mat1 * mat2 for any mat1, mat2 and matAns with contiguous
+  // rows
+  MultiplyTask task;
+  memset(&task, 0, sizeof(task));
+  task.a = mat1->matrix_data;
+  task.a_row_step = row_step(mat1);
+  task.a_column_step = column_step(mat1);
+  task.b = mat2->matrix_data;
+  task.b_stride = row_step(mat2);
+  task.c = matAns->matrix_data;
+  task.c_stride = row_step(matAns);
+  task.rows = matAns->rows;
+  task.inner = mat1->columns;
+  task.columns = matAns->columns;
+  return task;
+}
+
+static void finish_elements(MultiplyTask* task, size_t offset, size_t n) {
+  // the stores after the bias of a fused layer forward, run on a few rows
+  // of the answer while they are still in cache
+  if (task->preactivation) {
+    vector_copy(task->c + offset, task->preactivation + offset, n);
+  }
+  if (task->activate) {
+    vector_atan(task->c + offset, task->c + offset, n);
+  }
+}
+
+static void gemv_rows(void* context, unsigned int begin, unsigned int end) {
+  // begin and end count tiles of ROW_TILE rows, the matrix rows, the
+  // vector and the answer are all contiguous
+  MultiplyTask* task = (MultiplyTask*)context;
+  unsigned int columns = task->inner;
+  size_t stride = task->a_row_step;
+  const real* x = task->b;
+  real* y = task->c;
+  unsigned int r = begin * ROW_TILE;
+  unsigned int r_end = end * ROW_TILE;
+  if (r_end > task->rows) r_end = task->rows;
+  unsigned int r_begin = r;
+  const real* bias = task->bias;
+  size_t bias_step = task->bias_step;
+  // four rows at a time so each element of vec is loaded once per block
+  for (; r + ROW_TILE <= r_end; r += ROW_TILE) {
+    const real* a0 = task->a + r * stride;
+    const real* a1 = a0 + stride;
+    const real* a2 = a1 + stride;
+    const real* a3 = a2 + stride;
+    accum sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    if (bias) {
+      sum0 = bias[r * bias_step];
+      sum1 = bias[(r+1) * bias_step];
+      sum2 = bias[(r+2) * bias_step];
+      sum3 = bias[(r+3) * bias_step];
+    }
+    for (unsigned int c = 0; c < columns; c++) {
+      accum xc = x[c];
+      sum0 += a0[c] * xc;
+      sum1 += a1[c] * xc;
+      sum2 += a2[c] * xc;
+      sum3 += a3[c] * xc;
+    }
+    y[r] = sum0;
+    y[r+1] = sum1;
+    y[r+2] = sum2;
+    y[r+3] = sum3;
+  }
+  for (; r < r_end; r++) {
+    const real* a = task->a + r * stride;
+    accum total = bias ? bias[r * bias_step] : 0;
+    for (unsigned int c = 0; c < columns; c++) {
+      total += (accum)a[c] * x[c];
+    }
+    y[r] = total;
+  }
+  finish_elements(task, r_begin, r_end - r_begin);
+}
+
+static void run_gemv(MultiplyTask* task) {
+  unsigned int tiles = (task->rows + ROW_TILE - 1) / ROW_TILE;
+  parallel_for(
+    tiles, parallel_grain((size_t)ROW_TILE * task->inner), gemv_rows, task
+  );
+}
+
+static void gemm_rows(void* context, unsigned int begin, unsigned int end) {
+  // begin and end count tiles of ROW_TILE rows, splitting on whole tiles
+  // keeps every element's arithmetic the same whatever the thread count
+  MultiplyTask* task = (MultiplyTask*)context;
+  unsigned int inner = task->inner;
+  unsigned int columns = task->columns;
+  const real* a = task->a;
+  size_t ars = task->a_row_step;
+  size_t acs = task->a_column_step;
+  const real* b = task->b;
+  real* c = task->c;
+  unsigned int row_begin = begin * ROW_TILE;
+  unsigned int row_end = end * ROW_TILE;
+  if (row_end > task->rows) row_end = task->rows;
+  // a ROW_TILE x GEMM_BLOCK_COLUMNS tile of the answer is accumulated in
+  // accum precision over the whole inner dimension, while the panel of
+  // mat2 it streams through is reused by every row tile
+  accum tile[ROW_TILE][GEMM_BLOCK_COLUMNS];
+  for (unsigned int j0 = 0; j0 < columns; j0 += GEMM_BLOCK_COLUMNS) {
+    unsigned int width = columns - j0;
+    if (width > GEMM_BLOCK_COLUMNS) width = GEMM_BLOCK_COLUMNS;
+    for (unsigned int r = row_begin; r < row_end; r += ROW_TILE) {
+      unsigned int tile_rows = row_end - r;
+      if (tile_rows > ROW_TILE) tile_rows = ROW_TILE;
+      for (unsigned int t = 0; t < ROW_TILE; t++) {
+        for (unsigned int j = 0; j < width; j++) {
+          tile[t][j] = 0;
+        }
+      }
+      if (tile_rows == ROW_TILE) {
+        // four rows at a time so each loaded element of mat2 is used
+        // four times
+        for (unsigned int k = 0; k < inner; k++) {
+          const real* ak = a + r * ars + k * acs;
+          accum a0 = ak[0];
+          accum a1 = ak[ars];
+          accum a2 = ak[2 * ars];
+          accum a3 = ak[3 * ars];
+          const real* bk = b + k * task->b_stride + j0;
+          for (unsigned int j = 0; j < width; j++) {
+            accum bkj = bk[j];
+            tile[0][j] += a0 * bkj;
+            tile[1][j] += a1 * bkj;
+            tile[2][j] += a2 * bkj;
+            tile[3][j] += a3 * bkj;
+          }
+        }
+      } else {
+        for (unsigned int t = 0; t < tile_rows; t++) {
+          for (unsigned int k = 0; k < inner; k++) {
+            accum ar = a[(r+t) * ars + k * acs];
+            const real* bk = b + k * task->b_stride + j0;
+            for (unsigned int j = 0; j < width; j++) {
+              tile[t][j] += ar * bk[j];
+            }
+          }
+        }
+      }
+      for (unsigned int t = 0; t < tile_rows; t++) {
+        size_t offset = (r+t) * task->c_stride + j0;
+        real* cr = c + offset;
+        if (task->bias) {
+          accum bias = task->bias[(r+t) * task->bias_step];
+          for (unsigned int j = 0; j < width; j++) {
+            cr[j] = tile[t][j] + bias;
+          }
+        } else {
+          for (unsigned int j = 0; j < width; j++) {
+            cr[j] = tile[t][j];
+          }
+        }
+        finish_elements(task, offset, width);
+      }
+    }
+  }
+}
+
+static void run_gemm(MultiplyTask* task) {
+  unsigned int tiles = (task->rows + ROW_TILE - 1) / ROW_TILE;
+  size_t tile_work = (size_t)ROW_TILE * task->inner * task->columns;
+  parallel_for(tiles, parallel_grain(tile_work), gemm_rows, task);
+}
+
+static void run_multiply(MultiplyTask* task) {
+  // the vector kernel when everything it reads and writes is contiguous
+  if (task->columns == 1 && task->a_column_step == 1 && task->b_stride == 1
+    && task->c_stride == 1) {
+    run_gemv(task);
   } else {
-    // new matrix dimensions: mat1.rows, mat2.columns
-    // matAns->rows = mat1->rows;
-    // matAns->columns = mat2->columns;
-    // unsigned int matrix_size = matAns->rows * matAns->columns;
-    // free(matAns->matrix_data);
-    // free(matAns);
-    Matrix* mat = create_empty_matrix(
-      mat1->rows,
-      mat2->columns
+    run_gemm(task);
+  }
+}
+
+static void multiply_elements(Matrix* mat1, Matrix* mat2, Matrix* matAns) {
+  // any layout, one element at a time
+  for (unsigned int r = 0; r < matAns->rows; r++) {
+    for (unsigned int c = 0; c < matAns->columns; c++) {
+      accum total = 0;
+      for (unsigned int k = 0; k < mat1->columns; k++) {
+        total += (accum)get_element(mat1, r, k) * get_element(mat2, k, c);
+      }
+      set_element(matAns, r, c, total);
+    }
+  }
+}
+
+void gemv(Matrix* mat, Matrix* vec, Matrix* matAns) {
+  // matAns = mat * vec, where vec and matAns are column vectors
+  check_multiply_sizes("Matrix-vector multiplication", mat, vec, matAns);
+  if (vec->columns != 1) {
+    printf("Error: Matrix-vector multiplication: "
+    "not a vector: %d x %d\n", vec->rows, vec->columns);
+    exit(1);
+  }
+  PROFILE_START(start);
+  MultiplyTask task = multiply_task(mat, vec, matAns);
+  run_multiply(&task);
+  PROFILE_END(start, "gemv", -1, 2.0 * mat->rows * mat->columns,
+    PROFILE_BYTES((double)mat->rows * mat->columns + mat->rows
+    + mat->columns));
+}
+
+void gemm(Matrix* mat1, Matrix* mat2, Matrix* matAns) {
+  // matAns = mat1 * mat2, matAns must not share data with mat1 or mat2;
+  // mat1 may be a transposed view
+  check_multiply_sizes("Matrix multiplication", mat1, mat2, matAns);
+  PROFILE_START(start);
+  if (!rows_contiguous(mat2) || !rows_contiguous(matAns)) {
+    multiply_elements(mat1, mat2, matAns);
+  } else {
+    MultiplyTask task = multiply_task(mat1, mat2, matAns);
+    run_multiply(&task);
+  }
+  PROFILE_END(start, "gemm", -1,
+    2.0 * mat1->columns * matAns->rows * matAns->columns,
+    PROFILE_BYTES((double)mat1->columns * (matAns->rows + matAns->columns)
+    + (double)matAns->rows * matAns->columns));
+}
+
+static void bias_rows(void* context, unsigned int begin, unsigned int end) {
+  // the fused layer forward without a product: a is the input itself
+  MultiplyTask* task = (MultiplyTask*)context;
+  for (unsigned int r = begin; r < end; r++) {
+    size_t offset = r * task->c_stride;
+    const real* in = task->a + r * task->a_row_step;
+    real* out = task->c + offset;
+    real bias = task->bias[r * task->bias_step];
+    for (unsigned int j = 0; j < task->columns; j++) {
+      out[j] = in[j] + bias;
+    }
+    finish_elements(task, offset, task->columns);
+  }
+}
+
+void gemm_bias_atan(
+  Matrix* mat1, Matrix* mat2, Matrix* bias, Matrix* preactivation,
+  Matrix* matAns
+) {
+  // matAns = atan(mat1 * mat2 + bias) in one sweep over the answer, the
+  // column vector bias is added to every column; a NULL mat1 leaves out
+  // the product and a NULL preactivation skips storing mat1 * mat2 + bias
+  if (mat1) {
+    check_multiply_sizes("Layer forward", mat1, mat2, matAns);
+  } else if (matAns->rows != mat2->rows
+    || matAns->columns != mat2->columns) {
+    printf("Error: Layer forward: "
+    "matrices not the same size: %d x %d, %d x %d\n",
+    mat2->rows, mat2->columns, matAns->rows, matAns->columns);
+    exit(1);
+  }
+  if (bias->rows != matAns->rows || bias->columns != 1
+    || (preactivation && (preactivation->rows != matAns->rows
+    || preactivation->columns != matAns->columns))) {
+    printf("Error: Layer forward: "
+    "bias or pre-activation not the right size for %d x %d\n",
+    matAns->rows, matAns->columns);
+    exit(1);
+  }
+  if (!rows_contiguous(mat2) || !rows_contiguous(matAns)
+    || (preactivation && (row_step(preactivation) != row_step(matAns)
+    || !rows_contiguous(preactivation)))) {
+    printf("Error: Layer forward: "
+    "input, answer and pre-activation need contiguous rows, laid out alike\n");
+    exit(1);
+  }
+  MultiplyTask task = multiply_task(mat1 ? mat1 : mat2, mat2, matAns);
+  task.bias = bias->matrix_data;
+  task.bias_step = row_step(bias);
+  task.preactivation = preactivation ? preactivation->matrix_data : NULL;
+  task.activate = 1;
+  PROFILE_START(start);
+  if (!mat1) {
+    parallel_for(
+      task.rows, parallel_grain(task.columns), bias_rows, &task
     );
-    for (unsigned int r = 0; r < mat->rows; r++) {
-      // r^th row of first matrix, c^th column of second matrix
-      Matrix* row = get_row(mat1, r);
-      for (unsigned int c = 0; c < mat->columns; c++) {
-        Matrix* col = get_column(mat2, c);
-        float dot = 0;
-        dot = dot_product(row, col);
-        unsigned int index = (r * mat->columns) + c;
-        mat->matrix_data[index] = dot;
-        free_matrix(row);
-        free_matrix(col);
+  } else {
+    run_multiply(&task);
+  }
+  PROFILE_END(start, "gemm_bias_atan", -1,
+    (2.0 * (mat1 ? mat1->columns : 0) + 1) * matAns->rows * matAns->columns,
+    PROFILE_BYTES((double)(mat1 ? mat1->columns : 0)
+    * (matAns->rows + matAns->columns)
+    + (preactivation ? 3.0 : 2.0) * matAns->rows * matAns->columns
+    + matAns->rows));
+}
+
+// accum elements of the transposed product kept per block of weight
+// columns, the samples of a batch accumulated together, and the widest
+// block so a single sample still leaves blocks to share between threads
+#define BACKWARD_TILE 1024
+#define BACKWARD_SAMPLES 64
+#define BACKWARD_MAX_COLUMNS 256
+
+typedef struct BackwardTask {
+  real* weights;
+  const real* delta;
+  const real* input;
+  const real* gradient;
+  real* next_delta;
+  real scale;
+  // distances between rows, and between the input's elements
+  size_t weights_stride;
+  size_t delta_stride;
+  size_t input_step;
+  size_t gradient_stride;
+  size_t next_delta_stride;
+  unsigned int rows;
+  unsigned int columns;
+  unsigned int batch_size;
+  unsigned int block_columns;
+  unsigned int block_samples;
+} BackwardTask;
+
+static void update_weight_row(
+  BackwardTask* task, unsigned int i, unsigned int j0, unsigned int width
+) {
+  real* w = task->weights + i * task->weights_stride + j0;
+  if (task->gradient) {
+    vector_axpy(
+      task->scale, task->gradient + i * task->gradient_stride + j0, w, width
+    );
+  } else {
+    // a single sample's gradient is the outer product delta * input^T
+    real di = task->delta[i * task->delta_stride];
+    size_t step = task->input_step;
+    const real* x = task->input + j0 * step;
+    for (unsigned int j = 0; j < width; j++) {
+      w[j] += task->scale * (di * x[j * step]);
+    }
+  }
+}
+
+static void backward_blocks(
+  void* context, unsigned int begin, unsigned int end
+) {
+  // each item is a block of weight columns, which are the rows of
+  // next_delta, so blocks never write the same memory; every row of the
+  // block is read for the transposed product and then updated in place
+  BackwardTask* task = (BackwardTask*)context;
+  unsigned int batch_size = task->batch_size;
+  accum tile[BACKWARD_TILE];
+  for (unsigned int block = begin; block < end; block++) {
+    unsigned int j0 = block * task->block_columns;
+    unsigned int width = task->columns - j0;
+    if (width > task->block_columns) width = task->block_columns;
+    for (unsigned int b0 = 0; b0 < batch_size; b0 += task->block_samples) {
+      unsigned int samples = batch_size - b0;
+      if (samples > task->block_samples) samples = task->block_samples;
+      // the update waits for the last group of samples to read the weights
+      unsigned int update = (b0 + samples == batch_size && task->scale != 0);
+      for (unsigned int t = 0; t < width * samples; t++) {
+        tile[t] = 0;
+      }
+      unsigned int i = 0;
+      // ROW_TILE rows at a time so each tile element is loaded and stored
+      // once per four multiply-adds, added in row order as for one row
+      for (; i + ROW_TILE <= task->rows; i += ROW_TILE) {
+        const real* w0 = task->weights + i * task->weights_stride + j0;
+        const real* w1 = w0 + task->weights_stride;
+        const real* w2 = w1 + task->weights_stride;
+        const real* w3 = w2 + task->weights_stride;
+        const real* d0 = task->delta + i * task->delta_stride + b0;
+        const real* d1 = d0 + task->delta_stride;
+        const real* d2 = d1 + task->delta_stride;
+        const real* d3 = d2 + task->delta_stride;
+        for (unsigned int j = 0; j < width; j++) {
+          accum w0j = w0[j], w1j = w1[j], w2j = w2[j], w3j = w3[j];
+          accum* t = tile + (size_t)j * samples;
+          for (unsigned int b = 0; b < samples; b++) {
+            t[b] = t[b] + w0j * d0[b] + w1j * d1[b] + w2j * d2[b]
+              + w3j * d3[b];
+          }
+        }
+        if (update) {
+          for (unsigned int r = 0; r < ROW_TILE; r++) {
+            update_weight_row(task, i + r, j0, width);
+          }
+        }
+      }
+      for (; i < task->rows; i++) {
+        const real* w = task->weights + i * task->weights_stride + j0;
+        const real* d = task->delta + i * task->delta_stride + b0;
+        for (unsigned int j = 0; j < width; j++) {
+          accum wij = w[j];
+          accum* t = tile + (size_t)j * samples;
+          for (unsigned int b = 0; b < samples; b++) {
+            t[b] += wij * d[b];
+          }
+        }
+        if (update) {
+          update_weight_row(task, i, j0, width);
+        }
+      }
+      for (unsigned int j = 0; j < width; j++) {
+        real* out = task->next_delta + (j0 + j) * task->next_delta_stride + b0;
+        for (unsigned int b = 0; b < samples; b++) {
+          out[b] = tile[(size_t)j * samples + b];
+        }
       }
     }
-    return mat;
   }
 }
 
+void transposed_multiply_update(
+  Matrix* weights, Matrix* delta, Matrix* input, Matrix* gradient,
+  double scale, Matrix* next_delta
+) {
+  // next_delta = weights^T * delta with the weights as they were on entry,
+  // then weights += scale * gradient, in one traversal of the weights and
+  // without building the transpose; a NULL gradient means a single
+  // sample's delta * input^T, computed on the fly, and a zero scale leaves
+  // the weights alone
+  if (weights->rows != delta->rows || next_delta->rows != weights->columns
+    || next_delta->columns != delta->columns
+    || (gradient && (gradient->rows != weights->rows
+    || gradient->columns != weights->columns))
+    || (!gradient && (delta->columns != 1 || input->columns != 1
+    || input->rows != weights->columns))) {
+    printf("Error: Transposed multiply update: "
+    "matrices not the right size: weights %d x %d, delta %d x %d, "
+    "next delta %d x %d\n",
+    weights->rows, weights->columns, delta->rows, delta->columns,
+    next_delta->rows, next_delta->columns);
+    exit(1);
+  } else if (weights->transposed || delta->transposed
+    || next_delta->transposed || (gradient && gradient->transposed)) {
+    printf("Error: Transposed multiply update: "
+    "transposed views not supported\n");
+    exit(1);
+  }
+  BackwardTask task;
+  task.weights = weights->matrix_data;
+  task.delta = delta->matrix_data;
+  task.input = gradient ? NULL : input->matrix_data;
+  task.gradient = gradient ? gradient->matrix_data : NULL;
+  task.next_delta = next_delta->matrix_data;
+  task.scale = scale;
+  task.weights_stride = weights->stride;
+  task.delta_stride = delta->stride;
+  task.input_step = gradient ? 0 : row_step(input);
+  task.gradient_stride = gradient ? gradient->stride : 0;
+  task.next_delta_stride = next_delta->stride;
+  task.rows = weights->rows;
+  task.columns = weights->columns;
+  task.batch_size = delta->columns;
+  task.block_samples = task.batch_size;
+  if (task.block_samples > BACKWARD_SAMPLES) {
+    task.block_samples = BACKWARD_SAMPLES;
+  }
+  task.block_columns = BACKWARD_TILE / task.block_samples;
+  if (task.block_columns > BACKWARD_MAX_COLUMNS) {
+    task.block_columns = BACKWARD_MAX_COLUMNS;
+  }
+  unsigned int blocks = (
+    (task.columns + task.block_columns - 1) / task.block_columns
+  );
+  size_t block_work = (
+    (size_t)task.rows * task.block_columns * task.batch_size
+  );
+  PROFILE_START(start);
+  parallel_for(blocks, parallel_grain(block_work), backward_blocks, &task);
+  // the product, then the update if there is one
+  PROFILE_END(start, "transposed_multiply_update", -1,
+    (2.0 * task.batch_size + ((scale != 0) ? 2 : 0)) * task.rows
+    * task.columns,
+    PROFILE_BYTES(((scale != 0) ? 2.0 : 1.0) * task.rows * task.columns
+    + (gradient ? (double)task.rows * task.columns : 0)
+    + (double)(task.rows + task.columns) * task.batch_size));
+}
+
 void transpose(Matrix* mat, Matrix* matAns) {
+  // copies the transpose into matAns, transposed_view() gives the same
+  // matrix without copying
+  PROFILE_START(start);
   unsigned int rows = mat->columns;
   unsigned int columns = mat->rows;
   matAns->rows = rows;
   matAns->columns = columns;
-  // unsigned int matrix_size = matAns->rows * matAns->columns;
   for (unsigned int r = 0; r < mat->rows; r++) {
     for (unsigned int c = 0; c < mat->columns; c++) {
-      // usually it would be (columns * r) + c
-      unsigned int transpose_index = (columns * c) + r;
-      matAns->matrix_data[transpose_index] = get_element(mat, r, c);
+      set_element(matAns, c, r, get_element(mat, r, c));
+    }
+  }
+  PROFILE_END(start, "transpose", -1, 0,
+    PROFILE_BYTES(2.0 * rows * columns));
+}
+
+static void outer_product_rows(
+  void* context, unsigned int begin, unsigned int end
+) {
+  MultiplyTask* task = (MultiplyTask*)context;
+  for (unsigned int i = begin; i < end; i++) {
+    real* row = task->c + i * task->c_stride;
+    real value = task->a[i * task->a_row_step];
+    for (unsigned int j = 0; j < task->columns; j++) {
+      row[j] = value * task->b[j * task->b_stride];
     }
   }
 }
@@ -184,19 +895,28 @@ void outer_product(Matrix* mat1, Matrix* mat2, Matrix* matAns) {
     );
     exit(1);
   } else {
-    unsigned int mat1_size = mat1->rows;
-    unsigned int mat2_size = mat2->rows;
-    matAns->rows = mat1_size;
-    matAns->columns = mat2_size;
-    // unsigned int matrix_size = matAns->rows * matAns->columns;
-    for (unsigned int i = 0; i < mat1_size; i++) {
-      for (unsigned int j = 0; j < mat2_size; j++) {
-        unsigned int index = (matAns->columns * i) + j;
-        matAns->matrix_data[index] = (
-          mat1->matrix_data[i] * mat2->matrix_data[j]
-        );
+    PROFILE_START(start);
+    matAns->rows = mat1->rows;
+    matAns->columns = mat2->rows;
+    if (!rows_contiguous(matAns)) {
+      for (unsigned int i = 0; i < matAns->rows; i++) {
+        for (unsigned int j = 0; j < matAns->columns; j++) {
+          set_element(
+            matAns, i, j, get_element(mat1, i, 0) * get_element(mat2, j, 0)
+          );
+        }
       }
+    } else {
+      MultiplyTask task = multiply_task(mat1, mat2, matAns);
+      parallel_for(
+        matAns->rows, parallel_grain(matAns->columns), outer_product_rows,
+        &task
+      );
     }
+    PROFILE_END(start, "outer_product", -1,
+      (double)matAns->rows * matAns->columns,
+      PROFILE_BYTES((double)matAns->rows * matAns->columns + matAns->rows
+      + matAns->columns));
   }
 }
 
@@ -208,18 +928,139 @@ void add(Matrix* mat1, Matrix* mat2, Matrix* matAns) {
     );
     exit(1);
   } else {
+    PROFILE_START(start);
     matAns->rows = mat1->rows;
     matAns->columns = mat1->columns;
-    unsigned int matrix_size = mat1->rows * mat1->columns;
-    // free(matAns->matrix_data);
-    // double* matAns_data = (double*)malloc(sizeof(double) * matrix_size);
-    for (unsigned int i = 0; i < matrix_size; i++) {
-      matAns->matrix_data[i] = mat1->matrix_data[i] + mat2->matrix_data[i];
+    elementwise(mat1, mat2, matAns, vector_add);
+    PROFILE_END(start, "add", -1, (double)mat1->rows * mat1->columns,
+      PROFILE_BYTES(3.0 * mat1->rows * mat1->columns));
+  }
+}
+
+typedef struct ScaleTask {
+  real scale;
+  const real* a;
+  real* out;
+  size_t size;
+} ScaleTask;
+
+// elements per chunk of a parallel elementwise operation
+#define ELEMENT_CHUNK 4096
+
+static void add_scaled_chunks(
+  void* context, unsigned int begin, unsigned int end
+) {
+  ScaleTask* task = (ScaleTask*)context;
+  size_t first = (size_t)begin * ELEMENT_CHUNK;
+  size_t last = (size_t)end * ELEMENT_CHUNK;
+  if (last > task->size) last = task->size;
+  vector_axpy(task->scale, task->a + first, task->out + first, last - first);
+}
+
+void add_scaled(Matrix* mat, Matrix* matAns, double scale) {
+  // matAns += scale * mat
+  if (mat->rows != matAns->rows || mat->columns != matAns->columns) {
+    printf("Error: Scaled addition: "
+    "matrices not the same size: %d x %d, %d x %d\n",
+    mat->rows, mat->columns, matAns->rows, matAns->columns
+    );
+    exit(1);
+  } else if (mat->transposed != matAns->transposed) {
+    for (unsigned int r = 0; r < mat->rows; r++) {
+      for (unsigned int c = 0; c < mat->columns; c++) {
+        vector_axpy(
+          scale, element_address(mat, r, c), element_address(matAns, r, c), 1
+        );
+      }
+    }
+  } else if (is_dense(mat) && is_dense(matAns)) {
+    add_scaled_data(
+      mat->matrix_data, matAns->matrix_data,
+      (size_t)mat->rows * mat->columns, scale
+    );
+  } else {
+    for (unsigned int r = 0; r < stored_rows(mat); r++) {
+      vector_axpy(
+        scale, mat->matrix_data + (size_t)r * mat->stride,
+        matAns->matrix_data + (size_t)r * matAns->stride, stored_columns(mat)
+      );
     }
-    // matAns->matrix_data = matAns_data;
   }
 }
 
+void add_scaled_data(const real* data, real* dataAns, size_t n, double scale) {
+  // dataAns += scale * data over n elements, split between threads
+  PROFILE_START(start);
+  ScaleTask task = {scale, data, dataAns, n};
+  unsigned int chunks = (n + ELEMENT_CHUNK - 1) / ELEMENT_CHUNK;
+  parallel_for(
+    chunks, parallel_grain(ELEMENT_CHUNK), add_scaled_chunks, &task
+  );
+  PROFILE_END(start, "add_scaled_data", -1, 2.0 * n, PROFILE_BYTES(3.0 * n));
+}
+
+void add_column(Matrix* mat, Matrix* vec, Matrix* matAns) {
+  // adds the column vector vec to every column of mat
+  if (mat->rows != vec->rows || vec->columns != 1
+    || matAns->rows != mat->rows || matAns->columns != mat->columns) {
+    printf("Error: Column addition: "
+    "matrices not the right size: %d x %d, %d x %d, MatAns: %d x %d\n",
+    mat->rows, mat->columns, vec->rows, vec->columns,
+    matAns->rows, matAns->columns
+    );
+    exit(1);
+  } else if (rows_contiguous(mat) && rows_contiguous(matAns)) {
+    for (unsigned int r = 0; r < mat->rows; r++) {
+      const real* in = get_row_data(mat, r);
+      real* out = get_row_data(matAns, r);
+      real value = get_element(vec, r, 0);
+      for (unsigned int c = 0; c < mat->columns; c++) {
+        out[c] = in[c] + value;
+      }
+    }
+  } else {
+    for (unsigned int r = 0; r < mat->rows; r++) {
+      for (unsigned int c = 0; c < mat->columns; c++) {
+        set_element(
+          matAns, r, c, get_element(mat, r, c) + get_element(vec, r, 0)
+        );
+      }
+    }
+  }
+}
+
+void sum_rows(Matrix* mat, Matrix* matAns) {
+  // sums each row of mat into the column vector matAns
+  if (matAns->rows != mat->rows || matAns->columns != 1) {
+    printf("Error: Row sums: "
+    "matrices not the right size: %d x %d, MatAns: %d x %d\n",
+    mat->rows, mat->columns, matAns->rows, matAns->columns
+    );
+    exit(1);
+  } else {
+    PROFILE_START(start);
+    for (unsigned int r = 0; r < mat->rows; r++) {
+      accum total = 0;
+      if (rows_contiguous(mat)) {
+        total = vector_sum(get_row_data(mat, r), mat->columns);
+      } else {
+        for (unsigned int c = 0; c < mat->columns; c++) {
+          total += get_element(mat, r, c);
+        }
+      }
+      set_element(matAns, r, 0, total);
+    }
+    PROFILE_END(start, "sum_rows", -1, (double)mat->rows * mat->columns,
+      PROFILE_BYTES((double)mat->rows * mat->columns + mat->rows));
+  }
+}
+
+static void copy_kernel(const real* a, const real* b, real* out, size_t n) {
+  // vector_copy in the shape elementwise() expects, b is ignored
+  (void)b;
+  vector_copy(a, out, n);
+}
+
 void copy_matrix(Matrix* mat, Matrix* matAns) {
   if (mat->rows != matAns->rows || mat->columns != matAns->columns) {
     printf("Error: Matrix copy: "
@@ -228,12 +1069,9 @@ void copy_matrix(Matrix* mat, Matrix* matAns) {
     );
     exit(1);
   } else {
-    unsigned int matrix_size = mat->rows * mat->columns;
-    // free(matAns->matrix_data);
-    // double* matAns_data = (double*)malloc(sizeof(double) * matrix_size);
-    for (unsigned int i = 0; i < matrix_size; i++) {
-      matAns->matrix_data[i] = mat->matrix_data[i];
-    }
-    // matAns->matrix_data = matAns_data;
+    PROFILE_START(start);
+    elementwise(mat, mat, matAns, copy_kernel);
+    PROFILE_END(start, "copy_matrix", -1, 0,
+      PROFILE_BYTES(2.0 * mat->rows * mat->columns));
   }
 }
\ No newline at end of file
@@ -1,12 +1,22 @@
 #ifndef MATRICES_H
 #define MATRICES_H
 
+#include <stddef.h>
+#include "precision.h"
+
 // implement matrix structure
 
+// element (r, c) is stored at matrix_data[r * stride + c], or at
+// matrix_data[c * stride + r] when transposed is set; views share the data
+// of another matrix or buffer and never free it
+
 typedef struct Matrix {
   unsigned int rows;
   unsigned int columns;
-  double* matrix_data;
+  real* matrix_data;
+  unsigned int owns_data;
+  unsigned int stride;
+  unsigned int transposed;
 } Matrix;
 
 double drand();
@@ -15,11 +25,48 @@ double random_normal();
 
 // implement matrix calculations
 
+// byte boundary the data of create_aligned_data() starts on, and that
+// every row of a matrix from create_empty_matrix() starts on
+#define MATRIX_ALIGNMENT 64
+
 Matrix* create_empty_matrix(unsigned int rows, unsigned int columns);
 
+real* create_aligned_data(size_t count);
+
+unsigned int padded_stride(unsigned int columns);
+
+Matrix* create_matrix_view(
+  real* data, unsigned int rows, unsigned int columns
+);
+
+Matrix* create_strided_view(
+  real* data, unsigned int rows, unsigned int columns, unsigned int stride
+);
+
+Matrix* get_block(
+  Matrix* mat, unsigned int row, unsigned int column, unsigned int rows,
+  unsigned int columns
+);
+
+Matrix* transposed_view(Matrix* mat);
+
+unsigned int is_dense(Matrix* mat);
+
 void free_matrix(Matrix* matrix);
 
-double get_element(Matrix* mat, unsigned int row, unsigned int column);
+// allocations by every thread so far
+unsigned long allocation_count();
+
+// allocations by the calling thread so far
+unsigned long thread_allocation_count();
+
+real get_element(Matrix* mat, unsigned int row, unsigned int column);
+
+void set_element(
+  Matrix* mat, unsigned int row, unsigned int column, real value
+);
+
+real* get_row_data(Matrix* mat, unsigned int row);
 
 Matrix* get_column(Matrix* mat, unsigned int column);
 
@@ -27,6 +74,8 @@ Matrix* get_row(Matrix* mat, unsigned int row);
 
 double sum(Matrix* mat);
 
+double abs_sum(Matrix* mat);
+
 void hadamard_product(Matrix* mat1, Matrix* mat2, Matrix* matAns);
 
 double dot_product(Matrix* mat1, Matrix* mat2);
@@ -35,12 +84,36 @@ void print_matrix(Matrix* mat);
 
 Matrix* multiply(Matrix* mat1, Matrix* mat2);
 
+unsigned int parallel_grain(size_t work_per_item);
+
+void gemv(Matrix* mat, Matrix* vec, Matrix* matAns);
+
+void gemm(Matrix* mat1, Matrix* mat2, Matrix* matAns);
+
+void gemm_bias_atan(
+  Matrix* mat1, Matrix* mat2, Matrix* bias, Matrix* preactivation,
+  Matrix* matAns
+);
+
+void transposed_multiply_update(
+  Matrix* weights, Matrix* delta, Matrix* input, Matrix* gradient,
+  double scale, Matrix* next_delta
+);
+
 void transpose(Matrix* mat, Matrix* matAns);
 
 void outer_product(Matrix* mat1, Matrix* mat2, Matrix* matAns);
 
 void add(Matrix* mat1, Matrix* mat2, Matrix* matAns);
 
+void add_scaled(Matrix* mat, Matrix* matAns, double scale);
+
+void add_scaled_data(const real* data, real* dataAns, size_t n, double scale);
+
+void add_column(Matrix* mat, Matrix* vec, Matrix* matAns);
+
+void sum_rows(Matrix* mat, Matrix* matAns);
+
 void copy_matrix(Matrix* mat, Matrix* matAns);
 
 #endif
\ No newline at end of file
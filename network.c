@@ -4,285 +4,532 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// samples per shard of a batched weight gradient, fixed so the summation
+// order does not depend on the number of threads
+#define GRADIENT_SHARD_SAMPLES 64
 
 // commment out if not to print verbose
 // #define PRINT_VERBOSE 1
 #include "network.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include "profile.h"
+#include "random.h"
 
 // implement neural network calculations
 
-void initialise_network(
-  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+static void setup_matrix(
+  Matrix** matrix, unsigned int rows, unsigned int columns,
   unsigned int clearNetwork
 ) {
-  network->num_layers = num_layers;
-  network->num_nodes = num_nodes;
-  // create network input
+  // create the matrix, or free it if the network is being cleared
   if (clearNetwork) {
-    free_matrix(network->input);
+    free_matrix(*matrix);
   } else {
-    network->input = create_empty_matrix(network->num_nodes[0], 1);
+    *matrix = create_empty_matrix(rows, columns);
   }
-  // create network output
+}
+
+static void setup_view(
+  Matrix** matrix, unsigned int rows, unsigned int columns,
+  unsigned int clearNetwork
+) {
+  // a view padded like create_empty_matrix(), pointed at its memory later
   if (clearNetwork) {
-    free_matrix(network->output);
+    free_matrix(*matrix);
   } else {
-    network->output = create_empty_matrix(
-      network->num_nodes[network->num_layers-1], 1
+    *matrix = create_strided_view(NULL, rows, columns, padded_stride(columns));
+  }
+}
+
+static size_t aligned_elements(size_t count) {
+  // count rounded up to whole MATRIX_ALIGNMENT blocks
+  size_t per_block = MATRIX_ALIGNMENT / sizeof(real);
+  return (count + per_block - 1) / per_block * per_block;
+}
+
+static unsigned int keeps_output(Network* network, unsigned int l) {
+  // with checkpoints only every interval-th layer's output, and the
+  // network output, outlives the forward pass
+  unsigned int interval = network->checkpoint_interval;
+  return interval <= 1 || l % interval == interval - 1
+    || l == network->num_layers - 1;
+}
+
+static size_t layout_activations(Network* network, real* base) {
+  // with a NULL base this only measures the activations, otherwise it
+  // points every layer's output into base: kept outputs get memory of
+  // their own, the others share interval - 1 buffers of the widest layer
+  // by position within their checkpoint interval
+  unsigned int stride = padded_stride(network->batch_size);
+  unsigned int widest = 0;
+  for (unsigned int l = 0; l < network->num_layers; l++) {
+    if (network->layers[l].output->rows > widest) {
+      widest = network->layers[l].output->rows;
+    }
+  }
+  size_t shared = aligned_elements((size_t)widest * stride);
+  size_t used = 0;
+  if (network->checkpoint_interval > 1) {
+    used = shared * (network->checkpoint_interval - 1);
+  }
+  for (unsigned int l = 0; l < network->num_layers; l++) {
+    Matrix* output = network->layers[l].output;
+    real* data = NULL;
+    if (keeps_output(network, l)) {
+      data = base + used;
+      used += aligned_elements((size_t)output->rows * stride);
+    } else {
+      data = base + shared * (l % network->checkpoint_interval);
+    }
+    if (base) {
+      output->matrix_data = data;
+      network->layers[l].input->matrix_data = l
+        ? network->layers[l-1].output->matrix_data
+        : network->input->matrix_data;
+    }
+  }
+  if (base) {
+    network->output->matrix_data = (
+      network->layers[network->num_layers-1].output->matrix_data
     );
   }
-  // create network target output
-  if (clearNetwork) {
-    free_matrix(network->target_output);
-  } else {
-    network->target_output = create_empty_matrix(
-      network->num_nodes[network->num_layers-1], 1
+  return used;
+}
+
+static void setup_activations(Network* network) {
+  network->activation_memory = create_empty_matrix(
+    layout_activations(network, NULL), 1
+  );
+  layout_activations(network, network->activation_memory->matrix_data);
+}
+
+static Matrix* take_workspace(
+  real* base, size_t* used, unsigned int rows, unsigned int columns
+) {
+  // carve the next rows x columns view out of the workspace, with rows
+  // padded like create_empty_matrix() so every view starts on a block
+  unsigned int stride = padded_stride(columns);
+  Matrix* view = NULL;
+  if (base) {
+    view = create_strided_view(base + *used, rows, columns, stride);
+  }
+  *used += aligned_elements((size_t)rows * stride);
+  return view;
+}
+
+static unsigned int num_gradient_shards(unsigned int batch_size) {
+  return (batch_size + GRADIENT_SHARD_SAMPLES - 1) / GRADIENT_SHARD_SAMPLES;
+}
+
+static size_t layout_workspace(Network* network, real* base) {
+  // with a NULL base this only measures the workspace, otherwise it
+  // creates every layer's temporaries as views into base
+  size_t used = 0;
+  unsigned int batch_size = network->batch_size;
+  unsigned int largest_weights = 0;
+  for (unsigned int l = 0; l < network->num_layers; l++) {
+    Layer* layer = &network->layers[l];
+    unsigned int input_rows = layer->input->rows;
+    unsigned int output_rows = layer->output->rows;
+    layer->delta = take_workspace(base, &used, output_rows, batch_size);
+    if (layer->layer_type == LAYER_HIDDEN) {
+      layer->activation_gradient = take_workspace(
+        base, &used, input_rows, batch_size
+      );
+      if (output_rows * input_rows > largest_weights) {
+        largest_weights = output_rows * input_rows;
+      }
+    }
+  }
+  // per-shard partial weight gradients, shared by every layer since the
+  // layers are backpropagated one at a time
+  unsigned int num_shards = num_gradient_shards(batch_size);
+  network->gradient_shards = NULL;
+  if (num_shards > 1) {
+    network->gradient_shards = take_workspace(
+      base, &used, num_shards, largest_weights
     );
   }
-  // create network cost
+  return used;
+}
+
+static void free_workspace(Network* network) {
+  for (unsigned int l = 0; l < network->num_layers; l++) {
+    Layer* layer = &network->layers[l];
+    free_matrix(layer->delta);
+    if (layer->layer_type == LAYER_HIDDEN) {
+      free_matrix(layer->activation_gradient);
+    }
+  }
+  if (network->gradient_shards) {
+    free_matrix(network->gradient_shards);
+  }
+  free_matrix(network->workspace);
+}
+
+static void place_parameters(
+  Network* network, real* base, unsigned int gradients
+) {
+  // point every layer's weights and biases, or their gradients, at their
+  // blocks of the slab starting at base
+  real* weights = base;
+  real* biases = base + network->num_weight_parameters;
+  for (unsigned int l = 0; l < network->num_layers; l++) {
+    Layer* layer = &network->layers[l];
+    Matrix* weight_block = gradients ? layer->weight_delta : layer->weights;
+    Matrix* bias_block = gradients ? layer->bias_delta : layer->biases;
+    if (weight_block) {
+      weight_block->matrix_data = weights;
+      weights += aligned_elements(
+        (size_t)weight_block->rows * weight_block->stride
+      );
+    }
+    bias_block->matrix_data = biases;
+    biases += aligned_elements(bias_block->rows);
+  }
+}
+
+static void setup_parameters(
+  Network* network, unsigned int training, unsigned int own_parameters,
+  unsigned int clearNetwork
+) {
+  // weights and biases are views into one slab, and their gradients into
+  // a second slab laid out the same way; without own_parameters only the
+  // views are made and the slab is given later
   if (clearNetwork) {
-    free_matrix(network->cost);
-  } else {
-    network->cost = create_empty_matrix(
-      network->output->rows, 1
+    for (unsigned int l = 0; l < network->num_layers; l++) {
+      Layer* layer = &network->layers[l];
+      if (layer->weights) {
+        free_matrix(layer->weights);
+      }
+      free_matrix(layer->biases);
+      if (training) {
+        if (layer->weight_delta) {
+          free_matrix(layer->weight_delta);
+        }
+        free_matrix(layer->bias_delta);
+      }
+    }
+    // a mapped slab goes with its mapping, a shared one with its network
+    if (!network->mapping && !network->shared_parameters) {
+      free(network->parameters);
+    }
+    free(network->gradients);
+    return;
+  }
+  size_t weights_size = 0;
+  size_t biases_size = 0;
+  for (unsigned int l = 0; l < network->num_layers; l++) {
+    Layer* layer = &network->layers[l];
+    unsigned int input_rows = network->num_nodes[l];
+    unsigned int output_rows = input_rows;
+    layer->weights = NULL;
+    layer->weight_delta = NULL;
+    layer->bias_delta = NULL;
+    if (layer->layer_type != LAYER_OUTPUT) {
+      // input and hidden layers feed the next layer's nodes
+      // every row of the weights starts on a block of its own
+      output_rows = network->num_nodes[l+1];
+      unsigned int stride = padded_stride(input_rows);
+      layer->weights = create_strided_view(
+        NULL, output_rows, input_rows, stride
+      );
+      if (training) {
+        layer->weight_delta = create_strided_view(
+          NULL, output_rows, input_rows, stride
+        );
+      }
+      weights_size += aligned_elements((size_t)output_rows * stride);
+    }
+    layer->biases = create_matrix_view(NULL, output_rows, 1);
+    if (training) {
+      layer->bias_delta = create_matrix_view(NULL, output_rows, 1);
+    }
+    biases_size += aligned_elements(output_rows);
+  }
+  network->num_weight_parameters = weights_size;
+  network->num_parameters = weights_size + biases_size;
+  network->parameters = NULL;
+  if (own_parameters) {
+    network->parameters = create_aligned_data(network->num_parameters);
+    place_parameters(network, network->parameters, 0);
+  }
+  network->gradients = NULL;
+  if (training) {
+    network->gradients = create_aligned_data(network->num_parameters);
+    place_parameters(network, network->gradients, 1);
+  }
+}
+
+static void setup_network(
+  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+  unsigned int batch_size, unsigned int training,
+  unsigned int own_parameters, unsigned int clearNetwork
+) {
+  // parameters and the prediction buffers always exist, the activations,
+  // targets, cost and backpropagation workspace only when training
+  network->num_layers = num_layers;
+  network->num_nodes = num_nodes;
+  network->batch_size = batch_size;
+  network->inference_only = !training;
+  unsigned int output_nodes = network->num_nodes[network->num_layers-1];
+  if (training) {
+    // activations hold one column per sample in the batch
+    setup_matrix(
+      &network->input, network->num_nodes[0], batch_size, clearNetwork
+    );
+    // the output is the output layer's activations
+    setup_view(
+      &network->output, output_nodes, batch_size, clearNetwork
+    );
+    setup_matrix(
+      &network->target_output, output_nodes, batch_size, clearNetwork
     );
+    setup_matrix(&network->cost, output_nodes, batch_size, clearNetwork);
+  } else {
+    network->input = NULL;
+    network->output = NULL;
+    network->target_output = NULL;
+    network->cost = NULL;
   }
+  // two buffers predict() alternates between, each fits the widest layer
+  unsigned int widest = 0;
+  for (unsigned int l = 0; l < network->num_layers; l++) {
+    if (network->num_nodes[l] > widest) {
+      widest = network->num_nodes[l];
+    }
+  }
+  setup_matrix(&network->activations[0], widest, 1, clearNetwork);
+  setup_matrix(&network->activations[1], widest, 1, clearNetwork);
   if (!clearNetwork) {
     // allocate memory to layers
-    network->layers = (Layer*)malloc(sizeof(Layer) * network->num_layers);
+    network->layers = (Layer*)calloc(network->num_layers, sizeof(Layer));
   }
   for (unsigned int l = 0; l < network->num_layers; l++) {
-    // create network input
-    if (clearNetwork) {
-      free_matrix(network->layers[l].input);
-    } else {
-      network->layers[l].input = create_empty_matrix(
-        network->num_nodes[l], 1
-      );
-    }
+    Layer* layer = &network->layers[l];
     // set layer type
     if (l == network->num_layers - 1) {
       // if output layer
-      (network->layers[l]).layer_type = LAYER_OUTPUT;
+      layer->layer_type = LAYER_OUTPUT;
     } else if (l == 0) {
       // if input layer
-      (network->layers[l]).layer_type = LAYER_INPUT;
+      layer->layer_type = LAYER_INPUT;
     } else {
       // if hidden layer
-      (network->layers[l]).layer_type = LAYER_HIDDEN;
+      layer->layer_type = LAYER_HIDDEN;
     }
-    // output layer
-    if ((network->layers[l]).layer_type != LAYER_OUTPUT) {
-      // create layer output
-      if (clearNetwork) {
-        free_matrix(network->layers[l].output);
-      } else {
-        network->layers[l].output = create_empty_matrix(
-          network->num_nodes[l+1], 1
-        );
-      }
-      // create multiplied matrix
-      if (clearNetwork) {
-        free_matrix(network->layers[l].multiplied);
-      } else {
-        network->layers[l].multiplied = create_empty_matrix(
-          network->layers[l].output->rows, 1
-        );
-      }
-    } else {
-      // create layer output
-      if (clearNetwork) {
-        free_matrix(network->layers[l].output);
-      } else {
-        network->layers[l].output = create_empty_matrix(
-          network->layers[l].input->rows, 1
-        );
-      }
-      // create layer multiplied matrix
-      if (clearNetwork) {
-        free_matrix(network->layers[l].multiplied);
-      } else {
-        network->layers[l].multiplied = create_empty_matrix(
-          network->layers[l].output->rows, 1
-        );
-      }
-    }
-    if ((network->layers[l]).layer_type != LAYER_OUTPUT) {
-      // if input or hidden layer
-      // create layer weights
-      if (clearNetwork) {
-        free_matrix(network->layers[l].weights);
-      } else {
-        network->layers[l].weights = create_empty_matrix(
-          network->layers[l].output->rows,
-          network->layers[l].input->rows
-        );
-      }
+    unsigned int input_rows = network->num_nodes[l];
+    unsigned int output_rows = input_rows;
+    if (layer->layer_type != LAYER_OUTPUT) {
+      output_rows = network->num_nodes[l+1];
     }
-    // create layer biases
-    if (clearNetwork) {
-      free_matrix(network->layers[l].biases);
-    } else {
-      network->layers[l].biases = create_empty_matrix(
-        network->layers[l].output->rows, 1
-      );
+    if (training) {
+      // a layer's input is the previous layer's output, or the network
+      // input, so only the outputs are stored
+      setup_view(&layer->input, input_rows, batch_size, clearNetwork);
+      setup_view(&layer->output, output_rows, batch_size, clearNetwork);
     }
   }
+  if (!training) {
+    network->activation_memory = NULL;
+  } else if (clearNetwork) {
+    free_matrix(network->activation_memory);
+  } else {
+    network->checkpoint_interval = 0;
+    setup_activations(network);
+  }
+  setup_parameters(network, training, own_parameters, clearNetwork);
+  // size the backpropagation workspace once so training never allocates
+  if (!training) {
+    network->workspace = NULL;
+    network->gradient_shards = NULL;
+  } else if (clearNetwork) {
+    free_workspace(network);
+  } else {
+    network->workspace = create_empty_matrix(
+      layout_workspace(network, NULL), 1
+    );
+    layout_workspace(network, network->workspace->matrix_data);
+  }
   // clear the network layers
   if (clearNetwork) {
     free(network->layers);
+    if (network->mapping) {
+      munmap(network->mapping, network->mapping_size);
+    }
   }
+  network->mapping = NULL;
+  network->mapping_size = 0;
+  network->shared_parameters = 0;
+  network->gradient_ready = NULL;
+  network->gradient_ready_context = NULL;
 }
 
-void randomise_network(Network* net) {
-  for (unsigned int l = 0; l < net->num_layers; l++) {
-    if ((net->layers[l]).layer_type != LAYER_OUTPUT) {
-      // if input or hidden layer
-      unsigned int weights_size = (net->layers[l]).weights->rows;
-      weights_size *= (net->layers[l]).weights->columns;
-      // randomise layer weights
-      for (unsigned int i = 0; i < weights_size; i++) {
-        (net->layers[l]).weights->matrix_data[i] = random_normal();
-      }
-    }
-    // randomise layer biases
-    for (unsigned int j = 0; j < (net->layers[l]).biases->rows; j++) {
-      (net->layers[l]).biases->matrix_data[j] = random_normal();
-    }
+void initialise_network(
+  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+  unsigned int clearNetwork
+) {
+  initialise_batch_network(network, num_layers, num_nodes, 1, clearNetwork);
+}
+
+void initialise_batch_network(
+  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+  unsigned int batch_size, unsigned int clearNetwork
+) {
+  // clearing releases whatever the network was created with
+  unsigned int training = 1;
+  if (clearNetwork) {
+    training = !network->inference_only;
   }
+  setup_network(
+    network, num_layers, num_nodes, batch_size, training, 1, clearNetwork
+  );
 }
 
-double activate_hidden(double n) {
-  // activation function of hidden layer
-  // return (1 / ( 1 + (float)exp(-1*(double)n) ));
-  return (double)atan(n);
+void initialise_inference_network(
+  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+  unsigned int clearNetwork
+) {
+  // only what predict() needs: weights, biases and two activation buffers
+  if (clearNetwork && !network->inference_only) {
+    initialise_batch_network(
+      network, num_layers, num_nodes, network->batch_size, 1
+    );
+  } else {
+    setup_network(network, num_layers, num_nodes, 0, 0, 1, clearNetwork);
+  }
 }
 
-double activate_hidden_derivative(double n) {
-  // derivative of activation function of hidden layer
-  // return activate_hidden(n) * (1.0 - activate_hidden(n));
-  return (double)(1 / ((n*n) - 1));
+void initialise_network_without_parameters(
+  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+  unsigned int batch_size, unsigned int clearNetwork
+) {
+  if (clearNetwork) {
+    initialise_inference_network(network, num_layers, num_nodes, 1);
+  } else {
+    setup_network(
+      network, num_layers, num_nodes, batch_size, batch_size != 0, 0, 0
+    );
+  }
+}
+
+void randomise_network(Network* net) {
+  // the seed comes from rand(), so srand() still decides the network
+  unsigned long long seed = (unsigned long long)rand() << 32;
+  randomise_network_seeded(net, seed ^ (unsigned long long)rand());
 }
 
-double activate_output(double n) {
-  // activation function of output layer
-  return ((double)atan(n));
+void randomise_network_seeded(Network* net, unsigned long long seed) {
+  // every layer's weights then its biases take the next positions of the
+  // seed's stream of normals
+  unsigned long long offset = 0;
+  for (unsigned int l = 0; l < net->num_layers; l++) {
+    Layer* layer = &net->layers[l];
+    if (layer->layer_type != LAYER_OUTPUT) {
+      // if input or hidden layer
+      random_normal_matrix(layer->weights, seed, offset);
+      offset += (unsigned long long)layer->weights->rows
+        * layer->weights->columns;
+    }
+    random_normal_matrix(layer->biases, seed, offset);
+    offset += layer->biases->rows;
+  }
 }
 
-double activate_output_derivative(double n) {
-  // derivative of activation function of output layer
+double activation_derivative(double n) {
+  // the activation is atan, defined once by vector_atan() in kernels.c,
+  // which every forward pass, the generated passes and quantized inference
+  // call; backpropagation only keeps the activations, so this takes the
+  // output n of a layer
   return (double)(1 / ((n*n) - 1));
 }
 
 void cost(Matrix* output, Matrix* target_output, Matrix* cost_matrix) {
   // Euclidean distance from output to target output, squared
-  unsigned int output_size = output->columns * output->rows;
-  unsigned int targ_output_size = target_output->columns * target_output->rows;
-  if (output_size != targ_output_size) {
+  if (output->rows != target_output->rows
+    || output->columns != target_output->columns) {
     printf("Error: Cost: matrices not the same size: %d x %d, %d x %d\n",
     output->rows, output->columns, target_output->rows, target_output->columns);
     exit(1);
+  } else if (cost_matrix->rows != output->rows
+    || cost_matrix->columns != output->columns) {
+    printf("Error: Cost: cost matrix not the right size: %d x %d\n",
+    cost_matrix->rows, cost_matrix->columns);
+    exit(1);
   } else {
-    free(cost_matrix->matrix_data);
-    double* cost_matrix_data = (double*)malloc(sizeof(double) * output_size);
-    for (unsigned int i = 0; i < output_size; i++) {
-      // cost_matrix_data[i] = pow(
-      //   target_output->matrix_data[i] - output->matrix_data[i],
-      //   2.0);
-      // return absolute value
-      cost_matrix_data[i] = fabs(
-        target_output->matrix_data[i]
-        - output->matrix_data[i]
-      );
+    for (unsigned int r = 0; r < output->rows; r++) {
+      for (unsigned int c = 0; c < output->columns; c++) {
+        // set_element(cost_matrix, r, c, pow(
+        //   get_element(target_output, r, c) - get_element(output, r, c),
+        //   2.0));
+        // return absolute value
+        set_element(cost_matrix, r, c, fabs(
+          get_element(target_output, r, c)
+          - get_element(output, r, c)
+        ));
+      }
     }
-    cost_matrix->matrix_data = cost_matrix_data;
   }
 }
 
 double total_cost(Matrix* cost) {
-  unsigned int matrix_size = cost->rows;
-  double total_cost = 0;
-  for (unsigned int i = 0; i < matrix_size; i++) {
-    total_cost += fabs(cost->matrix_data[i]);
-  }
-  return total_cost;
+  // summed over every output node of every sample in the batch
+  return abs_sum(cost);
 }
 
-void forward_pass(Network* net, double* input, double* target_output) {
-  #ifdef PRINT_VERBOSE
-  printf("=================================\n");
-  printf("Network:\n");
-  printf("Network input:\n");
-  #endif
-  for (unsigned int i = 0; i < net->input->rows; i++) {
-    net->input->matrix_data[i] = input[i];
-  }
-  for (unsigned int i = 0; i < net->target_output->rows; i++) {
-    net->target_output->matrix_data[i] = target_output[i];
-  }
+static void forward_layers(
+  Network* net, unsigned int first, unsigned int end
+) {
+  // runs layers [first, end) of the batch already in net->input and
+  // net->target_output, the cost once the output layer has run
   #ifdef PRINT_VERBOSE
   print_matrix(net->input);
   #endif
-  for (unsigned int l = 0; l < net->num_layers; l++) {
+  for (unsigned int l = first; l < end; l++) {
     #ifdef PRINT_VERBOSE
     printf("=== Layer %d ===\n", l);
     #endif
     Layer* cur_layer = &net->layers[l];
-    // set layer inputs
-    // free(cur_layer->input);
-    if (cur_layer->layer_type == LAYER_INPUT) {
-      copy_matrix(net->input, cur_layer->input);
-      // cur_layer->input = net->input;
-    } else {
-      copy_matrix(net->layers[l-1].output, cur_layer->input);
-      // cur_layer->input = net->layers[l-1].output;
-    }
+    PROFILE_START(start);
     #ifdef PRINT_VERBOSE
     printf("Layer input:\n");
     print_matrix(cur_layer->input);
     #endif
     // forward pass layer
+    // multiply, add biases and activate in one sweep; backpropagation only
+    // needs the activations, so the pre-activation is not kept, and the
+    // output layer's activations are the network output
     if (cur_layer->layer_type != LAYER_OUTPUT) {
       // is input or hidden layer
-      Matrix* multiplied;
-      multiplied = multiply(cur_layer->weights, cur_layer->input);
-      #ifdef PRINT_VERBOSE
-      printf("Multiplied:\n");
-      print_matrix(multiplied);
-      #endif
-      copy_matrix(multiplied, cur_layer->multiplied);
-      add(multiplied, cur_layer->biases, multiplied);
-      #ifdef PRINT_VERBOSE
-      printf("Multiplied + biases:\n");
-      print_matrix(multiplied);
-      #endif
-      // activate output
-      unsigned int matrix_size = multiplied->rows * multiplied->columns;
-      for (unsigned int i = 0; i < matrix_size; i++) {
-        multiplied->matrix_data[i] = activate_hidden(
-          multiplied->matrix_data[i]);
-      }
-      // set output
-      free_matrix(cur_layer->output);
-      cur_layer->output = multiplied;
+      gemm_bias_atan(
+        cur_layer->weights, cur_layer->input, cur_layer->biases, NULL,
+        cur_layer->output
+      );
     } else {
       // is output layer
-      // free_matrix(cur_layer->output);
-      add(cur_layer->input, cur_layer->biases, cur_layer->multiplied);
-      // activate output
-      Matrix* multiplied = cur_layer->multiplied;
-      unsigned int matrix_size = multiplied->rows * multiplied->columns;
-      for (unsigned int i = 0; i < matrix_size; i++) {
-        cur_layer->output->matrix_data[i] = activate_hidden(
-          multiplied->matrix_data[i]);
-      }
-      // free_matrix(net->output);
-      copy_matrix(cur_layer->output, net->output);
+      gemm_bias_atan(
+        NULL, cur_layer->input, cur_layer->biases, NULL, cur_layer->output
+      );
     }
     #ifdef PRINT_VERBOSE
     printf("Layer output:\n");
     print_matrix(cur_layer->output);
     #endif
+    // the product and bias, reading the input and writing the output
+    PROFILE_END(start, "forward", l,
+      (2.0 * (cur_layer->weights ? cur_layer->input->rows : 0) + 1)
+      * cur_layer->output->rows * net->batch_size,
+      PROFILE_BYTES((cur_layer->weights
+      ? (double)cur_layer->weights->rows * cur_layer->weights->columns : 0)
+      + ((double)cur_layer->input->rows + cur_layer->output->rows)
+      * net->batch_size));
+  }
+  if (end < net->num_layers) {
+    return;
   }
   cost(net->output, net->target_output, net->cost);
   net->total_cost = total_cost(net->cost);
@@ -297,113 +544,472 @@ void forward_pass(Network* net, double* input, double* target_output) {
   #endif
 }
 
-void backpropagate(
-  Network* net, double bias_learning_rate, double weight_learning_rate
+static void copy_rows(double* data, Matrix* mat) {
+  // data holds the matrix without padding, one row after another
+  for (unsigned int r = 0; r < mat->rows; r++) {
+    real* row = get_row_data(mat, r);
+    for (unsigned int c = 0; c < mat->columns; c++) {
+      row[c] = data[(size_t)r * mat->columns + c];
+    }
+  }
+}
+
+void forward_pass(Network* net, double* input, double* target_output) {
+  // input and target_output hold net->batch_size samples laid out like the
+  // network matrices: one row per node, one column per sample
+  #ifdef PRINT_VERBOSE
+  printf("=================================\n");
+  printf("Network:\n");
+  printf("Network input:\n");
+  #endif
+  copy_rows(input, net->input);
+  copy_rows(target_output, net->target_output);
+  forward_layers(net, 0, net->num_layers);
+}
+
+void forward_pass_batch(
+  Network* net, Matrix* input, Matrix* target_output
+) {
+  if (input->rows != net->input->rows
+    || input->columns != net->input->columns
+    || target_output->rows != net->target_output->rows
+    || target_output->columns != net->target_output->columns) {
+    printf("Error: Forward pass: batch not the network's size: "
+    "%d x %d, %d x %d, expected %d x %d, %d x %d\n",
+    input->rows, input->columns,
+    target_output->rows, target_output->columns,
+    net->input->rows, net->input->columns,
+    net->target_output->rows, net->target_output->columns);
+    exit(1);
+  }
+  copy_matrix(input, net->input);
+  copy_matrix(target_output, net->target_output);
+  forward_layers(net, 0, net->num_layers);
+}
+
+static void predict_layer(Layer* layer, Matrix* input, Matrix* output) {
+  // one layer of inference, input and output are the ping-pong buffers
+  // no gradient follows, so the pre-activation is not kept
+  output->rows = layer->biases->rows;
+  Matrix* weights = (layer->layer_type != LAYER_OUTPUT) ? layer->weights : NULL;
+  gemm_bias_atan(weights, input, layer->biases, NULL, output);
+}
+
+void predict(Network* net, double* input, double* output) {
+  // forward pass for serving: no target, no cost and no per-layer copies,
+  // activations alternate between the network's two buffers
+  Matrix* current = net->activations[0];
+  Matrix* next = net->activations[1];
+  current->rows = net->num_nodes[0];
+  for (unsigned int i = 0; i < current->rows; i++) {
+    current->matrix_data[i] = input[i];
+  }
+  for (unsigned int l = 0; l < net->num_layers; l++) {
+    PROFILE_START(start);
+    predict_layer(&net->layers[l], current, next);
+    PROFILE_END(start, "predict", l,
+      (2.0 * (net->layers[l].layer_type != LAYER_OUTPUT ? current->rows : 0)
+      + 1) * next->rows,
+      PROFILE_BYTES((net->layers[l].layer_type != LAYER_OUTPUT
+      ? (double)current->rows * next->rows : 0)
+      + current->rows + 2.0 * next->rows));
+    Matrix* swap = current;
+    current = next;
+    next = swap;
+  }
+  for (unsigned int i = 0; i < current->rows; i++) {
+    output[i] = current->matrix_data[i];
+  }
+}
+
+void initialise_predict_scratch(
+  PredictScratch* scratch, Network* net, unsigned int batch_size,
+  unsigned int clearScratch
+) {
+  // two buffers of the widest layer by batch_size samples
+  if (clearScratch) {
+    free_matrix(scratch->activations[0]);
+    free_matrix(scratch->activations[1]);
+    return;
+  }
+  unsigned int widest = 0;
+  for (unsigned int l = 0; l < net->num_layers; l++) {
+    if (net->num_nodes[l] > widest) {
+      widest = net->num_nodes[l];
+    }
+  }
+  scratch->batch_size = batch_size;
+  scratch->activations[0] = create_empty_matrix(widest, batch_size);
+  scratch->activations[1] = create_empty_matrix(widest, batch_size);
+}
+
+static void shape_activations(
+  Matrix* activations, unsigned int rows, unsigned int count
 ) {
-  // perform backpropagation
+  // rows x count in the scratch's buffer, padded like any other matrix so
+  // a single sample is a contiguous vector for gemv
+  activations->rows = rows;
+  activations->columns = count;
+  activations->stride = padded_stride(count);
+}
+
+void predict_batch(
+  Network* net, PredictScratch* scratch, double* input, double* output,
+  unsigned int count
+) {
+  if (count > scratch->batch_size) {
+    printf("Error: Predict batch: %d samples for a scratch of %d\n",
+    count, scratch->batch_size);
+    exit(1);
+  }
+  unsigned int inputs = net->num_nodes[0];
+  unsigned int outputs = net->num_nodes[net->num_layers-1];
+  Matrix* current = scratch->activations[0];
+  Matrix* next = scratch->activations[1];
+  shape_activations(current, inputs, count);
+  for (unsigned int r = 0; r < inputs; r++) {
+    real* row = get_row_data(current, r);
+    for (unsigned int s = 0; s < count; s++) {
+      row[s] = input[(size_t)s * inputs + r];
+    }
+  }
+  for (unsigned int l = 0; l < net->num_layers; l++) {
+    PROFILE_START(start);
+    shape_activations(next, net->layers[l].biases->rows, count);
+    predict_layer(&net->layers[l], current, next);
+    PROFILE_END(start, "predict_batch", l,
+      (2.0 * (net->layers[l].layer_type != LAYER_OUTPUT ? current->rows : 0)
+      + 1) * next->rows * count,
+      PROFILE_BYTES((net->layers[l].layer_type != LAYER_OUTPUT
+      ? (double)current->rows * next->rows : 0)
+      + (current->rows + 2.0 * next->rows) * count));
+    Matrix* swap = current;
+    current = next;
+    next = swap;
+  }
+  for (unsigned int r = 0; r < outputs; r++) {
+    real* row = get_row_data(current, r);
+    for (unsigned int s = 0; s < count; s++) {
+      output[(size_t)s * outputs + r] = row[s];
+    }
+  }
+}
+
+static void update_biases(
+  Layer* layer, double bias_learning_rate, unsigned int update
+) {
+  // the bias gradient is the delta summed over the batch
+  sum_rows(layer->delta, layer->bias_delta);
+  if (update) {
+    add_scaled(layer->bias_delta, layer->biases, -bias_learning_rate);
+  }
+}
+
+typedef struct GradientTask {
   Matrix* delta;
-  for (unsigned int l = net->num_layers - 1; l > 0; l--) {
+  Matrix* input;
+  Matrix* weight_delta;
+  real* partials;
+  unsigned int num_shards;
+} GradientTask;
+
+static void gradient_shard_rows(
+  void* context, unsigned int begin, unsigned int end
+) {
+  // each item is one row of one shard's partial gradient:
+  // partial[s][i][j] = sum over the shard's samples b of
+  // delta[i][b] * input[j][b]
+  GradientTask* task = (GradientTask*)context;
+  unsigned int rows = task->weight_delta->rows;
+  unsigned int columns = task->weight_delta->columns;
+  unsigned int batch_size = task->delta->columns;
+  unsigned int input_stride = task->input->stride;
+  for (unsigned int item = begin; item < end; item++) {
+    unsigned int shard = item / rows;
+    unsigned int i = item % rows;
+    unsigned int first = shard * GRADIENT_SHARD_SAMPLES;
+    unsigned int count = batch_size - first;
+    if (count > GRADIENT_SHARD_SAMPLES) count = GRADIENT_SHARD_SAMPLES;
+    real* out = task->partials;
+    if (out) {
+      out += ((size_t)shard * rows + i) * columns;
+    } else {
+      out = get_row_data(task->weight_delta, i);
+    }
+    const real* delta_row = get_row_data(task->delta, i) + first;
+    for (unsigned int j = 0; j < columns; j++) {
+      out[j] = vector_dot(
+        delta_row,
+        task->input->matrix_data + (size_t)j * input_stride + first,
+        count
+      );
+    }
+  }
+}
+
+static void reduce_gradient_rows(
+  void* context, unsigned int begin, unsigned int end
+) {
+  // sum the shards' partial rows in shard order
+  GradientTask* task = (GradientTask*)context;
+  unsigned int rows = task->weight_delta->rows;
+  unsigned int columns = task->weight_delta->columns;
+  for (unsigned int i = begin; i < end; i++) {
+    real* out = get_row_data(task->weight_delta, i);
+    vector_copy(task->partials + (size_t)i * columns, out, columns);
+    for (unsigned int shard = 1; shard < task->num_shards; shard++) {
+      vector_add(
+        out,
+        task->partials + ((size_t)shard * rows + i) * columns,
+        out, columns
+      );
+    }
+  }
+}
+
+static void weight_gradient(
+  Network* net, Matrix* delta, Matrix* input, Matrix* weight_delta
+) {
+  // weight_delta = delta * input^T, summed over the batch in fixed shards
+  // of samples that are computed in parallel and reduced in order
+  unsigned int num_shards = num_gradient_shards(delta->columns);
+  GradientTask task = {
+    delta, input, weight_delta,
+    num_shards > 1 ? net->gradient_shards->matrix_data : NULL,
+    num_shards
+  };
+  size_t row_work = (size_t)weight_delta->columns * GRADIENT_SHARD_SAMPLES;
+  parallel_for(
+    num_shards * weight_delta->rows, parallel_grain(row_work),
+    gradient_shard_rows, &task
+  );
+  if (num_shards > 1) {
+    parallel_for(
+      weight_delta->rows,
+      parallel_grain((size_t)weight_delta->columns * num_shards),
+      reduce_gradient_rows, &task
+    );
+  }
+}
+
+static void backward_layers(
+  Network* net, double bias_learning_rate, double weight_learning_rate,
+  unsigned int update, unsigned int first, unsigned int end
+) {
+  // perform backpropagation of layers [first, end) from the delta of
+  // layer end - 1, gradients are summed over the batch before the weights
+  // and biases are updated, or only written to the gradient slab when
+  // update is 0
+  for (unsigned int l = end - 1; l >= first && l > 0; l--) {
     #ifdef PRINT_VERBOSE
     printf("=== Layer %d ===\n", l);
     #endif
     Layer* cur_layer = &net->layers[l];
+    Matrix* delta = cur_layer->delta;
+    PROFILE_START(start);
     if (cur_layer->layer_type == LAYER_OUTPUT) {
-      delta = create_empty_matrix(
-        cur_layer->output->rows,
-        1
-      );
-      unsigned int matrix_size = delta->rows;
-      for (unsigned int i = 0; i < matrix_size; i++) {
-        // delta->matrix_data[i] = (
-        //   net->cost->matrix_data[i]
-        // );
-        // Layer* final_layer = &(net->layers[net->num_layers-1]);
-        delta->matrix_data[i] = (
-          // activate_output_derivative(
-          //   final_layer->multiplied->matrix_data[i]
-          // )
-          // *
-          -(
-            net->target_output->matrix_data[i]
-            - net->output->matrix_data[i]
-          )
-        );
+      for (unsigned int r = 0; r < delta->rows; r++) {
+        real* delta_row = get_row_data(delta, r);
+        real* target_row = get_row_data(net->target_output, r);
+        real* output_row = get_row_data(net->output, r);
+        for (unsigned int c = 0; c < delta->columns; c++) {
+          delta_row[c] = -(target_row[c] - output_row[c]);
+        }
       }
-      // copy_matrix(net->cost, delta);
       #ifdef PRINT_VERBOSE
       printf("Delta:\n");
       print_matrix(delta);
       #endif
       // update biases
-      for (unsigned int i = 0; i < cur_layer->biases->rows; i++) {
-        cur_layer->biases->matrix_data[i] -= (
-          delta->matrix_data[i] * bias_learning_rate
-        );
+      update_biases(cur_layer, bias_learning_rate, update);
+      if (net->gradient_ready) {
+        net->gradient_ready(net->gradient_ready_context, l);
       }
+      // the output layer has no weights, so its delta passes straight back
+      copy_matrix(delta, net->layers[l-1].delta);
     } else {
       // is hidden or input layer
-      // update weights
-      Matrix* weight_delta = create_empty_matrix(
-        cur_layer->weights->rows, cur_layer->weights->columns
-      );
-      outer_product(delta, net->layers[l-1].output, weight_delta);
+      Matrix* prev_output = net->layers[l-1].output;
+      Matrix* weight_delta = NULL;
+      if (net->batch_size > 1) {
+        // sum of the outer products over the batch: delta * prev_output^T
+        weight_delta = cur_layer->weight_delta;
+        weight_gradient(net, delta, prev_output, weight_delta);
+      } else if (!update) {
+        weight_delta = cur_layer->weight_delta;
+        outer_product(delta, prev_output, weight_delta);
+      }
       #ifdef PRINT_VERBOSE
       printf("Weights:\n"); print_matrix(cur_layer->weights);
       printf("Delta:\n"); print_matrix(delta);
-      printf("Previous output:\n"); print_matrix(net->layers[l-1].output);
-      printf("Weight delta:\n"); print_matrix(weight_delta);
+      printf("Previous output:\n"); print_matrix(prev_output);
       #endif
-      unsigned int weights_size = cur_layer->weights->rows;
-      weights_size *= cur_layer->weights->columns;
-      for (unsigned int i = 0; i < weights_size; i++) {
-        cur_layer->weights->matrix_data[i] -= (
-          weight_delta->matrix_data[i] * weight_learning_rate
-        );
-      }
+      // compute delta for next layer from the weights before this step's
+      // update, and update them in the same pass, a single sample's
+      // outer product is formed on the fly
+      Matrix* next_delta = net->layers[l-1].delta;
+      transposed_multiply_update(
+        cur_layer->weights, delta, prev_output, weight_delta,
+        update ? -weight_learning_rate : 0, next_delta
+      );
       // update biases
-      for (unsigned int i = 0; i < cur_layer->biases->rows; i++) {
-        cur_layer->biases->matrix_data[i] -= (
-          delta->matrix_data[i] * bias_learning_rate
-        );
+      update_biases(cur_layer, bias_learning_rate, update);
+      if (net->gradient_ready) {
+        net->gradient_ready(net->gradient_ready_context, l);
       }
-      #ifdef PRINT_VERBOSE
-      printf("Delta:\n");
-      print_matrix(delta);
-      #endif
-      // free weight_delta
-      free_matrix(weight_delta);
-      // compute delta for next layer
-      if (l > 0) {
-        Matrix* transposed = create_empty_matrix(
-          cur_layer->weights->rows,
-          cur_layer->weights->columns
-        );
-        transpose(cur_layer->weights, transposed);
-        Matrix* multiplied = multiply(
-          transposed,
-          delta
-        );
-        Matrix* activation_gradient = create_empty_matrix(
-          net->layers[l-1].output->rows,
-          1
-        );
-        unsigned int matrix_size = activation_gradient->rows;
-        for (unsigned int i = 0; i < matrix_size; i++) {
-          activation_gradient->matrix_data[i] = activate_output_derivative(
-            net->layers[l-1].output->matrix_data[i]
-          );
+      Matrix* activation_gradient = cur_layer->activation_gradient;
+      for (unsigned int r = 0; r < activation_gradient->rows; r++) {
+        real* gradient_row = get_row_data(activation_gradient, r);
+        real* output_row = get_row_data(prev_output, r);
+        for (unsigned int c = 0; c < activation_gradient->columns; c++) {
+          gradient_row[c] = activation_derivative(output_row[c]);
         }
-        hadamard_product(activation_gradient, multiplied, multiplied);
-        free_matrix(delta);
-        delta = multiplied;
-        free_matrix(transposed);
-        free_matrix(activation_gradient);
-        #ifdef PRINT_VERBOSE
-        printf("New delta:\n");
-        print_matrix(delta);
-        #endif
       }
+      hadamard_product(activation_gradient, next_delta, next_delta);
+      #ifdef PRINT_VERBOSE
+      printf("New delta:\n");
+      print_matrix(next_delta);
+      #endif
     }
+    // weight gradient, transposed product and update of a hidden layer,
+    // the delta and bias gradient of every layer
+    PROFILE_END(start, "backward", l,
+      (cur_layer->weights ? (4.0 * net->batch_size + (update ? 2 : 0))
+      * cur_layer->weights->rows * cur_layer->weights->columns
+      + 3.0 * cur_layer->input->rows * net->batch_size : 0)
+      + 2.0 * delta->rows * net->batch_size,
+      PROFILE_BYTES((cur_layer->weights ? (update ? 3.0 : 2.0)
+      * cur_layer->weights->rows * cur_layer->weights->columns
+      + 4.0 * cur_layer->input->rows * net->batch_size : 0)
+      + 3.0 * delta->rows * net->batch_size));
+  }
+}
+
+static void backward_checkpoints(
+  Network* net, double bias_learning_rate, double weight_learning_rate,
+  unsigned int update
+) {
+  // one checkpoint interval at a time from the top: the outputs the
+  // interval's layers read are recomputed from the checkpoint below it,
+  // except in the top interval, which the forward pass left in place
+  unsigned int interval = net->checkpoint_interval;
+  unsigned int end = net->num_layers;
+  if (interval <= 1) {
+    backward_layers(
+      net, bias_learning_rate, weight_learning_rate, update, 0, end
+    );
+    return;
+  }
+  while (end > 1) {
+    unsigned int first = (end - 1) / interval * interval;
+    if (end < net->num_layers) {
+      forward_layers(net, first, end - 1);
+    }
+    backward_layers(
+      net, bias_learning_rate, weight_learning_rate, update, first, end
+    );
+    end = first;
+  }
+}
+
+void backpropagate(
+  Network* net, double bias_learning_rate, double weight_learning_rate
+) {
+  backward_checkpoints(net, bias_learning_rate, weight_learning_rate, 1);
+}
+
+void compute_gradients(Network* net) {
+  backward_checkpoints(net, 0, 0, 0);
+}
+
+static void check_layer_range(Network* net) {
+  if (net->checkpoint_interval > 1) {
+    printf("Error: Layer range: network keeps only checkpointed "
+    "activations\n");
+    exit(1);
+  }
+}
+
+void forward_pass_layers(
+  Network* net, unsigned int first, unsigned int end
+) {
+  check_layer_range(net);
+  forward_layers(net, first, end);
+}
+
+void compute_gradients_layers(
+  Network* net, unsigned int first, unsigned int end
+) {
+  check_layer_range(net);
+  backward_layers(net, 0, 0, 0, first, end);
+}
+
+void use_activation_checkpoints(Network* net, unsigned int interval) {
+  if (net->inference_only) {
+    printf("Error: Checkpoints: network was not created for training\n");
+    exit(1);
   }
-  free_matrix(delta);
+  free_matrix(net->activation_memory);
+  net->checkpoint_interval = interval;
+  setup_activations(net);
+}
+
+void zero_gradients(Network* net) {
+  memset(net->gradients, 0, sizeof(real) * net->num_parameters);
+}
+
+void apply_gradients(
+  Network* net, double bias_learning_rate, double weight_learning_rate
+) {
+  // the weights are the front of the slab and the biases the back, each
+  // updated in a single sweep
+  size_t num_weights = net->num_weight_parameters;
+  add_scaled_data(
+    net->gradients, net->parameters, num_weights, -weight_learning_rate
+  );
+  add_scaled_data(
+    net->gradients + num_weights, net->parameters + num_weights,
+    net->num_parameters - num_weights, -bias_learning_rate
+  );
+}
+
+void copy_parameters(Network* source, Network* net) {
+  unsigned int same_layers = (source->num_layers == net->num_layers);
+  for (unsigned int l = 0; same_layers && l < net->num_layers; l++) {
+    same_layers = (source->num_nodes[l] == net->num_nodes[l]);
+  }
+  if (!same_layers) {
+    printf("Error: Copy parameters: networks not the same size\n");
+    exit(1);
+  }
+  vector_copy(source->parameters, net->parameters, net->num_parameters);
+}
+
+void use_parameter_slab(Network* net, real* parameters) {
+  if (!net->mapping && !net->shared_parameters) {
+    free(net->parameters);
+  }
+  net->parameters = parameters;
+  net->shared_parameters = 0;
+  place_parameters(net, parameters, 0);
+}
+
+void share_parameters(Network* source, Network* net) {
+  unsigned int same_layers = (source->num_layers == net->num_layers);
+  for (unsigned int l = 0; same_layers && l < net->num_layers; l++) {
+    same_layers = (source->num_nodes[l] == net->num_nodes[l]);
+  }
+  if (!same_layers) {
+    printf("Error: Share parameters: networks not the same size\n");
+    exit(1);
+  }
+  use_parameter_slab(net, source->parameters);
+  net->shared_parameters = 1;
+}
+
+real* use_gradient_slab(Network* net, real* gradients) {
+  real* previous = net->gradients;
+  net->gradients = gradients;
+  place_parameters(net, gradients, 1);
+  return previous;
 }
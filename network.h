@@ -6,24 +6,70 @@
 // implement neural network layer structure
 
 enum layerType {LAYER_INPUT, LAYER_HIDDEN, LAYER_OUTPUT};
+
+// called during backpropagation once a layer's gradients are in the
+// gradient slab, from the output layer down to layer 1
+typedef void (*gradient_ready_hook)(void* context, unsigned int layer);
+
 typedef struct Layer {
+  // views into the network's activation memory, the input is the previous
+  // layer's output or the network input
   Matrix* input;
+  // views into the network's parameter slab
   Matrix* weights;
   Matrix* biases;
-  Matrix* multiplied;
   Matrix* output;
+  // views into the network's gradient slab
+  Matrix* weight_delta;
+  Matrix* bias_delta;
+  // backpropagation temporaries, views into the network workspace
+  Matrix* delta;
+  Matrix* activation_gradient;
   enum layerType layer_type;
 } Layer;
 
+// predict_batch() buffers, one per thread sharing a network that none of
+// them write to
+typedef struct PredictScratch {
+  Matrix* activations[2];
+  unsigned int batch_size;
+} PredictScratch;
+
 typedef struct Network {
   Matrix* input;
   Matrix* output;
   Matrix* target_output;
   unsigned int num_layers;
   unsigned int* num_nodes;
+  unsigned int batch_size;
   Layer* layers;
   Matrix* cost;
   double total_cost;
+  // every layer's weights, then every layer's biases, in one allocation
+  // with each block starting on a MATRIX_ALIGNMENT boundary; the gradient
+  // slab has the same layout and only exists for training
+  real* parameters;
+  real* gradients;
+  size_t num_parameters;
+  size_t num_weight_parameters;
+  // one allocation backing every layer's output, of which only every
+  // checkpoint_interval-th is kept when the interval is above 1
+  Matrix* activation_memory;
+  unsigned int checkpoint_interval;
+  // one allocation backing every backpropagation temporary
+  Matrix* workspace;
+  Matrix* gradient_shards;
+  // ping-pong buffers for predict()
+  Matrix* activations[2];
+  unsigned int inference_only;
+  // checkpoint the parameters are mapped from, if any
+  void* mapping;
+  size_t mapping_size;
+  // set when the parameter slab belongs to another network
+  unsigned int shared_parameters;
+  // optional, NULL unless set by the caller
+  gradient_ready_hook gradient_ready;
+  void* gradient_ready_context;
 } Network;
 
 // implement neural network calculations
@@ -33,15 +79,33 @@ void initialise_network(
   unsigned int clearNetwork
 );
 
-void randomise_network(Network* net);
+void initialise_batch_network(
+  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+  unsigned int batch_size, unsigned int clearNetwork
+);
 
-double activate_hidden(double n);
+void initialise_inference_network(
+  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+  unsigned int clearNetwork
+);
 
-double activate_hidden_derivative(double n);
+// a batch network, or an inference network for a batch_size of 0, whose
+// parameter views point nowhere until use_parameter_slab() or
+// share_parameters() gives it a slab, so no slab of its own is allocated
+void initialise_network_without_parameters(
+  Network* network, unsigned int num_layers, unsigned int* num_nodes,
+  unsigned int batch_size, unsigned int clearNetwork
+);
 
-double activate_output(double n);
+// standard normal weights and biases from a seed drawn with rand()
+void randomise_network(Network* net);
 
-double activate_output_derivative(double n);
+// the same from a given seed, identical whatever the number of threads
+void randomise_network_seeded(Network* net, unsigned long long seed);
+
+// the derivative backpropagation uses for the atan of vector_atan(), from
+// the activation's output
+double activation_derivative(double n);
 
 void cost(Matrix* output, Matrix* target_output, Matrix* cost_matrix);
 
@@ -49,8 +113,75 @@ double total_cost(Matrix* cost);
 
 void forward_pass(Network* net, double* input, double* target_output);
 
+void forward_pass_batch(
+  Network* net, Matrix* input, Matrix* target_output
+);
+
+void predict(Network* net, double* input, double* output);
+
+void initialise_predict_scratch(
+  PredictScratch* scratch, Network* net, unsigned int batch_size,
+  unsigned int clearScratch
+);
+
+// predict() of count <= scratch->batch_size samples, input and output one
+// sample after another; only the scratch is written, so any number of
+// threads may run it on the same network with a scratch each
+void predict_batch(
+  Network* net, PredictScratch* scratch, double* input, double* output,
+  unsigned int count
+);
+
 void backpropagate(
   Network* net, double bias_learning_rate, double weight_learning_rate
 );
 
+// fills the gradient slab for the last forward pass, the parameters are
+// left alone
+void compute_gradients(Network* net);
+
+// forward_pass() and compute_gradients() of layers [first, end) only, so
+// a pipeline stage can run its share of the network: layer first reads
+// layer first - 1's output, or net->input, and backpropagation of layer
+// first leaves the delta of layer first - 1 for the stage before; the
+// cost is computed with the output layer
+void forward_pass_layers(
+  Network* net, unsigned int first, unsigned int end
+);
+
+void compute_gradients_layers(
+  Network* net, unsigned int first, unsigned int end
+);
+
+void zero_gradients(Network* net);
+
+// one SGD step over the whole parameter slab
+void apply_gradients(
+  Network* net, double bias_learning_rate, double weight_learning_rate
+);
+
+// keeps only the output of every interval-th layer, and the network
+// output, through the forward pass; backpropagation recomputes the rest
+// one interval at a time, so activation memory is about
+// num_layers / interval + interval layers instead of num_layers for a
+// forward pass more. 0 or 1 keeps every output, and the layer range
+// functions above need every output kept
+void use_activation_checkpoints(Network* net, unsigned int interval);
+
+// copies every parameter of a network with the same layer sizes
+void copy_parameters(Network* source, Network* net);
+
+// points the network at a slab laid out like net->parameters, e.g. a
+// mapped checkpoint, releasing its own
+void use_parameter_slab(Network* net, real* parameters);
+
+// points the parameter views at source's slab, which source keeps
+// owning; the network then trains source's parameters and must be cleared
+// before source is
+void share_parameters(Network* source, Network* net);
+
+// points the gradient views at a slab laid out like net->gradients and
+// returns the slab it replaces, which the caller then owns
+real* use_gradient_slab(Network* net, real* gradients);
+
 #endif
\ No newline at end of file
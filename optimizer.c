@@ -0,0 +1,190 @@
+#include "optimizer.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// elements per chunk of a parallel optimizer step
+#define OPTIMIZER_CHUNK 4096
+
+typedef struct StepTask {
+  Optimizer* optimizer;
+  real* parameters;
+  const real* gradients;
+  real* first_moment;
+  real* second_moment;
+  size_t size;
+  real rate;
+  AdamStep adam;
+} StepTask;
+
+static void step_chunks(void* context, unsigned int begin, unsigned int end) {
+  StepTask* task = (StepTask*)context;
+  size_t first = (size_t)begin * OPTIMIZER_CHUNK;
+  size_t last = (size_t)end * OPTIMIZER_CHUNK;
+  if (last > task->size) last = task->size;
+  size_t n = last - first;
+  real* param = task->parameters + first;
+  const real* gradient = task->gradients + first;
+  switch (task->optimizer->type) {
+    case OPTIMIZER_MOMENTUM:
+    case OPTIMIZER_NESTEROV:
+      vector_momentum_step(
+        param, gradient, task->first_moment + first, n, task->rate,
+        task->optimizer->momentum,
+        task->optimizer->type == OPTIMIZER_NESTEROV
+      );
+      break;
+    case OPTIMIZER_ADAM:
+    case OPTIMIZER_ADAMW:
+      vector_adam_step(
+        param, gradient, task->first_moment + first,
+        task->second_moment + first, n, &task->adam
+      );
+      break;
+    default:
+      vector_axpy(-task->rate, gradient, param, n);
+      break;
+  }
+}
+
+static void step_range(
+  Optimizer* optimizer, Network* net, size_t begin, size_t end,
+  double rate, double decay
+) {
+  // one pass over [begin, end) of the slab, decay only applies to weights
+  if (end <= begin) {
+    return;
+  }
+  StepTask task;
+  task.optimizer = optimizer;
+  task.parameters = net->parameters + begin;
+  task.gradients = net->gradients + begin;
+  task.first_moment = optimizer->first_moment
+    ? optimizer->first_moment + begin : NULL;
+  task.second_moment = optimizer->second_moment
+    ? optimizer->second_moment + begin : NULL;
+  task.size = end - begin;
+  task.rate = rate;
+  if (optimizer->type == OPTIMIZER_ADAM
+    || optimizer->type == OPTIMIZER_ADAMW) {
+    // bias corrections for the moments' zero start
+    double t = (double)optimizer->step;
+    task.adam.beta1 = optimizer->momentum;
+    task.adam.beta2 = optimizer->beta2;
+    task.adam.rate = rate / (1 - pow(optimizer->momentum, t));
+    task.adam.second_correction = 1 / (1 - pow(optimizer->beta2, t));
+    task.adam.epsilon = optimizer->epsilon;
+    task.adam.gradient_decay = 0;
+    task.adam.parameter_decay = 0;
+    if (optimizer->type == OPTIMIZER_ADAMW) {
+      task.adam.parameter_decay = rate * decay;
+    } else {
+      task.adam.gradient_decay = decay;
+    }
+  }
+  unsigned int chunks = (task.size + OPTIMIZER_CHUNK - 1) / OPTIMIZER_CHUNK;
+  parallel_for(
+    chunks, parallel_grain(OPTIMIZER_CHUNK), step_chunks, &task
+  );
+}
+
+static size_t first_trained_weight(Network* net) {
+  // the input layer's weights are the first block of the slab
+  if (net->num_layers > 2) {
+    return net->layers[1].weights->matrix_data - net->parameters;
+  }
+  return net->num_weight_parameters;
+}
+
+void initialise_optimizer(
+  Optimizer* optimizer, Network* net, enum optimizerType type,
+  double learning_rate, unsigned int clearOptimizer
+) {
+  if (clearOptimizer) {
+    free(optimizer->first_moment);
+    free(optimizer->second_moment);
+    optimizer->first_moment = NULL;
+    optimizer->second_moment = NULL;
+    return;
+  }
+  if (!net->gradients) {
+    printf("Error: Optimizer: network was not created for training\n");
+    exit(1);
+  }
+  optimizer->type = type;
+  optimizer->learning_rate = learning_rate;
+  optimizer->bias_learning_rate = learning_rate;
+  optimizer->momentum = 0.9;
+  optimizer->beta2 = 0.999;
+  optimizer->epsilon = 1e-8;
+  optimizer->weight_decay = (type == OPTIMIZER_ADAMW) ? 0.01 : 0;
+  optimizer->step = 0;
+  optimizer->num_parameters = net->num_parameters;
+  optimizer->first_moment = NULL;
+  optimizer->second_moment = NULL;
+  if (type != OPTIMIZER_SGD) {
+    optimizer->first_moment = create_aligned_data(net->num_parameters);
+  }
+  if (type == OPTIMIZER_ADAM || type == OPTIMIZER_ADAMW) {
+    optimizer->second_moment = create_aligned_data(net->num_parameters);
+  }
+}
+
+void reset_optimizer(Optimizer* optimizer) {
+  size_t size = sizeof(real) * optimizer->num_parameters;
+  if (optimizer->first_moment) {
+    memset(optimizer->first_moment, 0, size);
+  }
+  if (optimizer->second_moment) {
+    memset(optimizer->second_moment, 0, size);
+  }
+  optimizer->step = 0;
+}
+
+void optimizer_step(Optimizer* optimizer, Network* net) {
+  if (net->num_parameters != optimizer->num_parameters) {
+    printf("Error: Optimizer: network has %lu parameters, expected %lu\n",
+    (unsigned long)net->num_parameters,
+    (unsigned long)optimizer->num_parameters);
+    exit(1);
+  }
+  PROFILE_START(start);
+  optimizer->step++;
+  step_range(
+    optimizer, net, first_trained_weight(net), net->num_weight_parameters,
+    optimizer->learning_rate, optimizer->weight_decay
+  );
+  step_range(
+    optimizer, net, net->num_weight_parameters, net->num_parameters,
+    optimizer->bias_learning_rate, 0
+  );
+  // parameter, gradient and one or two state arrays, read and written
+  PROFILE_END(start, "optimizer_step", -1, 0,
+    PROFILE_BYTES((optimizer->second_moment ? 6.0
+    : optimizer->first_moment ? 4.0 : 3.0)
+    * (net->num_parameters - first_trained_weight(net))));
+}
+
+void optimise(Optimizer* optimizer, Network* net) {
+  compute_gradients(net);
+  optimizer_step(optimizer, net);
+}
+
+const char* optimizer_name(enum optimizerType type) {
+  switch (type) {
+    case OPTIMIZER_MOMENTUM:
+      return "momentum";
+    case OPTIMIZER_NESTEROV:
+      return "nesterov";
+    case OPTIMIZER_ADAM:
+      return "adam";
+    case OPTIMIZER_ADAMW:
+      return "adamw";
+    default:
+      return "sgd";
+  }
+}
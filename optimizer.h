@@ -0,0 +1,54 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "network.h"
+
+// optimizers that turn the network's gradient slab into a parameter update
+//
+// the optimizer state is laid out like the parameter slab, so every step
+// is one fused pass over the parameters, gradients and state; the input
+// layer's weights are not trained (see backpropagate) and are skipped
+
+enum optimizerType {
+  OPTIMIZER_SGD, OPTIMIZER_MOMENTUM, OPTIMIZER_NESTEROV, OPTIMIZER_ADAM,
+  OPTIMIZER_ADAMW
+};
+
+typedef struct Optimizer {
+  enum optimizerType type;
+  double learning_rate;
+  // learning rate of the biases, the same as learning_rate unless changed
+  double bias_learning_rate;
+  // velocity decay for momentum and Nesterov, beta1 for Adam
+  double momentum;
+  double beta2;
+  double epsilon;
+  // L2 penalty for Adam, decoupled decay for AdamW, never on the biases
+  double weight_decay;
+  unsigned long step;
+  // velocity, or Adam's first and second moments, parallel to the slab
+  real* first_moment;
+  real* second_moment;
+  size_t num_parameters;
+} Optimizer;
+
+// sets the usual defaults: momentum 0.9, beta2 0.999, epsilon 1e-8 and a
+// weight decay of 0.01 for AdamW, 0 otherwise
+void initialise_optimizer(
+  Optimizer* optimizer, Network* net, enum optimizerType type,
+  double learning_rate, unsigned int clearOptimizer
+);
+
+// zeroes the state as if no step had been taken
+void reset_optimizer(Optimizer* optimizer);
+
+// updates the parameters from the gradients of the last
+// compute_gradients()
+void optimizer_step(Optimizer* optimizer, Network* net);
+
+// compute_gradients() then optimizer_step() for the last forward pass
+void optimise(Optimizer* optimizer, Network* net);
+
+const char* optimizer_name(enum optimizerType type);
+
+#endif
@@ -0,0 +1,366 @@
+#include "pipeline.h"
+#include "kernels.h"
+#include "profile.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// a ring of micro-batch numbers; the producer only moves tail and the
+// consumer only moves head, each on a cache line of its own
+struct PipelineQueue {
+  _Atomic unsigned long head;
+  char head_padding[64 - sizeof(unsigned long)];
+  _Atomic unsigned long tail;
+  char tail_padding[64 - sizeof(unsigned long)];
+  unsigned int* items;
+  unsigned int capacity;
+};
+
+static void pipeline_error(const char* message) {
+  printf("Error: Pipeline: %s\n", message);
+  exit(1);
+}
+
+static void push_micro_batch(PipelineQueue* queue, unsigned int m) {
+  unsigned long tail = atomic_load_explicit(
+    &queue->tail, memory_order_relaxed
+  );
+  while (tail - atomic_load_explicit(&queue->head, memory_order_acquire)
+    >= queue->capacity) {
+    sched_yield();
+  }
+  queue->items[tail % queue->capacity] = m;
+  // the release publishes the item and the activations written before it
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+static unsigned int pop_micro_batch(PipelineQueue* queue) {
+  unsigned long head = atomic_load_explicit(
+    &queue->head, memory_order_relaxed
+  );
+  while (atomic_load_explicit(&queue->tail, memory_order_acquire) == head) {
+    sched_yield();
+  }
+  unsigned int m = queue->items[head % queue->capacity];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return m;
+}
+
+static void expect_micro_batch(PipelineQueue* queue, unsigned int m) {
+  // every stage handles the micro-batches in the same order
+  if (pop_micro_batch(queue) != m) {
+    pipeline_error("micro-batches out of order");
+  }
+}
+
+static void load_samples(double* samples, Matrix* batch, unsigned int first) {
+  // samples first, first + 1, ... one column each
+  for (unsigned int r = 0; r < batch->rows; r++) {
+    real* row = get_row_data(batch, r);
+    for (unsigned int c = 0; c < batch->columns; c++) {
+      row[c] = samples[((size_t)first + c) * batch->rows + r];
+    }
+  }
+}
+
+static void store_samples(Matrix* batch, double* samples, unsigned int first) {
+  for (unsigned int r = 0; r < batch->rows; r++) {
+    real* row = get_row_data(batch, r);
+    for (unsigned int c = 0; c < batch->columns; c++) {
+      samples[((size_t)first + c) * batch->rows + r] = row[c];
+    }
+  }
+}
+
+static void stage_forward(PipelineStage* stage, unsigned int m) {
+  Pipeline* pipeline = stage->pipeline;
+  Network* replica = &pipeline->replicas[m % pipeline->num_stages];
+  unsigned int first_sample = m * pipeline->micro_batch;
+  if (stage->index == 0) {
+    load_samples(pipeline->input, replica->input, first_sample);
+    if (pipeline->target_output) {
+      load_samples(
+        pipeline->target_output, replica->target_output, first_sample
+      );
+    }
+  } else {
+    expect_micro_batch(&pipeline->forward[stage->index-1], m);
+  }
+  forward_pass_layers(replica, stage->first, stage->end);
+  if (stage->index + 1 < pipeline->num_stages) {
+    push_micro_batch(&pipeline->forward[stage->index], m);
+  } else if (pipeline->training) {
+    pipeline->total_cost += replica->total_cost;
+  } else {
+    store_samples(replica->output, pipeline->output, first_sample);
+  }
+}
+
+static void add_layer_gradients(
+  Network* net, Network* replica, unsigned int l, unsigned int m
+) {
+  // the first micro-batch overwrites the network's gradients, the rest
+  // are added in order
+  Layer* layer = &net->layers[l];
+  Layer* from = &replica->layers[l];
+  Matrix* blocks[2][2] = {
+    {from->weight_delta, layer->weight_delta},
+    {from->bias_delta, layer->bias_delta}
+  };
+  for (unsigned int b = 0; b < 2; b++) {
+    if (!blocks[b][0]) {
+      continue;
+    }
+    size_t n = (size_t)blocks[b][0]->rows * blocks[b][0]->stride;
+    real* out = blocks[b][1]->matrix_data;
+    if (m == 0) {
+      vector_copy(blocks[b][0]->matrix_data, out, n);
+    } else {
+      vector_add(out, blocks[b][0]->matrix_data, out, n);
+    }
+  }
+}
+
+static void stage_backward(PipelineStage* stage, unsigned int m) {
+  // predictions only pass the micro-batch back, which frees its replica
+  Pipeline* pipeline = stage->pipeline;
+  Network* replica = &pipeline->replicas[m % pipeline->num_stages];
+  if (stage->index + 1 < pipeline->num_stages) {
+    expect_micro_batch(&pipeline->backward[stage->index], m);
+  }
+  if (pipeline->training) {
+    compute_gradients_layers(replica, stage->first, stage->end);
+    unsigned int first = stage->first ? stage->first : 1;
+    for (unsigned int l = first; l < stage->end; l++) {
+      add_layer_gradients(pipeline->net, replica, l, m);
+    }
+  }
+  if (stage->index > 0) {
+    push_micro_batch(&pipeline->backward[stage->index-1], m);
+  }
+}
+
+static void run_schedule(PipelineStage* stage) {
+  // 1F1B: forwards until the pipeline below this stage is full, then a
+  // forward and a backward in turn, then the backwards left over
+  Pipeline* pipeline = stage->pipeline;
+  unsigned int count = pipeline->num_micro_batches;
+  unsigned int warmup = pipeline->num_stages - stage->index - 1;
+  if (warmup > count) {
+    warmup = count;
+  }
+  unsigned int forwards = 0;
+  unsigned int backwards = 0;
+  while (forwards < warmup) {
+    stage_forward(stage, forwards++);
+  }
+  while (forwards < count) {
+    stage_forward(stage, forwards++);
+    stage_backward(stage, backwards++);
+  }
+  while (backwards < count) {
+    stage_backward(stage, backwards++);
+  }
+}
+
+static void* run_stage(void* context) {
+  PipelineStage* stage = (PipelineStage*)context;
+  Pipeline* pipeline = stage->pipeline;
+  unsigned long seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->job == seen && !pipeline->stop) {
+      pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    seen = pipeline->job;
+    unsigned int stop = pipeline->stop;
+    pthread_mutex_unlock(&pipeline->lock);
+    if (stop) {
+      return NULL;
+    }
+    PROFILE_START(start);
+    run_schedule(stage);
+    PROFILE_END(start, "pipeline_stage", stage->index, 0, 0);
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->finished++;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+  }
+}
+
+static unsigned int pack_layers(
+  Pipeline* pipeline, double* work, double limit
+) {
+  // fills each stage with layers while it stays within limit, keeping one
+  // layer for every stage after it; returns 1 if everything fitted
+  unsigned int num_layers = pipeline->net->num_layers;
+  unsigned int l = 0;
+  unsigned int fits = 1;
+  for (unsigned int s = 0; s < pipeline->num_stages; s++) {
+    PipelineStage* stage = &pipeline->stages[s];
+    unsigned int stages_left = pipeline->num_stages - s - 1;
+    double done = 0;
+    stage->first = l;
+    do {
+      done += work[l++];
+    } while (num_layers - l > stages_left
+      && (!stages_left || done + work[l] <= limit));
+    if (done > limit) {
+      fits = 0;
+    }
+    stage->end = l;
+  }
+  return fits;
+}
+
+static void split_layers(Pipeline* pipeline) {
+  // contiguous stages of at least one layer each, with the most
+  // multiply-adds any stage has as small as possible; the bound is
+  // bisected between the largest layer and the whole network
+  Network* net = pipeline->net;
+  unsigned int num_layers = net->num_layers;
+  double* work = (double*)malloc(sizeof(double) * num_layers);
+  double low = 0;
+  double high = 0;
+  for (unsigned int l = 0; l < num_layers; l++) {
+    work[l] = net->num_nodes[l];
+    if (l + 1 < num_layers) {
+      work[l] *= net->num_nodes[l+1];
+    }
+    high += work[l];
+    if (work[l] > low) {
+      low = work[l];
+    }
+  }
+  for (unsigned int step = 0; step < 64 && high - low > 0.5; step++) {
+    double middle = (low + high) / 2;
+    if (pack_layers(pipeline, work, middle)) {
+      high = middle;
+    } else {
+      low = middle;
+    }
+  }
+  pack_layers(pipeline, work, high);
+  free(work);
+}
+
+void start_pipeline(
+  Pipeline* pipeline, Network* net, unsigned int num_stages,
+  unsigned int micro_batch
+) {
+  if (num_stages == 0 || num_stages > net->num_layers) {
+    pipeline_error("needs between one stage and one stage per layer");
+  } else if (micro_batch == 0) {
+    pipeline_error("needs micro-batches of at least one sample");
+  }
+  pipeline->net = net;
+  pipeline->num_stages = num_stages;
+  pipeline->micro_batch = micro_batch;
+  pipeline->job = 0;
+  pipeline->finished = 0;
+  pipeline->stop = 0;
+  pipeline->stages = (PipelineStage*)calloc(
+    num_stages, sizeof(PipelineStage)
+  );
+  split_layers(pipeline);
+  pipeline->replicas = (Network*)calloc(num_stages, sizeof(Network));
+  for (unsigned int r = 0; r < num_stages; r++) {
+    initialise_network_without_parameters(
+      &pipeline->replicas[r], net->num_layers, net->num_nodes, micro_batch,
+      0
+    );
+    share_parameters(net, &pipeline->replicas[r]);
+  }
+  // a queue never holds more than the micro-batches in flight
+  pipeline->forward = (PipelineQueue*)calloc(
+    2 * num_stages, sizeof(PipelineQueue)
+  );
+  pipeline->backward = pipeline->forward + num_stages;
+  for (unsigned int q = 0; q < 2 * num_stages; q++) {
+    PipelineQueue* queue = &pipeline->forward[q];
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    queue->capacity = num_stages;
+    queue->items = (unsigned int*)calloc(num_stages, sizeof(unsigned int));
+  }
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->changed, NULL);
+  for (unsigned int s = 0; s < num_stages; s++) {
+    PipelineStage* stage = &pipeline->stages[s];
+    stage->pipeline = pipeline;
+    stage->index = s;
+    if (pthread_create(&stage->thread, NULL, run_stage, stage)) {
+      pipeline_error("could not start a stage");
+    }
+  }
+}
+
+void finish_pipeline(Pipeline* pipeline) {
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->stop = 1;
+  pthread_cond_broadcast(&pipeline->changed);
+  pthread_mutex_unlock(&pipeline->lock);
+  Network* net = pipeline->net;
+  for (unsigned int s = 0; s < pipeline->num_stages; s++) {
+    pthread_join(pipeline->stages[s].thread, NULL);
+    initialise_batch_network(
+      &pipeline->replicas[s], net->num_layers, net->num_nodes,
+      pipeline->micro_batch, 1
+    );
+  }
+  for (unsigned int q = 0; q < 2 * pipeline->num_stages; q++) {
+    free(pipeline->forward[q].items);
+  }
+  free(pipeline->forward);
+  free(pipeline->replicas);
+  free(pipeline->stages);
+  pthread_cond_destroy(&pipeline->changed);
+  pthread_mutex_destroy(&pipeline->lock);
+}
+
+static void run_job(Pipeline* pipeline) {
+  // wakes every stage and waits for all of them to finish the job
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->finished = 0;
+  pipeline->job++;
+  pthread_cond_broadcast(&pipeline->changed);
+  while (pipeline->finished < pipeline->num_stages) {
+    pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+void pipeline_gradients(
+  Pipeline* pipeline, double* input, double* target_output,
+  unsigned int num_micro_batches
+) {
+  if (!pipeline->net->gradients) {
+    pipeline_error("network was not created for training");
+  }
+  if (num_micro_batches == 0) {
+    zero_gradients(pipeline->net);
+    pipeline->net->total_cost = 0;
+    return;
+  }
+  pipeline->input = input;
+  pipeline->target_output = target_output;
+  pipeline->output = NULL;
+  pipeline->num_micro_batches = num_micro_batches;
+  pipeline->training = 1;
+  pipeline->total_cost = 0;
+  run_job(pipeline);
+  pipeline->net->total_cost = pipeline->total_cost;
+}
+
+void pipeline_predict(
+  Pipeline* pipeline, double* input, double* output,
+  unsigned int num_micro_batches
+) {
+  pipeline->input = input;
+  pipeline->target_output = NULL;
+  pipeline->output = output;
+  pipeline->num_micro_batches = num_micro_batches;
+  pipeline->training = 0;
+  run_job(pipeline);
+}
@@ -0,0 +1,83 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include "network.h"
+
+// pipeline parallel execution of deep networks
+//
+// the layers are split into contiguous stages of about equal work, each
+// run by a thread of its own. A batch is cut into micro-batches that
+// flow from stage to stage through bounded single-producer,
+// single-consumer queues, forward and then back again. Every stage
+// follows the one forward, one backward (1F1B) schedule: after enough
+// forwards to fill the pipeline it alternates a forward with a backward,
+// so every stage stays busy and at most num_stages micro-batches are in
+// flight. Their activations live in as many replicas of the network,
+// which share its parameters. Each stage adds its layers' gradients into
+// the network's slab in micro-batch order, so the result is the same as
+// running the micro-batches one after another on a single thread.
+
+typedef struct PipelineQueue PipelineQueue;
+
+typedef struct PipelineStage {
+  struct Pipeline* pipeline;
+  unsigned int index;
+  // the stage runs layers [first, end)
+  unsigned int first;
+  unsigned int end;
+  pthread_t thread;
+} PipelineStage;
+
+typedef struct Pipeline {
+  Network* net;
+  unsigned int num_stages;
+  unsigned int micro_batch;
+  PipelineStage* stages;
+  // activations of the micro-batches in flight, micro-batch m in
+  // replicas[m % num_stages]
+  Network* replicas;
+  // forward[s] carries micro-batches from stage s to s + 1, backward[s]
+  // from stage s + 1 back to s
+  PipelineQueue* forward;
+  PipelineQueue* backward;
+  // the running job
+  double* input;
+  double* target_output;
+  double* output;
+  unsigned int num_micro_batches;
+  unsigned int training;
+  double total_cost;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  unsigned long job;
+  unsigned int finished;
+  unsigned int stop;
+} Pipeline;
+
+// splits net into num_stages stages, at most one per layer, that run
+// micro-batches of micro_batch samples, and starts their threads
+void start_pipeline(
+  Pipeline* pipeline, Network* net, unsigned int num_stages,
+  unsigned int micro_batch
+);
+
+void finish_pipeline(Pipeline* pipeline);
+
+// compute_gradients() of num_micro_batches * micro_batch samples, given
+// one sample after another: the network's gradient slab gets the sum
+// over every sample and net->total_cost the summed cost; the network must
+// have been created for training
+void pipeline_gradients(
+  Pipeline* pipeline, double* input, double* target_output,
+  unsigned int num_micro_batches
+);
+
+// predict_batch() of num_micro_batches * micro_batch samples through the
+// stages, input and output one sample after another
+void pipeline_predict(
+  Pipeline* pipeline, double* input, double* output,
+  unsigned int num_micro_batches
+);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+// element type of every matrix, chosen at build time:
+//   default           double storage, double accumulation
+//   -DPRECISION_FLOAT float storage, float accumulation
+//   -DPRECISION_MIXED float storage, double accumulation in the
+//                     matrix products, dot products and sums
+
+#if defined(PRECISION_FLOAT) || defined(PRECISION_MIXED)
+#define REAL_IS_FLOAT 1
+typedef float real;
+#else
+typedef double real;
+#endif
+
+#ifdef PRECISION_FLOAT
+typedef float accum;
+#else
+typedef double accum;
+#endif
+
+#endif
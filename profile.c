@@ -0,0 +1,294 @@
+#include "profile.h"
+#include "matrices.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// slots of a thread's region hash table, a power of two with room to spare
+#define PROFILE_REGION_SLOTS (2 * PROFILE_MAX_REGIONS)
+
+typedef struct ProfileRegion {
+  const char* name;
+  int layer;
+  unsigned long calls;
+  unsigned long long ns;
+  double flops;
+  double bytes;
+  unsigned long allocations;
+} ProfileRegion;
+
+typedef struct ProfileEvent {
+  const char* name;
+  int layer;
+  unsigned int thread;
+  unsigned long long start_ns;
+  unsigned long long duration_ns;
+  double flops;
+  double bytes;
+} ProfileEvent;
+
+// what one thread records: only its owner writes it, under a lock of its
+// own that is only ever contended by an export or reset, so recording
+// threads never wait for each other
+typedef struct ProfileThread {
+  pthread_mutex_t lock;
+  unsigned int id;
+  unsigned int in_use;
+  ProfileRegion regions[PROFILE_MAX_REGIONS];
+  unsigned int num_regions;
+  unsigned long dropped_regions;
+  // index + 1 into regions, 0 for an empty slot
+  unsigned short region_slots[PROFILE_REGION_SLOTS];
+  ProfileEvent events[PROFILE_MAX_EVENTS];
+  unsigned long long num_events;
+  struct ProfileThread* next;
+} ProfileThread;
+
+// every thread's table, kept after the thread exits so export still sees
+// its records; a thread that starts later takes over a free table rather
+// than adding one, so tables are only allocated for threads that run at
+// the same time
+static ProfileThread* thread_tables = NULL;
+static unsigned int num_thread_tables = 0;
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t table_key;
+static pthread_once_t table_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local ProfileThread* thread_table = NULL;
+
+static unsigned long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void release_table(void* table) {
+  // runs as the owning thread exits
+  pthread_mutex_lock(&tables_lock);
+  ((ProfileThread*)table)->in_use = 0;
+  pthread_mutex_unlock(&tables_lock);
+}
+
+static void create_table_key() {
+  pthread_key_create(&table_key, release_table);
+}
+
+static ProfileThread* own_table() {
+  // the calling thread's table, taken on its first record; plain calloc,
+  // so profiling does not show up in the allocation counts it reports
+  if (thread_table) {
+    return thread_table;
+  }
+  pthread_once(&table_key_once, create_table_key);
+  pthread_mutex_lock(&tables_lock);
+  ProfileThread* table = thread_tables;
+  while (table && table->in_use) {
+    table = table->next;
+  }
+  if (!table) {
+    table = (ProfileThread*)calloc(1, sizeof(ProfileThread));
+    if (!table) {
+      pthread_mutex_unlock(&tables_lock);
+      return NULL;
+    }
+    pthread_mutex_init(&table->lock, NULL);
+    table->id = ++num_thread_tables;
+    table->next = thread_tables;
+    thread_tables = table;
+  }
+  table->in_use = 1;
+  pthread_mutex_unlock(&tables_lock);
+  pthread_setspecific(table_key, table);
+  thread_table = table;
+  return table;
+}
+
+ProfileStart profile_start() {
+  ProfileStart start;
+  start.allocations = thread_allocation_count();
+  start.ns = now_ns();
+  return start;
+}
+
+static ProfileRegion* find_region(
+  ProfileThread* table, const char* name, int layer
+) {
+  // names are string literals, so the pointer and layer identify the
+  // region; open addressing keeps the lookup to a probe or two
+  size_t hash = ((size_t)name >> 3) * 31 + (size_t)(layer + 1);
+  hash ^= hash >> 7;
+  for (unsigned int probe = 0; probe < PROFILE_REGION_SLOTS; probe++) {
+    unsigned int slot = (hash + probe) & (PROFILE_REGION_SLOTS - 1);
+    unsigned int index = table->region_slots[slot];
+    if (!index) {
+      if (table->num_regions == PROFILE_MAX_REGIONS) {
+        return NULL;
+      }
+      ProfileRegion* region = &table->regions[table->num_regions++];
+      memset(region, 0, sizeof(*region));
+      region->name = name;
+      region->layer = layer;
+      table->region_slots[slot] = table->num_regions;
+      return region;
+    }
+    ProfileRegion* region = &table->regions[index - 1];
+    if (region->name == name && region->layer == layer) {
+      return region;
+    }
+  }
+  return NULL;
+}
+
+void profile_end(
+  ProfileStart start, const char* name, int layer, double flops,
+  double bytes
+) {
+  unsigned long long end = now_ns();
+  unsigned long allocations = thread_allocation_count() - start.allocations;
+  ProfileThread* table = own_table();
+  if (!table) {
+    return;
+  }
+  pthread_mutex_lock(&table->lock);
+  ProfileRegion* region = find_region(table, name, layer);
+  if (region) {
+    region->calls++;
+    region->ns += end - start.ns;
+    region->flops += flops;
+    region->bytes += bytes;
+    region->allocations += allocations;
+  } else {
+    table->dropped_regions++;
+  }
+  // the thread's oldest events are overwritten once its buffer is full
+  ProfileEvent* event = &table->events[table->num_events % PROFILE_MAX_EVENTS];
+  event->name = name;
+  event->layer = layer;
+  event->thread = table->id;
+  event->start_ns = start.ns;
+  event->duration_ns = end - start.ns;
+  event->flops = flops;
+  event->bytes = bytes;
+  table->num_events++;
+  pthread_mutex_unlock(&table->lock);
+}
+
+void profile_reset() {
+  pthread_mutex_lock(&tables_lock);
+  for (ProfileThread* table = thread_tables; table; table = table->next) {
+    pthread_mutex_lock(&table->lock);
+    table->num_regions = 0;
+    table->dropped_regions = 0;
+    memset(table->region_slots, 0, sizeof(table->region_slots));
+    table->num_events = 0;
+    pthread_mutex_unlock(&table->lock);
+  }
+  pthread_mutex_unlock(&tables_lock);
+}
+
+void profile_write_json(FILE* file) {
+  // every thread's regions merged by name and layer, in the order they
+  // first appear
+  static ProfileRegion merged[PROFILE_MAX_REGIONS];
+  unsigned int num_merged = 0;
+  unsigned long dropped_regions = 0;
+  unsigned long long num_events = 0;
+  pthread_mutex_lock(&tables_lock);
+  for (ProfileThread* table = thread_tables; table; table = table->next) {
+    pthread_mutex_lock(&table->lock);
+    for (unsigned int r = 0; r < table->num_regions; r++) {
+      ProfileRegion* region = &table->regions[r];
+      unsigned int m = 0;
+      while (m < num_merged && (merged[m].name != region->name
+        || merged[m].layer != region->layer)) {
+        m++;
+      }
+      if (m == num_merged) {
+        if (num_merged == PROFILE_MAX_REGIONS) {
+          dropped_regions += region->calls;
+          continue;
+        }
+        merged[num_merged++] = *region;
+        continue;
+      }
+      merged[m].calls += region->calls;
+      merged[m].ns += region->ns;
+      merged[m].flops += region->flops;
+      merged[m].bytes += region->bytes;
+      merged[m].allocations += region->allocations;
+    }
+    dropped_regions += table->dropped_regions;
+    num_events += table->num_events;
+    pthread_mutex_unlock(&table->lock);
+  }
+  pthread_mutex_unlock(&tables_lock);
+  fprintf(file, "{\"regions\": [");
+  for (unsigned int r = 0; r < num_merged; r++) {
+    ProfileRegion* region = &merged[r];
+    double ns = region->ns ? (double)region->ns : 1;
+    fprintf(file, "%s\n  {\"name\": \"%s\", \"layer\": %d, \"calls\": %lu, "
+    "\"total_ns\": %llu, \"mean_ns\": %.1f, \"flops\": %.0f, "
+    "\"bytes\": %.0f, \"gflops\": %.3f, \"gbytes_per_sec\": %.3f, "
+    "\"allocations\": %lu}",
+    r ? "," : "", region->name, region->layer, region->calls, region->ns,
+    (double)region->ns / region->calls, region->flops, region->bytes,
+    region->flops / ns, region->bytes / ns, region->allocations);
+  }
+  fprintf(file, "\n], \"dropped_regions\": %lu, \"events\": %llu}\n",
+  dropped_regions, num_events);
+}
+
+static void kept_events(
+  ProfileThread* table, unsigned long long* first, unsigned long long* count
+) {
+  *count = table->num_events;
+  *first = 0;
+  if (*count > PROFILE_MAX_EVENTS) {
+    *first = *count - PROFILE_MAX_EVENTS;
+  }
+}
+
+void profile_write_trace(FILE* file) {
+  // complete ("X") events of every thread in microseconds since the
+  // earliest one kept
+  pthread_mutex_lock(&tables_lock);
+  unsigned long long epoch_ns = ~0ULL;
+  for (ProfileThread* table = thread_tables; table; table = table->next) {
+    pthread_mutex_lock(&table->lock);
+    unsigned long long first, count;
+    kept_events(table, &first, &count);
+    for (unsigned long long e = first; e < count; e++) {
+      if (table->events[e % PROFILE_MAX_EVENTS].start_ns < epoch_ns) {
+        epoch_ns = table->events[e % PROFILE_MAX_EVENTS].start_ns;
+      }
+    }
+    pthread_mutex_unlock(&table->lock);
+  }
+  int pid = (int)getpid();
+  unsigned int written = 0;
+  fprintf(file, "{\"traceEvents\": [");
+  for (ProfileThread* table = thread_tables; table; table = table->next) {
+    pthread_mutex_lock(&table->lock);
+    unsigned long long first, count;
+    kept_events(table, &first, &count);
+    for (unsigned long long e = first; e < count; e++) {
+      ProfileEvent* event = &table->events[e % PROFILE_MAX_EVENTS];
+      char name[64];
+      if (event->layer >= 0) {
+        snprintf(name, sizeof(name), "%s %d", event->name, event->layer);
+      } else {
+        snprintf(name, sizeof(name), "%s", event->name);
+      }
+      fprintf(file, "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", "
+      "\"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, "
+      "\"tid\": %u, \"args\": {\"flops\": %.0f, \"bytes\": %.0f}}",
+      written++ ? "," : "", name, event->layer >= 0 ? "layer" : "kernel",
+      (event->start_ns - epoch_ns) / 1e3, event->duration_ns / 1e3, pid,
+      event->thread, event->flops, event->bytes);
+    }
+    pthread_mutex_unlock(&table->lock);
+  }
+  fprintf(file, "\n], \"displayTimeUnit\": \"ns\"}\n");
+  pthread_mutex_unlock(&tables_lock);
+}
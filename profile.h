@@ -0,0 +1,61 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "precision.h"
+
+// hot path instrumentation, compiled in with -DENABLE_PROFILING (make
+// PROFILE=1) and to nothing otherwise
+//
+// every region records calls, wall time, FLOPs, bytes moved and the heap
+// allocations of the recording thread, keyed by name and layer (-1 for
+// matrix kernels); the most recent PROFILE_MAX_EVENTS calls of each thread
+// are also kept for a Chrome trace. Each thread records into a table of
+// its own, so recording threads never wait for each other, and the tables
+// are merged when written out; a thread that exits hands its table, and
+// its trace thread id, on to the next thread that records
+//
+//   PROFILE_START(start);
+//   ... work ...
+//   PROFILE_END(start, "gemm", -1, flops, bytes);
+//
+// the flops and bytes arguments are only evaluated when profiling
+
+#define PROFILE_MAX_REGIONS 256
+#define PROFILE_MAX_EVENTS 16384
+
+typedef struct ProfileStart {
+  unsigned long long ns;
+  unsigned long allocations;
+} ProfileStart;
+
+ProfileStart profile_start();
+
+void profile_end(
+  ProfileStart start, const char* name, int layer, double flops,
+  double bytes
+);
+
+// bytes moved by n elements
+#define PROFILE_BYTES(n) ((double)(n) * sizeof(real))
+
+#ifdef ENABLE_PROFILING
+#define PROFILE_START(start) ProfileStart start = profile_start()
+#define PROFILE_END(start, name, layer, flops, bytes) \
+  profile_end(start, name, layer, flops, bytes)
+#else
+#define PROFILE_START(start)
+#define PROFILE_END(start, name, layer, flops, bytes)
+#endif
+
+// forgets every region and event recorded so far
+void profile_reset();
+
+// totals per region as one JSON object
+void profile_write_json(FILE* file);
+
+// the recorded events in Chrome trace event format, for chrome://tracing
+// or Perfetto
+void profile_write_trace(FILE* file);
+
+#endif
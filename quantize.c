@@ -0,0 +1,304 @@
+#include "quantize.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include "profile.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// rows requantized together, so their pre-activations are still in cache
+// for the atan and the rounding
+#define QUANTIZE_TILE 64
+// largest magnitude of a quantized value, symmetric so zero is exact
+#define QUANTIZE_LEVELS 127
+
+static int8_t* create_int8_data(size_t count) {
+  // zeroed and aligned like create_aligned_data()
+  return (int8_t*)create_aligned_data(
+    (count + sizeof(real) - 1) / sizeof(real)
+  );
+}
+
+static double scale_for(double largest) {
+  // value of one quantization step when largest must be representable
+  return largest > 0 ? largest / QUANTIZE_LEVELS : 1;
+}
+
+static int8_t quantize_value(double value, double inverse_scale) {
+  double q = nearbyint(value * inverse_scale);
+  if (q > QUANTIZE_LEVELS) q = QUANTIZE_LEVELS;
+  if (q < -QUANTIZE_LEVELS) q = -QUANTIZE_LEVELS;
+  return (int8_t)q;
+}
+
+static void calibrate(
+  Network* net, double* samples, unsigned int count, double* largest
+) {
+  // largest[l] is the largest magnitude of any input of layer l over the
+  // samples, taken batch by batch through forward_pass()
+  unsigned int batch_size = net->batch_size;
+  unsigned int inputs = net->num_nodes[0];
+  unsigned int outputs = net->num_nodes[net->num_layers-1];
+  double* batch = (double*)malloc(sizeof(double) * inputs * batch_size);
+  double* targets = (double*)calloc(outputs * batch_size, sizeof(double));
+  for (unsigned int l = 0; l < net->num_layers; l++) {
+    largest[l] = 0;
+  }
+  for (unsigned int first = 0; first < count; first += batch_size) {
+    // one column per sample, a short last batch repeats its last sample
+    for (unsigned int b = 0; b < batch_size; b++) {
+      unsigned int s = first + b < count ? first + b : count - 1;
+      for (unsigned int r = 0; r < inputs; r++) {
+        batch[(size_t)r * batch_size + b] = samples[(size_t)s * inputs + r];
+      }
+    }
+    forward_pass(net, batch, targets);
+    for (unsigned int l = 0; l + 1 < net->num_layers; l++) {
+      Matrix* input = net->layers[l].input;
+      for (unsigned int r = 0; r < input->rows; r++) {
+        real* row = get_row_data(input, r);
+        for (unsigned int c = 0; c < input->columns; c++) {
+          if (fabs(row[c]) > largest[l]) {
+            largest[l] = fabs(row[c]);
+          }
+        }
+      }
+    }
+  }
+  free(batch);
+  free(targets);
+}
+
+static void quantize_layer(
+  QuantizedLayer* quantized, Layer* layer, double input_scale
+) {
+  // symmetric per row weights, with the input scale folded into the
+  // scale each row's int32 sum is multiplied by
+  Matrix* weights = layer->weights;
+  quantized->rows = layer->biases->rows;
+  quantized->columns = weights ? weights->columns : quantized->rows;
+  quantized->stride = 0;
+  quantized->weights = NULL;
+  quantized->output_scales = NULL;
+  quantized->input_scale = input_scale;
+  quantized->biases = create_aligned_data(quantized->rows);
+  for (unsigned int i = 0; i < quantized->rows; i++) {
+    quantized->biases[i] = get_element(layer->biases, i, 0);
+  }
+  if (!weights) {
+    return;
+  }
+  quantized->stride = (
+    (quantized->columns + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT
+    * MATRIX_ALIGNMENT
+  );
+  quantized->weights = create_int8_data(
+    (size_t)quantized->rows * quantized->stride
+  );
+  quantized->output_scales = create_aligned_data(quantized->rows);
+  for (unsigned int i = 0; i < quantized->rows; i++) {
+    real* row = get_row_data(weights, i);
+    double largest = 0;
+    for (unsigned int j = 0; j < quantized->columns; j++) {
+      if (fabs(row[j]) > largest) {
+        largest = fabs(row[j]);
+      }
+    }
+    double scale = scale_for(largest);
+    int8_t* out = quantized->weights + (size_t)i * quantized->stride;
+    for (unsigned int j = 0; j < quantized->columns; j++) {
+      out[j] = quantize_value(row[j], 1 / scale);
+    }
+    quantized->output_scales[i] = scale * input_scale;
+  }
+}
+
+static size_t layer_bytes(QuantizedLayer* layer) {
+  size_t bytes = sizeof(real) * layer->rows;
+  if (layer->weights) {
+    bytes += (size_t)layer->rows * layer->stride + sizeof(real) * layer->rows;
+  }
+  return bytes;
+}
+
+void initialise_quantized_network(
+  QuantizedNetwork* quantized, Network* net, double* samples,
+  unsigned int count, unsigned int clearNetwork
+) {
+  if (clearNetwork) {
+    for (unsigned int l = 0; l < quantized->num_layers; l++) {
+      QuantizedLayer* layer = &quantized->layers[l];
+      free(layer->weights);
+      free(layer->output_scales);
+      free(layer->biases);
+    }
+    free(quantized->layers);
+    free(quantized->inputs[0]);
+    free(quantized->activations);
+    return;
+  }
+  if (net->inference_only) {
+    printf("Error: Quantize: network was not created for training\n");
+    exit(1);
+  } else if (net->checkpoint_interval > 1) {
+    printf("Error: Quantize: network keeps only checkpointed activations\n");
+    exit(1);
+  } else if (count == 0) {
+    printf("Error: Quantize: no calibration samples\n");
+    exit(1);
+  }
+  quantized->num_layers = net->num_layers;
+  quantized->num_nodes = net->num_nodes;
+  quantized->layers = (QuantizedLayer*)calloc(
+    net->num_layers, sizeof(QuantizedLayer)
+  );
+  double* largest = (double*)calloc(net->num_layers, sizeof(double));
+  calibrate(net, samples, count, largest);
+  quantized->model_bytes = 0;
+  unsigned int widest = 0;
+  for (unsigned int l = 0; l < net->num_layers; l++) {
+    quantize_layer(
+      &quantized->layers[l], &net->layers[l], scale_for(largest[l])
+    );
+    quantized->model_bytes += layer_bytes(&quantized->layers[l]);
+    if (net->num_nodes[l] > widest) {
+      widest = net->num_nodes[l];
+    }
+  }
+  free(largest);
+  // each quantized input padded to whole blocks like a weight row
+  size_t padded = (
+    (widest + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT
+  );
+  quantized->inputs[0] = create_int8_data(2 * padded);
+  quantized->inputs[1] = quantized->inputs[0] + padded;
+  quantized->activations = create_aligned_data(widest);
+}
+
+typedef struct QuantizedTask {
+  QuantizedLayer* layer;
+  const int8_t* input;
+  real* activations;
+  // the next layer's quantized input, NULL for the last hidden layer
+  int8_t* next_input;
+  double next_inverse_scale;
+} QuantizedTask;
+
+static void quantized_rows(
+  void* context, unsigned int begin, unsigned int end
+) {
+  // begin and end count tiles of QUANTIZE_TILE rows
+  QuantizedTask* task = (QuantizedTask*)context;
+  QuantizedLayer* layer = task->layer;
+  unsigned int r_end = end * QUANTIZE_TILE;
+  if (r_end > layer->rows) r_end = layer->rows;
+  for (unsigned int r0 = begin * QUANTIZE_TILE; r0 < r_end;
+    r0 += QUANTIZE_TILE) {
+    unsigned int r1 = r0 + QUANTIZE_TILE < r_end ? r0 + QUANTIZE_TILE : r_end;
+    real* out = task->activations;
+    // the padding of a weight row is zero, so whole padded rows are summed
+    for (unsigned int i = r0; i < r1; i++) {
+      int32_t sum = vector_dot_int8(
+        layer->weights + (size_t)i * layer->stride, task->input,
+        layer->stride
+      );
+      out[i] = sum * layer->output_scales[i] + layer->biases[i];
+    }
+    vector_atan(out + r0, out + r0, r1 - r0);
+    if (task->next_input) {
+      for (unsigned int i = r0; i < r1; i++) {
+        task->next_input[i] = quantize_value(out[i], task->next_inverse_scale);
+      }
+    }
+  }
+}
+
+void quantized_predict(
+  QuantizedNetwork* quantized, double* input, double* output
+) {
+  unsigned int last = quantized->num_layers - 1;
+  int8_t* current = quantized->inputs[0];
+  int8_t* next = quantized->inputs[1];
+  double inverse_scale = 1 / quantized->layers[0].input_scale;
+  for (unsigned int j = 0; j < quantized->num_nodes[0]; j++) {
+    current[j] = quantize_value(input[j], inverse_scale);
+  }
+  for (unsigned int l = 0; l < last; l++) {
+    QuantizedLayer* layer = &quantized->layers[l];
+    PROFILE_START(start);
+    QuantizedTask task = {
+      layer, current, quantized->activations,
+      l + 1 < last ? next : NULL,
+      1 / quantized->layers[l+1].input_scale
+    };
+    unsigned int tiles = (layer->rows + QUANTIZE_TILE - 1) / QUANTIZE_TILE;
+    parallel_for(
+      tiles, parallel_grain((size_t)QUANTIZE_TILE * layer->stride),
+      quantized_rows, &task
+    );
+    // int8 multiply-adds, the rescale and bias; weights are single bytes
+    PROFILE_END(start, "quantized_predict", l,
+      (2.0 * layer->columns + 2) * layer->rows,
+      (double)layer->rows * layer->stride + layer->columns
+      + PROFILE_BYTES(3.0 * layer->rows));
+    int8_t* swap = current;
+    current = next;
+    next = swap;
+  }
+  // the output layer adds its biases to the last activations unquantized
+  QuantizedLayer* output_layer = &quantized->layers[last];
+  real* activations = quantized->activations;
+  for (unsigned int i = 0; i < output_layer->rows; i++) {
+    activations[i] += output_layer->biases[i];
+  }
+  vector_atan(activations, activations, output_layer->rows);
+  for (unsigned int i = 0; i < output_layer->rows; i++) {
+    output[i] = activations[i];
+  }
+}
+
+void quantization_report(
+  QuantizedNetwork* quantized, Network* net, double* samples,
+  unsigned int count, QuantizationReport* report
+) {
+  unsigned int inputs = net->num_nodes[0];
+  unsigned int outputs = net->num_nodes[net->num_layers-1];
+  double* expected = (double*)malloc(sizeof(double) * outputs);
+  double* actual = (double*)malloc(sizeof(double) * outputs);
+  double total_error = 0;
+  unsigned int agreed = 0;
+  report->samples = count;
+  report->max_error = 0;
+  for (unsigned int s = 0; s < count; s++) {
+    predict(net, samples + (size_t)s * inputs, expected);
+    quantized_predict(quantized, samples + (size_t)s * inputs, actual);
+    unsigned int expected_best = 0;
+    unsigned int actual_best = 0;
+    for (unsigned int i = 0; i < outputs; i++) {
+      double error = fabs(actual[i] - expected[i]);
+      total_error += error;
+      if (error > report->max_error) {
+        report->max_error = error;
+      }
+      if (expected[i] > expected[expected_best]) expected_best = i;
+      if (actual[i] > actual[actual_best]) actual_best = i;
+    }
+    agreed += expected_best == actual_best;
+  }
+  report->mean_error = count ? total_error / ((double)count * outputs) : 0;
+  report->argmax_agreement = count ? (double)agreed / count : 0;
+  report->float_bytes = sizeof(real) * net->num_parameters;
+  report->quantized_bytes = quantized->model_bytes;
+  free(expected);
+  free(actual);
+}
+
+void print_quantization_report(QuantizationReport* report) {
+  printf("Quantized over %u samples: max error %g, mean error %g, "
+  "argmax agreement %.2f%%\n",
+  report->samples, report->max_error, report->mean_error,
+  100 * report->argmax_agreement);
+  printf("Model size: %zu bytes unquantized, %zu bytes int8 (%.1fx smaller)\n",
+  report->float_bytes, report->quantized_bytes,
+  (double)report->float_bytes / report->quantized_bytes);
+}
@@ -0,0 +1,76 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdint.h>
+#include "network.h"
+
+// post-training int8 quantization for serving
+//
+// the weights of every layer are stored as int8 with one scale per row,
+// and each layer's input is quantized with a single scale calibrated from
+// sample inputs run through forward_pass(). A layer is then int8 dot
+// products accumulated in int32, followed by one requantize step per
+// tile of rows: rescale, add the bias, atan and round to the next layer's
+// int8 input. The output layer only adds its biases, so it takes the last
+// hidden layer's activations unquantized.
+
+typedef struct QuantizedLayer {
+  // rows x stride weights, each row padded to MATRIX_ALIGNMENT bytes
+  int8_t* weights;
+  unsigned int rows;
+  unsigned int columns;
+  unsigned int stride;
+  // weight scale of each row times input_scale, what an int32 sum is
+  // multiplied by to give the pre-activation without the bias
+  real* output_scales;
+  real* biases;
+  // value of one step of the quantized input
+  real input_scale;
+} QuantizedLayer;
+
+typedef struct QuantizedNetwork {
+  unsigned int num_layers;
+  unsigned int* num_nodes;
+  QuantizedLayer* layers;
+  // quantized inputs a layer reads from and writes the next one's to,
+  // and the activations of the layer being computed
+  int8_t* inputs[2];
+  real* activations;
+  // bytes of weights, scales and biases
+  size_t model_bytes;
+} QuantizedNetwork;
+
+typedef struct QuantizationReport {
+  unsigned int samples;
+  // output differences from predict() with the unquantized network
+  double max_error;
+  double mean_error;
+  // samples whose largest output is the same node in both
+  double argmax_agreement;
+  size_t float_bytes;
+  size_t quantized_bytes;
+} QuantizationReport;
+
+// quantizes a trained network with the largest activation each layer
+// sees over count samples of num_nodes[0] inputs, one after another;
+// net must have been created for training, keeping every activation, so
+// forward_pass() can run, and is left with the last calibration batch in it
+void initialise_quantized_network(
+  QuantizedNetwork* quantized, Network* net, double* samples,
+  unsigned int count, unsigned int clearNetwork
+);
+
+void quantized_predict(
+  QuantizedNetwork* quantized, double* input, double* output
+);
+
+// compares quantized_predict() with predict() over count samples laid
+// out like the calibration samples
+void quantization_report(
+  QuantizedNetwork* quantized, Network* net, double* samples,
+  unsigned int count, QuantizationReport* report
+);
+
+void print_quantization_report(QuantizationReport* report);
+
+#endif
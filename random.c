@@ -0,0 +1,174 @@
+#include "random.h"
+#include "threadpool.h"
+#include "profile.h"
+#include "kernels.h"
+
+// Philox4x32 multipliers and the Weyl sequence the key is bumped by
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+// counter blocks generated side by side, each round is one pass over the
+// lanes so the compiler can keep them in vector registers
+#define PHILOX_LANES 16
+// values per item of a parallel fill, a whole number of blocks so no
+// block is generated by two items
+#define RANDOM_CHUNK 4096
+// rough operations per normal, for sizing the parallel chunks
+#define RANDOM_COST 64
+
+void philox4x32(
+  const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]
+) {
+  uint32_t c0 = counter[0], c1 = counter[1];
+  uint32_t c2 = counter[2], c3 = counter[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (unsigned int round = 0; round < PHILOX_ROUNDS; round++) {
+    uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+    uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+    c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+    c1 = (uint32_t)p1;
+    c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+    c3 = (uint32_t)p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+static void philox_lanes(
+  unsigned long long first_block, unsigned long long seed,
+  uint32_t words[4][PHILOX_LANES]
+) {
+  // philox4x32() of the counters first_block, first_block + 1, ... with
+  // the seed as the key, word w of block i in words[w][i]
+  uint32_t* c0 = words[0];
+  uint32_t* c1 = words[1];
+  uint32_t* c2 = words[2];
+  uint32_t* c3 = words[3];
+  uint32_t k0 = (uint32_t)seed;
+  uint32_t k1 = (uint32_t)(seed >> 32);
+  for (unsigned int i = 0; i < PHILOX_LANES; i++) {
+    c0[i] = (uint32_t)(first_block + i);
+    c1[i] = (uint32_t)((first_block + i) >> 32);
+    c2[i] = 0;
+    c3[i] = 0;
+  }
+  for (unsigned int round = 0; round < PHILOX_ROUNDS; round++) {
+    for (unsigned int i = 0; i < PHILOX_LANES; i++) {
+      uint64_t p0 = (uint64_t)PHILOX_M0 * c0[i];
+      uint64_t p1 = (uint64_t)PHILOX_M1 * c2[i];
+      c0[i] = (uint32_t)(p1 >> 32) ^ c1[i] ^ k0;
+      c1[i] = (uint32_t)p1;
+      c2[i] = (uint32_t)(p0 >> 32) ^ c3[i] ^ k1;
+      c3[i] = (uint32_t)p0;
+    }
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+}
+
+static double uniform(uint32_t word) {
+  // (0, 1), never 0 so its log is finite
+  return (word + 0.5) * (1.0 / 4294967296.0);
+}
+
+static void fill_range(
+  real* out, size_t n, unsigned long long seed, unsigned long long offset
+) {
+  // position p is word p % 4 of block p / 4; words 0 and 1 of a block
+  // give one pair of normals and words 2 and 3 the other. The transform
+  // runs on every lane at once, pair 0 of each block then pair 1
+  uint32_t words[4][PHILOX_LANES];
+  real u1[2 * PHILOX_LANES];
+  real u2[2 * PHILOX_LANES];
+  real cosines[2 * PHILOX_LANES];
+  real sines[2 * PHILOX_LANES];
+  size_t done = 0;
+  while (done < n) {
+    unsigned long long position = offset + done;
+    unsigned int skip = position % 4;
+    size_t take = 4 * PHILOX_LANES - skip;
+    if (take > n - done) {
+      take = n - done;
+    }
+    philox_lanes(position / 4, seed, words);
+    for (unsigned int pair = 0; pair < 2; pair++) {
+      for (unsigned int i = 0; i < PHILOX_LANES; i++) {
+        u1[pair * PHILOX_LANES + i] = uniform(words[2 * pair][i]);
+        u2[pair * PHILOX_LANES + i] = uniform(words[2 * pair + 1][i]);
+      }
+    }
+    vector_box_muller(u1, u2, cosines, sines, 2 * PHILOX_LANES);
+    for (size_t j = 0; j < take; j++) {
+      // normal skip + j is the cos or sin of pair (skip + j) % 4 / 2 of
+      // block (skip + j) / 4
+      size_t k = skip + j;
+      size_t lane = (k % 4 / 2) * PHILOX_LANES + k / 4;
+      out[done + j] = (k % 2) ? sines[lane] : cosines[lane];
+    }
+    done += take;
+  }
+}
+
+typedef struct FillTask {
+  real* out;
+  size_t n;
+  unsigned long long seed;
+  unsigned long long offset;
+  // rows of a strided matrix when set, chunks of out otherwise
+  Matrix* mat;
+} FillTask;
+
+static void fill_chunks(void* context, unsigned int begin, unsigned int end) {
+  FillTask* task = (FillTask*)context;
+  for (unsigned int item = begin; item < end; item++) {
+    if (task->mat) {
+      Matrix* mat = task->mat;
+      fill_range(
+        get_row_data(mat, item), mat->columns, task->seed,
+        task->offset + (unsigned long long)item * mat->columns
+      );
+    } else {
+      size_t first = (size_t)item * RANDOM_CHUNK;
+      size_t count = task->n - first;
+      if (count > RANDOM_CHUNK) count = RANDOM_CHUNK;
+      fill_range(task->out + first, count, task->seed, task->offset + first);
+    }
+  }
+}
+
+void random_normal_fill(
+  real* out, size_t n, unsigned long long seed, unsigned long long offset
+) {
+  PROFILE_START(start);
+  FillTask task = {out, n, seed, offset, NULL};
+  parallel_for(
+    (n + RANDOM_CHUNK - 1) / RANDOM_CHUNK,
+    parallel_grain((size_t)RANDOM_CHUNK * RANDOM_COST), fill_chunks, &task
+  );
+  PROFILE_END(start, "random_normal", -1, 0, PROFILE_BYTES(n));
+}
+
+void random_normal_matrix(
+  Matrix* mat, unsigned long long seed, unsigned long long offset
+) {
+  if (mat->stride == mat->columns || mat->rows == 1) {
+    random_normal_fill(
+      mat->matrix_data, (size_t)mat->rows * mat->columns, seed, offset
+    );
+    return;
+  }
+  PROFILE_START(start);
+  FillTask task = {NULL, 0, seed, offset, mat};
+  parallel_for(
+    mat->rows, parallel_grain((size_t)mat->columns * RANDOM_COST),
+    fill_chunks, &task
+  );
+  PROFILE_END(start, "random_normal", -1, 0,
+    PROFILE_BYTES((double)mat->rows * mat->columns));
+}
@@ -0,0 +1,32 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+#include "matrices.h"
+
+// counter-based random numbers for filling parameters
+//
+// Philox4x32-10 turns a 128 bit counter and a 64 bit key into four random
+// 32 bit words with no state in between, so value p of a seed's stream is
+// computed from p alone: any range can be filled by any thread and the
+// result never depends on how the work was split. Normals come from the
+// Box-Muller transform, which uses both normals of every pair of
+// uniforms.
+
+void philox4x32(
+  const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]
+);
+
+// out[i] is the standard normal at position offset + i of seed's stream,
+// filled in parallel
+void random_normal_fill(
+  real* out, size_t n, unsigned long long seed, unsigned long long offset
+);
+
+// element (r, c) gets position offset + r * columns + c, so the padding
+// of the rows is left alone and takes no positions
+void random_normal_matrix(
+  Matrix* mat, unsigned long long seed, unsigned long long offset
+);
+
+#endif
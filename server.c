@@ -0,0 +1,250 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static unsigned long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void server_error(const char* message) {
+  printf("Error: Inference server: %s\n", message);
+  exit(1);
+}
+
+static unsigned int take_batch(
+  InferenceServer* server, InferenceRequest** batch
+) {
+  // waits for work, then for a full batch or the oldest request's
+  // deadline, and dequeues up to max_batch requests; 0 once stopped with
+  // nothing left
+  pthread_mutex_lock(&server->lock);
+  for (;;) {
+    while (!server->head && !server->stop) {
+      pthread_cond_wait(&server->queued, &server->lock);
+    }
+    if (!server->head || !server->max_delay_ns || server->stop
+      || server->queue_length >= server->max_batch) {
+      break;
+    }
+    // another worker may take the queue meanwhile, then the deadline is
+    // the new oldest request's
+    unsigned long long deadline = (
+      server->head->submitted_ns + server->max_delay_ns
+    );
+    if (now_ns() >= deadline) {
+      break;
+    }
+    struct timespec until;
+    until.tv_sec = deadline / 1000000000ULL;
+    until.tv_nsec = deadline % 1000000000ULL;
+    pthread_cond_timedwait(&server->queued, &server->lock, &until);
+  }
+  unsigned int count = 0;
+  while (server->head && count < server->max_batch) {
+    batch[count++] = server->head;
+    server->head = server->head->next;
+  }
+  if (!server->head) {
+    server->tail = NULL;
+  }
+  server->queue_length -= count;
+  if (count) {
+    server->requests += count;
+    server->batches++;
+  }
+  // whatever is left is for the next idle worker
+  if (server->head) {
+    pthread_cond_signal(&server->queued);
+  }
+  pthread_mutex_unlock(&server->lock);
+  return count;
+}
+
+static void* serve(void* context) {
+  InferenceWorker* worker = (InferenceWorker*)context;
+  InferenceServer* server = worker->server;
+  Network* net = server->net;
+  unsigned int inputs = net->num_nodes[0];
+  unsigned int outputs = net->num_nodes[net->num_layers-1];
+  for (;;) {
+    unsigned int count = take_batch(server, worker->batch);
+    if (!count) {
+      return NULL;
+    }
+    for (unsigned int s = 0; s < count; s++) {
+      double* input = worker->batch[s]->input;
+      for (unsigned int i = 0; i < inputs; i++) {
+        worker->inputs[(size_t)s * inputs + i] = input[i];
+      }
+    }
+    if (server->model) {
+      Network* version = model_acquire(server->model, worker->reader);
+      predict_batch(
+        version, &worker->scratch, worker->inputs, worker->outputs, count
+      );
+      model_release(server->model, worker->reader);
+    } else {
+      predict_batch(
+        net, &worker->scratch, worker->inputs, worker->outputs, count
+      );
+    }
+    for (unsigned int s = 0; s < count; s++) {
+      InferenceRequest* request = worker->batch[s];
+      for (unsigned int o = 0; o < outputs; o++) {
+        request->output[o] = worker->outputs[(size_t)s * outputs + o];
+      }
+      // a callback completes the request itself, and the request is not
+      // touched again once it has been called
+      if (request->callback) {
+        request->callback(request->callback_context, request->output);
+      } else {
+        sem_post(&request->done);
+      }
+    }
+  }
+}
+
+static void start_server(
+  InferenceServer* server, Network* net, ModelHandle* model,
+  unsigned int num_workers, unsigned int max_batch,
+  unsigned long long max_delay_ns
+) {
+  if (num_workers == 0 || max_batch == 0) {
+    server_error("needs at least one worker and a batch of one");
+  }
+  server->net = net;
+  server->model = model;
+  server->max_batch = max_batch;
+  server->max_delay_ns = max_delay_ns;
+  server->num_workers = num_workers;
+  server->head = NULL;
+  server->tail = NULL;
+  server->queue_length = 0;
+  server->stop = 0;
+  server->requests = 0;
+  server->batches = 0;
+  pthread_mutex_init(&server->lock, NULL);
+  // deadlines are on the monotonic clock, like the submission times
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&server->queued, &attributes);
+  pthread_condattr_destroy(&attributes);
+  unsigned int inputs = net->num_nodes[0];
+  unsigned int outputs = net->num_nodes[net->num_layers-1];
+  server->workers = (InferenceWorker*)calloc(
+    num_workers, sizeof(InferenceWorker)
+  );
+  for (unsigned int w = 0; w < num_workers; w++) {
+    InferenceWorker* worker = &server->workers[w];
+    worker->server = server;
+    if (model) {
+      worker->reader = register_model_reader(model);
+    }
+    initialise_predict_scratch(&worker->scratch, net, max_batch, 0);
+    worker->batch = (InferenceRequest**)calloc(
+      max_batch, sizeof(InferenceRequest*)
+    );
+    worker->inputs = (double*)calloc(
+      (size_t)max_batch * inputs, sizeof(double)
+    );
+    worker->outputs = (double*)calloc(
+      (size_t)max_batch * outputs, sizeof(double)
+    );
+    if (pthread_create(&worker->thread, NULL, serve, worker)) {
+      server_error("could not start a worker");
+    }
+  }
+}
+
+void start_inference_server(
+  InferenceServer* server, Network* net, unsigned int num_workers,
+  unsigned int max_batch, unsigned long long max_delay_ns
+) {
+  start_server(server, net, NULL, num_workers, max_batch, max_delay_ns);
+}
+
+void start_model_server(
+  InferenceServer* server, ModelHandle* model, unsigned int num_workers,
+  unsigned int max_batch, unsigned long long max_delay_ns
+) {
+  // every version has the layer sizes of the first
+  start_server(
+    server, &model->versions[0], model, num_workers, max_batch,
+    max_delay_ns
+  );
+}
+
+void stop_inference_server(InferenceServer* server) {
+  pthread_mutex_lock(&server->lock);
+  server->stop = 1;
+  pthread_cond_broadcast(&server->queued);
+  pthread_mutex_unlock(&server->lock);
+  for (unsigned int w = 0; w < server->num_workers; w++) {
+    InferenceWorker* worker = &server->workers[w];
+    pthread_join(worker->thread, NULL);
+    initialise_predict_scratch(&worker->scratch, server->net, 0, 1);
+    free(worker->batch);
+    free(worker->inputs);
+    free(worker->outputs);
+  }
+  free(server->workers);
+  pthread_cond_destroy(&server->queued);
+  pthread_mutex_destroy(&server->lock);
+}
+
+void initialise_inference_request(
+  InferenceRequest* request, unsigned int clearRequest
+) {
+  // the completion semaphore lives as long as the request; only requests
+  // without a callback post it, and waiting takes the count back to 0
+  if (clearRequest) {
+    sem_destroy(&request->done);
+    return;
+  }
+  sem_init(&request->done, 0, 0);
+}
+
+void inference_submit(
+  InferenceServer* server, InferenceRequest* request, double* input,
+  double* output, inference_callback callback, void* callback_context
+) {
+  request->input = input;
+  request->output = output;
+  request->callback = callback;
+  request->callback_context = callback_context;
+  request->next = NULL;
+  pthread_mutex_lock(&server->lock);
+  if (server->stop) {
+    pthread_mutex_unlock(&server->lock);
+    server_error("request submitted after the server stopped");
+  }
+  request->submitted_ns = now_ns();
+  if (server->tail) {
+    server->tail->next = request;
+  } else {
+    server->head = request;
+  }
+  server->tail = request;
+  server->queue_length++;
+  // a worker waiting for its batch to fill is woken too, to count again
+  if (server->queue_length == 1 || server->queue_length >= server->max_batch) {
+    pthread_cond_signal(&server->queued);
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+void inference_wait(InferenceRequest* request) {
+  while (sem_wait(&request->done)) {
+    // interrupted by a signal, wait again
+  }
+}
+
+int inference_ready(InferenceRequest* request) {
+  int value = 0;
+  sem_getvalue(&request->done, &value);
+  return value > 0;
+}
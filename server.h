@@ -0,0 +1,105 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include "network.h"
+#include "hotswap.h"
+
+// concurrent inference on one shared, read-only network
+//
+// callers submit single samples from any thread; a queue merges them into
+// micro-batches and worker threads, each with its own PredictScratch, run
+// every batch through predict_batch(). A worker takes whatever is queued
+// once there are max_batch requests or the oldest has waited max_delay_ns,
+// so a lone request is never held back longer than that and busy periods
+// get full batches. Completion is either a future to wait on or a
+// callback run on the worker. Requests are owned by the caller, so serving never
+// touches the heap. Served from a ModelHandle, every batch runs on the
+// version that is current when the batch starts, so a model published
+// meanwhile takes over from the next batch without pausing the workers.
+
+typedef void (*inference_callback)(void* context, double* output);
+
+typedef struct InferenceRequest {
+  double* input;
+  double* output;
+  inference_callback callback;
+  void* callback_context;
+  unsigned long long submitted_ns;
+  sem_t done;
+  struct InferenceRequest* next;
+} InferenceRequest;
+
+typedef struct InferenceWorker {
+  struct InferenceServer* server;
+  pthread_t thread;
+  PredictScratch scratch;
+  // the worker's slot in the model handle, if serving from one
+  unsigned int reader;
+  // the batch's requests and their samples one after another
+  InferenceRequest** batch;
+  double* inputs;
+  double* outputs;
+} InferenceWorker;
+
+typedef struct InferenceServer {
+  // the network served, or only its layer sizes when serving a handle
+  Network* net;
+  ModelHandle* model;
+  unsigned int max_batch;
+  unsigned long long max_delay_ns;
+  unsigned int num_workers;
+  InferenceWorker* workers;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  InferenceRequest* head;
+  InferenceRequest* tail;
+  unsigned int queue_length;
+  unsigned int stop;
+  // totals since the server started
+  unsigned long requests;
+  unsigned long batches;
+} InferenceServer;
+
+void start_inference_server(
+  InferenceServer* server, Network* net, unsigned int num_workers,
+  unsigned int max_batch, unsigned long long max_delay_ns
+);
+
+// serves whichever version of the model is current; the handle needs a
+// reader slot for each worker
+void start_model_server(
+  InferenceServer* server, ModelHandle* model, unsigned int num_workers,
+  unsigned int max_batch, unsigned long long max_delay_ns
+);
+
+// finishes every queued request, then stops the workers
+void stop_inference_server(InferenceServer* server);
+
+// a request is initialised once, reused for any number of submissions,
+// and cleared once it has completed for the last time
+void initialise_inference_request(
+  InferenceRequest* request, unsigned int clearRequest
+);
+
+// queues an initialised request for input, num_nodes[0] values that must
+// stay valid until the request completes with num_nodes[num_layers-1]
+// values in output; with a callback the request completes when it runs
+// on a worker thread, and from then on, the callback included, it may be
+// submitted again or cleared without waiting for it
+void inference_submit(
+  InferenceServer* server, InferenceRequest* request, double* input,
+  double* output, inference_callback callback, void* callback_context
+);
+
+// blocks until a request submitted without a callback has completed,
+// after which it may be reused; each such submission is waited for once
+// before the request is submitted again or cleared
+void inference_wait(InferenceRequest* request);
+
+// 1 once a request submitted without a callback has completed, without
+// blocking; it still needs inference_wait() before it is reused
+int inference_ready(InferenceRequest* request);
+
+#endif
@@ -0,0 +1,330 @@
+// generates topology.c, the forward pass, gradients and prediction of one
+// fixed topology with every size known to the compiler
+//
+//   specialize 784,128,10 > topology.c
+//
+// layer sizes, strides and loop bounds become constants, the shape
+// checks of the generic matrix functions are done once by
+// topology_matches(), and layers small enough are fully unrolled
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// the most layers and the widest layer a topology may have
+#define SPECIALIZE_MAX_LAYERS 64
+#define SPECIALIZE_MAX_NODES 65536
+// dot products this long or shorter are written out term by term, longer
+// ones become loops with constant bounds
+#define SPECIALIZE_UNROLL 16
+
+static unsigned int num_layers = 0;
+static unsigned int num_nodes[SPECIALIZE_MAX_LAYERS];
+
+static void specialize_error(const char* message, const char* topology) {
+  fprintf(stderr, "Error: Specialize: %s: %s\n", message, topology);
+  exit(1);
+}
+
+static void parse_topology(const char* topology) {
+  // comma separated layer sizes, input first
+  const char* p = topology;
+  while (*p) {
+    char* end;
+    unsigned long nodes = strtoul(p, &end, 10);
+    if (end == p || nodes == 0 || nodes > SPECIALIZE_MAX_NODES) {
+      specialize_error("layer sizes must be whole numbers from 1", topology);
+    }
+    if (num_layers == SPECIALIZE_MAX_LAYERS) {
+      specialize_error("too many layers", topology);
+    }
+    num_nodes[num_layers++] = (unsigned int)nodes;
+    p = end;
+    if (*p == ',') {
+      p++;
+    } else if (*p) {
+      specialize_error("expected a comma", topology);
+    }
+  }
+  if (num_layers < 2) {
+    specialize_error("needs at least an input and an output layer", topology);
+  }
+}
+
+static void emit_sum(
+  const char* first, const char* weight, unsigned int row_major,
+  unsigned int fixed, unsigned int l, const char* vector, unsigned int n
+) {
+  // first + weight[...] * vector[0] + ... written out, with the weights
+  // walked along row fixed (row_major) or down column fixed
+  printf("(accum)%s", first);
+  for (unsigned int k = 0; k < n; k++) {
+    if (row_major) {
+      printf("\n      + (accum)%s[%u * TOPOLOGY_STRIDE_%u + %u] * %s[%u]",
+      weight, fixed, l, k, vector, k);
+    } else {
+      printf("\n      + (accum)%s[%u * TOPOLOGY_STRIDE_%u + %u] * %s[%u]",
+      weight, k, l, fixed, vector, k);
+    }
+  }
+}
+
+static void emit_affine(unsigned int l, const char* x, const char* y) {
+  // y = weights * x + biases of layer l, pre-activation only
+  unsigned int in = num_nodes[l];
+  unsigned int out = num_nodes[l+1];
+  if (in <= SPECIALIZE_UNROLL) {
+    for (unsigned int i = 0; i < out; i++) {
+      char bias[32];
+      snprintf(bias, sizeof(bias), "b[%u]", i);
+      printf("    %s[%u] = ", y, i);
+      emit_sum(bias, "w", 1, i, l, x, in);
+      printf(";\n");
+    }
+  } else {
+    // four rows at a time and each sum in column order, as gemv does
+    unsigned int blocked = out / 4 * 4;
+    if (blocked) {
+      printf("    for (unsigned int i = 0; i < %u; i += 4) {\n", blocked);
+      printf("      const real* w0 = w + i * TOPOLOGY_STRIDE_%u;\n", l);
+      for (unsigned int r = 1; r < 4; r++) {
+        printf("      const real* w%u = w%u + TOPOLOGY_STRIDE_%u;\n",
+        r, r - 1, l);
+      }
+      printf("      accum sum0 = b[i], sum1 = b[i+1], sum2 = b[i+2],"
+      " sum3 = b[i+3];\n");
+      printf("      for (unsigned int j = 0; j < %u; j++) {\n", in);
+      printf("        accum xj = %s[j];\n", x);
+      for (unsigned int r = 0; r < 4; r++) {
+        printf("        sum%u += w%u[j] * xj;\n", r, r);
+      }
+      printf("      }\n");
+      for (unsigned int r = 0; r < 4; r++) {
+        printf("      %s[i+%u] = sum%u;\n", y, r, r);
+      }
+      printf("    }\n");
+    }
+    for (unsigned int i = blocked; i < out; i++) {
+      printf("    {\n");
+      printf("      accum sum = b[%u];\n", i);
+      printf("      for (unsigned int j = 0; j < %u; j++) {\n", in);
+      printf("        sum += w[%u * TOPOLOGY_STRIDE_%u + j] * (accum)%s[j];\n",
+      i, l, x);
+      printf("      }\n");
+      printf("      %s[%u] = sum;\n", y, i);
+      printf("    }\n");
+    }
+  }
+}
+
+static double forward_flops() {
+  // multiply-adds and biases of one sample, counted like forward_layers()
+  double flops = 0;
+  for (unsigned int l = 0; l < num_layers; l++) {
+    unsigned int out = l + 1 < num_layers ? num_nodes[l+1] : num_nodes[l];
+    flops += (2.0 * (l + 1 < num_layers ? num_nodes[l] : 0) + 1) * out;
+  }
+  return flops;
+}
+
+static double backward_flops() {
+  // weight gradient and transposed product of every trained hidden layer
+  double flops = 0;
+  for (unsigned int l = 1; l + 1 < num_layers; l++) {
+    flops += (l > 1 ? 4.0 : 2.0) * num_nodes[l] * num_nodes[l+1];
+  }
+  return flops;
+}
+
+static void emit_copy(const char* from, const char* to, unsigned int n) {
+  printf("  for (unsigned int i = 0; i < %u; i++) {\n", n);
+  printf("    %s[i] = %s[i];\n", to, from);
+  printf("  }\n");
+}
+
+static void emit_header(const char* topology) {
+  printf("// generated by specialize for %s, do not edit\n\n", topology);
+  printf("#include <math.h>\n");
+  printf("#include \"topology.h\"\n");
+  printf("#include \"kernels.h\"\n");
+  printf("#include \"profile.h\"\n\n");
+  printf("// padded_stride() as a constant expression\n");
+  printf("#define TOPOLOGY_BLOCK (MATRIX_ALIGNMENT / sizeof(real))\n");
+  printf("#define TOPOLOGY_STRIDE(n) ((n) <= 1 ? (n) \\\n");
+  printf("  : ((n) + TOPOLOGY_BLOCK - 1) / TOPOLOGY_BLOCK * TOPOLOGY_BLOCK)\n");
+  for (unsigned int l = 0; l + 1 < num_layers; l++) {
+    printf("#define TOPOLOGY_STRIDE_%u TOPOLOGY_STRIDE(%u)\n", l, num_nodes[l]);
+  }
+  printf("\nconst unsigned int topology_num_layers = %u;\n", num_layers);
+  printf("const unsigned int topology_num_nodes[] = {");
+  for (unsigned int l = 0; l < num_layers; l++) {
+    printf("%s%u", l ? ", " : "", num_nodes[l]);
+  }
+  printf("};\n\n");
+}
+
+static void emit_matches() {
+  printf("int topology_matches(Network* net) {\n");
+  printf("  if (net->num_layers != %u) {\n    return 0;\n  }\n", num_layers);
+  for (unsigned int l = 0; l < num_layers; l++) {
+    printf("  if (net->num_nodes[%u] != %u) {\n    return 0;\n  }\n",
+    l, num_nodes[l]);
+  }
+  for (unsigned int l = 0; l + 1 < num_layers; l++) {
+    printf("  if (net->layers[%u].weights->stride != TOPOLOGY_STRIDE_%u) {\n"
+    "    return 0;\n  }\n", l, l);
+  }
+  printf("  return net->inference_only\n"
+  "    || (net->batch_size == 1 && net->checkpoint_interval <= 1);\n}\n\n");
+}
+
+static void emit_forward() {
+  unsigned int last = num_layers - 1;
+  unsigned int outputs = num_nodes[last];
+  printf("void topology_forward_pass(\n");
+  printf("  Network* net, double* input, double* target_output\n) {\n");
+  printf("  PROFILE_START(start);\n");
+  printf("  real* x = net->input->matrix_data;\n");
+  printf("  real* t = net->target_output->matrix_data;\n");
+  emit_copy("input", "x", num_nodes[0]);
+  emit_copy("target_output", "t", outputs);
+  for (unsigned int l = 0; l < last; l++) {
+    printf("  {\n");
+    printf("    // layer %u: %u -> %u\n", l, num_nodes[l], num_nodes[l+1]);
+    printf("    const real* w = net->layers[%u].weights->matrix_data;\n", l);
+    printf("    const real* b = net->layers[%u].biases->matrix_data;\n", l);
+    printf("    real* out = net->layers[%u].output->matrix_data;\n", l);
+    emit_affine(l, "x", "out");
+    printf("    vector_atan(out, out, %u);\n", num_nodes[l+1]);
+    printf("    x = out;\n");
+    printf("  }\n");
+  }
+  printf("  {\n");
+  printf("    // layer %u: output, biases only\n", last);
+  printf("    const real* b = net->layers[%u].biases->matrix_data;\n", last);
+  printf("    real* out = net->output->matrix_data;\n");
+  printf("    for (unsigned int i = 0; i < %u; i++) {\n", outputs);
+  printf("      out[i] = x[i] + b[i];\n");
+  printf("    }\n");
+  printf("    vector_atan(out, out, %u);\n", outputs);
+  printf("  }\n");
+  printf("  real* o = net->output->matrix_data;\n");
+  printf("  real* c = net->cost->matrix_data;\n");
+  printf("  for (unsigned int i = 0; i < %u; i++) {\n", outputs);
+  printf("    c[i] = fabs(t[i] - o[i]);\n");
+  printf("  }\n");
+  printf("  net->total_cost = vector_abs_sum(c, %u);\n", outputs);
+  printf("  PROFILE_END(start, \"topology_forward\", -1, %.0f, 0);\n}\n\n",
+  forward_flops());
+}
+
+static void emit_gradients() {
+  unsigned int last = num_layers - 1;
+  unsigned int outputs = num_nodes[last];
+  printf("void topology_compute_gradients(Network* net) {\n");
+  printf("  PROFILE_START(start);\n");
+  printf("  const real* t = net->target_output->matrix_data;\n");
+  printf("  const real* o = net->output->matrix_data;\n");
+  printf("  real* d = net->layers[%u].delta->matrix_data;\n", last);
+  printf("  real* bd = net->layers[%u].bias_delta->matrix_data;\n", last);
+  printf("  for (unsigned int i = 0; i < %u; i++) {\n", outputs);
+  printf("    d[i] = -(t[i] - o[i]);\n");
+  printf("    bd[i] = d[i];\n");
+  printf("  }\n");
+  printf("  if (net->gradient_ready) {\n");
+  printf("    net->gradient_ready(net->gradient_ready_context, %u);\n", last);
+  printf("  }\n");
+  printf("  // the output layer's delta is also the last hidden layer's\n");
+  for (unsigned int l = last - 1; l > 0; l--) {
+    unsigned int in = num_nodes[l];
+    unsigned int out = num_nodes[l+1];
+    printf("  {\n");
+    printf("    // layer %u: %u -> %u\n", l, in, out);
+    printf("    const real* p = net->layers[%u].output->matrix_data;\n", l-1);
+    printf("    real* wd = net->layers[%u].weight_delta->matrix_data;\n", l);
+    printf("    real* lbd = net->layers[%u].bias_delta->matrix_data;\n", l);
+    printf("    for (unsigned int i = 0; i < %u; i++) {\n", out);
+    printf("      for (unsigned int j = 0; j < %u; j++) {\n", in);
+    printf("        wd[i * TOPOLOGY_STRIDE_%u + j] = d[i] * p[j];\n", l);
+    printf("      }\n");
+    printf("      lbd[i] = d[i];\n");
+    printf("    }\n");
+    printf("    if (net->gradient_ready) {\n");
+    printf("      net->gradient_ready(net->gradient_ready_context, %u);\n", l);
+    printf("    }\n");
+    if (l > 1) {
+      // layer 0 is never trained, so its delta is not needed
+      printf("    const real* w = net->layers[%u].weights->matrix_data;\n", l);
+      printf("    real* next = net->layers[%u].delta->matrix_data;\n", l-1);
+      if (out <= SPECIALIZE_UNROLL) {
+        for (unsigned int j = 0; j < in; j++) {
+          printf("    next[%u] = ", j);
+          emit_sum("0", "w", 0, j, l, "d", out);
+          printf(";\n");
+        }
+      } else {
+        // whole rows of the weights at a time, in the generic order
+        printf("    accum sums[%u] = {0};\n", in);
+        printf("    for (unsigned int i = 0; i < %u; i++) {\n", out);
+        printf("      accum di = d[i];\n");
+        printf("      const real* row = w + i * TOPOLOGY_STRIDE_%u;\n", l);
+        printf("      for (unsigned int j = 0; j < %u; j++) {\n", in);
+        printf("        sums[j] += row[j] * di;\n");
+        printf("      }\n");
+        printf("    }\n");
+        printf("    for (unsigned int j = 0; j < %u; j++) {\n", in);
+        printf("      next[j] = sums[j];\n");
+        printf("    }\n");
+      }
+      printf("    for (unsigned int j = 0; j < %u; j++) {\n", in);
+      printf("      next[j] = (real)activation_derivative(p[j])"
+      " * next[j];\n");
+      printf("    }\n");
+      printf("    d = next;\n");
+    }
+    printf("  }\n");
+  }
+  printf("  PROFILE_END(start, \"topology_backward\", -1, %.0f, 0);\n}\n\n",
+  backward_flops());
+}
+
+static void emit_predict() {
+  unsigned int last = num_layers - 1;
+  printf("void topology_predict(Network* net, double* input, double* output)"
+  " {\n");
+  printf("  PROFILE_START(start);\n");
+  printf("  real* x = net->activations[0]->matrix_data;\n");
+  printf("  real* y = net->activations[1]->matrix_data;\n");
+  emit_copy("input", "x", num_nodes[0]);
+  for (unsigned int l = 0; l < last; l++) {
+    printf("  {\n");
+    printf("    // layer %u: %u -> %u\n", l, num_nodes[l], num_nodes[l+1]);
+    printf("    const real* w = net->layers[%u].weights->matrix_data;\n", l);
+    printf("    const real* b = net->layers[%u].biases->matrix_data;\n", l);
+    emit_affine(l, "x", "y");
+    printf("    vector_atan(y, y, %u);\n", num_nodes[l+1]);
+    printf("    real* swap = x;\n    x = y;\n    y = swap;\n");
+    printf("  }\n");
+  }
+  printf("  const real* b = net->layers[%u].biases->matrix_data;\n", last);
+  printf("  for (unsigned int i = 0; i < %u; i++) {\n", num_nodes[last]);
+  printf("    y[i] = x[i] + b[i];\n");
+  printf("  }\n");
+  printf("  vector_atan(y, y, %u);\n", num_nodes[last]);
+  emit_copy("y", "output", num_nodes[last]);
+  printf("  PROFILE_END(start, \"topology_predict\", -1, %.0f, 0);\n}\n",
+  forward_flops());
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s n0,n1,...\n", argv[0]);
+    return 1;
+  }
+  parse_topology(argv[1]);
+  emit_header(argv[1]);
+  emit_matches();
+  emit_forward();
+  emit_gradients();
+  emit_predict();
+  return 0;
+}
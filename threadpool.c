@@ -0,0 +1,273 @@
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+
+// each participant owns a range of the current job packed as
+// (end << 32) | begin, it takes chunks from the front while idle threads
+// steal the back half, both with compare and swap on the same word
+
+typedef struct WorkRange {
+  _Atomic uint64_t range;
+  // keep every range on its own cache line
+  char padding[64 - sizeof(uint64_t)];
+} WorkRange;
+
+typedef struct ThreadPool {
+  unsigned int requested_threads;
+  unsigned int num_threads;
+  unsigned int started;
+  pthread_t* threads;
+  WorkRange* ranges;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  // one job runs at a time, other callers run their work serially
+  pthread_mutex_t job_lock;
+  unsigned long generation;
+  unsigned int finished;
+  unsigned int shutdown;
+  parallel_task task;
+  void* context;
+  unsigned int grain;
+} ThreadPool;
+
+static ThreadPool pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .start = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+  .job_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static _Thread_local unsigned int in_parallel_task = 0;
+
+static uint64_t pack_range(unsigned int begin, unsigned int end) {
+  return ((uint64_t)end << 32) | begin;
+}
+
+static int take_chunk(
+  WorkRange* own, unsigned int grain, unsigned int* begin, unsigned int* end
+) {
+  uint64_t range = atomic_load(&own->range);
+  for (;;) {
+    unsigned int b = (unsigned int)range;
+    unsigned int e = (unsigned int)(range >> 32);
+    if (b >= e) {
+      return 0;
+    }
+    unsigned int next = (e - b > grain) ? b + grain : e;
+    if (atomic_compare_exchange_weak(
+      &own->range, &range, pack_range(next, e)
+    )) {
+      *begin = b;
+      *end = next;
+      return 1;
+    }
+  }
+}
+
+static int steal_range(unsigned int id) {
+  // move the back half of another participant's range into our own
+  for (unsigned int offset = 1; offset < pool.num_threads; offset++) {
+    WorkRange* victim = &pool.ranges[(id + offset) % pool.num_threads];
+    uint64_t range = atomic_load(&victim->range);
+    for (;;) {
+      unsigned int b = (unsigned int)range;
+      unsigned int e = (unsigned int)(range >> 32);
+      if (b >= e) {
+        break;
+      }
+      unsigned int middle = b + (e - b) / 2;
+      if (atomic_compare_exchange_weak(
+        &victim->range, &range, pack_range(b, middle)
+      )) {
+        atomic_store(&pool.ranges[id].range, pack_range(middle, e));
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void run_participant(
+  unsigned int id, parallel_task task, void* context, unsigned int grain
+) {
+  unsigned int begin, end;
+  in_parallel_task = 1;
+  for (;;) {
+    if (take_chunk(&pool.ranges[id], grain, &begin, &end)) {
+      task(context, begin, end);
+    } else if (!steal_range(id)) {
+      break;
+    }
+  }
+  in_parallel_task = 0;
+}
+
+static void* worker_main(void* arg) {
+  unsigned int id = (unsigned int)(uintptr_t)arg;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.generation == seen && !pool.shutdown) {
+      pthread_cond_wait(&pool.start, &pool.lock);
+    }
+    if (pool.shutdown) {
+      break;
+    }
+    seen = pool.generation;
+    parallel_task task = pool.task;
+    void* context = pool.context;
+    unsigned int grain = pool.grain;
+    pthread_mutex_unlock(&pool.lock);
+    run_participant(id, task, context, grain);
+    pthread_mutex_lock(&pool.lock);
+    pool.finished++;
+    if (pool.finished == pool.num_threads - 1) {
+      pthread_cond_signal(&pool.done);
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+static void stop_pool() {
+  if (!pool.started) {
+    return;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.shutdown = 1;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+  for (unsigned int t = 1; t < pool.num_threads; t++) {
+    pthread_join(pool.threads[t], NULL);
+  }
+  free(pool.threads);
+  free(pool.ranges);
+  pool.shutdown = 0;
+  pool.started = 0;
+}
+
+static void start_pool() {
+  unsigned int num_threads = pool.requested_threads;
+  if (num_threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = online > 0 ? (unsigned int)online : 1;
+  }
+  if (num_threads > MAX_THREADS) {
+    num_threads = MAX_THREADS;
+  }
+  pool.num_threads = num_threads;
+  pool.threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads);
+  pool.ranges = (WorkRange*)aligned_alloc(64, sizeof(WorkRange) * num_threads);
+  for (unsigned int t = 0; t < num_threads; t++) {
+    atomic_init(&pool.ranges[t].range, 0);
+  }
+  // thread 0 is whichever thread calls parallel_for
+  for (unsigned int t = 1; t < num_threads; t++) {
+    if (pthread_create(
+      &pool.threads[t], NULL, worker_main, (void*)(uintptr_t)t
+    )) {
+      printf("Error: Thread pool: could not start thread %d\n", t);
+      exit(1);
+    }
+  }
+  pool.started = 1;
+}
+
+static void prepare_fork() {
+  // no job is half way through when the process is copied
+  pthread_mutex_lock(&pool.job_lock);
+}
+
+static void parent_after_fork() {
+  pthread_mutex_unlock(&pool.job_lock);
+}
+
+static void child_after_fork() {
+  // only the forking thread exists in the child, the next job starts a
+  // fresh pool
+  if (pool.started) {
+    free(pool.threads);
+    free(pool.ranges);
+    pool.started = 0;
+  }
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.start, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  pthread_mutex_init(&pool.job_lock, NULL);
+}
+
+__attribute__((constructor)) static void register_fork_handlers() {
+  pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+}
+
+void set_num_threads(unsigned int num_threads) {
+  pthread_mutex_lock(&pool.job_lock);
+  stop_pool();
+  pool.requested_threads = num_threads;
+  pthread_mutex_unlock(&pool.job_lock);
+}
+
+unsigned int get_num_threads() {
+  pthread_mutex_lock(&pool.job_lock);
+  if (!pool.started) {
+    start_pool();
+  }
+  unsigned int num_threads = pool.num_threads;
+  pthread_mutex_unlock(&pool.job_lock);
+  return num_threads;
+}
+
+void parallel_for(
+  unsigned int count, unsigned int grain, parallel_task task, void* context
+) {
+  if (count == 0) {
+    return;
+  }
+  if (grain == 0) {
+    grain = 1;
+  }
+  // small jobs, nested calls and calls while another job is running stay
+  // on the calling thread
+  if (count <= grain || in_parallel_task
+    || pthread_mutex_trylock(&pool.job_lock)) {
+    task(context, 0, count);
+    return;
+  }
+  if (!pool.started) {
+    start_pool();
+  }
+  unsigned int num_threads = pool.num_threads;
+  if (num_threads == 1) {
+    pthread_mutex_unlock(&pool.job_lock);
+    task(context, 0, count);
+    return;
+  }
+  // split evenly, stealing evens out whatever imbalance is left
+  for (unsigned int t = 0; t < num_threads; t++) {
+    unsigned int begin = (unsigned int)((uint64_t)count * t / num_threads);
+    unsigned int end = (unsigned int)((uint64_t)count * (t+1) / num_threads);
+    atomic_store(&pool.ranges[t].range, pack_range(begin, end));
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.task = task;
+  pool.context = context;
+  pool.grain = grain;
+  pool.finished = 0;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+  run_participant(0, task, context, grain);
+  pthread_mutex_lock(&pool.lock);
+  while (pool.finished < num_threads - 1) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  pthread_mutex_unlock(&pool.job_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// work-stealing thread pool shared by the matrix and network code
+
+typedef void (*parallel_task)(
+  void* context, unsigned int begin, unsigned int end
+);
+
+// 0 uses one thread per online CPU, 1 keeps everything on the caller
+void set_num_threads(unsigned int num_threads);
+
+unsigned int get_num_threads();
+
+// runs task over [0, count) in chunks of at least grain items, the caller
+// takes part and returns once every chunk has finished
+void parallel_for(
+  unsigned int count, unsigned int grain, parallel_task task, void* context
+);
+
+#endif
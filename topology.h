@@ -0,0 +1,37 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include "network.h"
+
+// the network passes specialized for the one topology the library was
+// built for (make TOPOLOGY=10,10), generated into the build directory by
+// specialize.c
+//
+// every layer size, stride and loop bound is a constant and small layers
+// are fully unrolled; shapes are checked once by topology_matches()
+// instead of on every call. Every sum is taken in the order the generic
+// functions use, so the results are the same to the last bit.
+
+extern const unsigned int topology_num_layers;
+extern const unsigned int topology_num_nodes[];
+
+// 1 when net has the built topology and is either an inference network
+// or a training network with a batch of one sample that keeps every
+// activation, which the functions below then accept without further
+// checks
+int topology_matches(Network* net);
+
+// forward_pass() of one sample
+void topology_forward_pass(
+  Network* net, double* input, double* target_output
+);
+
+// compute_gradients() of the last topology_forward_pass() or
+// forward_pass(), calling the gradient ready hook the same way; the
+// delta of layer 0 is not computed since its parameters are never trained
+void topology_compute_gradients(Network* net);
+
+// predict() on the network's ping-pong buffers
+void topology_predict(Network* net, double* input, double* output);
+
+#endif